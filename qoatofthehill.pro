@@ -14,10 +14,18 @@ INCLUDEPATH += src_gameenabler
 INCLUDEPATH += src
 
 SOURCES += \
+    src/CompressedImage.cpp \
+    src/GameAssetLoader.cpp \
+    src/GameGLState.cpp \
+    src/GameJobPool.cpp \
     src/GameLevel.cpp \
     src/GameMenu.cpp \
     src/GameObject.cpp \
     src/GamePlayer.cpp \
+    src/GameProgram.cpp \
+    src/GameProgramCache.cpp \
+    src/GameRandom.cpp \
+    src/GameSpriteBatch.cpp \
     src/ParticleEngine.cpp \
     src/TextureManager.cpp \
     src_gameenabler/GameInstance.cpp \
@@ -26,10 +34,18 @@ SOURCES += \
     src_gameenabler/mygamewindoweventfilter.cpp
 
 HEADERS  += \
+    src/CompressedImage.h \
+    src/GameAssetLoader.h \
+    src/GameGLState.h \
+    src/GameJobPool.h \
     src/GameLevel.h \
     src/GameMenu.h \
     src/GameObject.h \
     src/GamePlayer.h \
+    src/GameProgram.h \
+    src/GameProgramCache.h \
+    src/GameRandom.h \
+    src/GameSpriteBatch.h \
     src/ParticleEngine.h \
     src/TextureManager.h \
     src_gameenabler/GameInstance.h \
@@ -41,6 +57,11 @@ OTHER_FILES +=
 RESOURCES += \
     images/images.qrc \
     sounds/sounds.qrc
+
+# GPU compressed textures made with tools/compress_textures.sh
+exists(images/compressed/compressed.qrc) {
+    RESOURCES += images/compressed/compressed.qrc
+}
     
 CONFIG += mobility
 
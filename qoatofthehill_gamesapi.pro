@@ -14,10 +14,18 @@ INCLUDEPATH += \
     src_gamesapi
 
 SOURCES += \
+    src/CompressedImage.cpp \
+    src/GameAssetLoader.cpp \
+    src/GameGLState.cpp \
+    src/GameJobPool.cpp \
     src/GameLevel.cpp \
     src/GameMenu.cpp \
     src/GameObject.cpp \
     src/GamePlayer.cpp \
+    src/GameProgram.cpp \
+    src/GameProgramCache.cpp \
+    src/GameRandom.cpp \
+    src/GameSpriteBatch.cpp \
     src/ParticleEngine.cpp \
     src/TextureManager.cpp \
     src_gamesapi/GameInstance.cpp \
@@ -28,9 +36,17 @@ SOURCES += \
 
 HEADERS  += \
     src/GameMenu.h \
+    src/CompressedImage.h \
+    src/GameAssetLoader.h \
+    src/GameGLState.h \
+    src/GameJobPool.h \
     src/GameLevel.h \
     src/GameObject.h \
     src/GamePlayer.h \
+    src/GameProgram.h \
+    src/GameProgramCache.h \
+    src/GameRandom.h \
+    src/GameSpriteBatch.h \
     src/ParticleEngine.h \
     src/TextureManager.h \
     src_gamesapi/GameInstance.h \
@@ -42,6 +58,11 @@ RESOURCES += \
     images/images.qrc \
     sounds/sounds.qrc
 
+# GPU compressed textures made with tools/compress_textures.sh
+exists(images/compressed/compressed.qrc) {
+    RESOURCES += images/compressed/compressed.qrc
+}
+
 # Uncomment the following for Qt GameEnabler's debug prints.
 #DEFINES += GE_DEBUG
 
@@ -0,0 +1,240 @@
+/**
+ * Copyright (c) 2011-2014 Microsoft Mobile.
+ */
+
+#include "CompressedImage.h"
+
+#include <QFile>
+#include <string.h>
+
+#include "trace.h"
+
+// Sizes of the file headers
+#define KTX_HEADER_SIZE 64
+#define PKM_HEADER_SIZE 16
+
+
+/*!
+  Returns the 32 bit value at \a p, in the opposite byte order if \a swap
+  is true.
+*/
+static GLuint readUInt32(const char *p, bool swap)
+{
+    GLuint value;
+    memcpy(&value, p, sizeof(value));
+
+    if (swap) {
+        value = (value >> 24) | ((value >> 8) & 0xff00)
+                | ((value << 8) & 0xff0000) | (value << 24);
+    }
+
+    return value;
+}
+
+
+/*!
+  Returns the big endian 16 bit value at \a p.
+*/
+static int readBigEndian16(const char *p)
+{
+    return ((uchar)p[0] << 8) | (uchar)p[1];
+}
+
+
+/*!
+  \class CompressedImage
+  \brief An image in a GPU compressed format read from a KTX or a PKM file.
+
+  The file is read and parsed with load(), which doesn't touch GL and can
+  be called in any thread. upload() then hands the levels to
+  glCompressedTexImage2D as they are in the file. A KTX file carries the
+  GL format of the image and may carry its mipmap levels, a PKM file holds
+  a single ETC1 level.
+*/
+
+
+/*!
+  Constructor.
+*/
+CompressedImage::CompressedImage()
+    : m_format(0),
+      m_width(0),
+      m_height(0),
+      m_levelCount(0)
+{
+}
+
+
+/*!
+  Destructor.
+*/
+CompressedImage::~CompressedImage()
+{
+}
+
+
+/*!
+  Reads the KTX or the PKM file \a fileName. Returns false if the file
+  can't be read or isn't a 2D image in a compressed format.
+*/
+bool CompressedImage::load(const QString &fileName)
+{
+    m_levelCount = 0;
+
+    QFile file(fileName);
+
+    if (!file.open(QIODevice::ReadOnly)) {
+        DEBUG_INFO("Failed to open a compressed image");
+        return false;
+    }
+
+    m_data = file.readAll();
+    file.close();
+
+    bool ok;
+
+    if (m_data.size() >= PKM_HEADER_SIZE
+            && memcmp(m_data.constData(), "PKM ", 4) == 0)
+        ok = parsePKM();
+    else
+        ok = parseKTX();
+
+    if (!ok) {
+        DEBUG_INFO("Unsupported compressed image");
+        m_data.clear();
+        m_levelCount = 0;
+    }
+
+    return ok;
+}
+
+
+/*!
+  Parses the KTX file in m_data. See the KTX specification of the Khronos
+  Group for the layout.
+*/
+bool CompressedImage::parseKTX()
+{
+    static const char identifier[12] = {
+        (char)0xAB, 'K', 'T', 'X', ' ', '1', '1', (char)0xBB,
+        '\r', '\n', (char)0x1A, '\n'
+    };
+
+    if (m_data.size() < KTX_HEADER_SIZE
+            || memcmp(m_data.constData(), identifier, 12) != 0)
+        return false;
+
+    const char *header = m_data.constData() + 12;
+    bool swap = readUInt32(header, false) != 0x04030201;
+    GLuint field[12];
+
+    for (int f = 0; f < 12; f++)
+        field[f] = readUInt32(header + (f + 1) * 4, swap);
+
+    // glType, glInternalFormat, pixelWidth, pixelHeight, pixelDepth,
+    // numberOfArrayElements, numberOfFaces, numberOfMipmapLevels and
+    // bytesOfKeyValueData
+    if (field[0] != 0 || field[7] != 0 || field[8] != 0 || field[9] != 1)
+        return false;
+
+    m_format = field[3];
+    m_width = field[5];
+    m_height = field[6];
+
+    // The sizes and offsets come from the file, so they are checked against
+    // the remaining data without adding anything to them first
+    qint64 dataSize = m_data.size();
+
+    if ((qint64)field[11] > dataSize - KTX_HEADER_SIZE)
+        return false;
+
+    quint32 levels = field[10] > 0 ? field[10] : 1;
+    qint64 offset = KTX_HEADER_SIZE + (qint64)field[11];
+
+    if (levels > COMPRESSED_IMAGE_MAX_LEVELS)
+        levels = COMPRESSED_IMAGE_MAX_LEVELS;
+
+    for (quint32 f = 0; f < levels; f++) {
+        if (dataSize - offset < 4)
+            return false;
+
+        quint32 size = readUInt32(m_data.constData() + offset, swap);
+        offset += 4;
+
+        if (size == 0 || size > dataSize - offset)
+            return false;
+
+        m_levelOffset[f] = (int)offset;
+        m_levelSize[f] = (int)size;
+        m_levelCount++;
+
+        // The levels are aligned to four bytes
+        offset += (size + 3) & ~3;
+    }
+
+    return true;
+}
+
+
+/*!
+  Parses the PKM file in m_data, an ETC1 image written by the etc1tool of
+  the Android SDK or by etcpack.
+*/
+bool CompressedImage::parsePKM()
+{
+    const char *header = m_data.constData();
+
+    // Format 0 is ETC1 RGB without mipmaps
+    if (readBigEndian16(header + 6) != 0)
+        return false;
+
+    int blocksX = (readBigEndian16(header + 8) + 3) / 4;
+    int blocksY = (readBigEndian16(header + 10) + 3) / 4;
+    qint64 size = (qint64)blocksX * blocksY * 8;
+
+    if (size > m_data.size() - PKM_HEADER_SIZE)
+        return false;
+
+    m_format = GL_ETC1_RGB8_OES;
+    m_width = readBigEndian16(header + 12);
+    m_height = readBigEndian16(header + 14);
+    m_levelOffset[0] = PKM_HEADER_SIZE;
+    m_levelSize[0] = (int)size;
+    m_levelCount = 1;
+
+    return true;
+}
+
+
+/*!
+  Uploads the levels of the image into \a texture. The texture is minified
+  through the mipmaps if \a mipmaps is true and the file holds all of them.
+*/
+void CompressedImage::upload(GLuint texture, bool mipmaps) const
+{
+    int w = m_width;
+    int h = m_height;
+
+    glBindTexture(GL_TEXTURE_2D, texture);
+
+    for (int f = 0; f < m_levelCount; f++) {
+        glCompressedTexImage2D(GL_TEXTURE_2D, f, m_format, w, h, 0,
+                               m_levelSize[f],
+                               m_data.constData() + m_levelOffset[f]);
+
+        w = w > 1 ? w / 2 : 1;
+        h = h > 1 ? h / 2 : 1;
+    }
+
+    // All the levels down to 1x1 are needed for mipmapping
+    int last = m_levelCount - 1;
+    bool complete = m_levelCount > 1 && (m_width >> last) <= 1
+            && (m_height >> last) <= 1;
+
+    if (mipmaps && !complete)
+        DEBUG_INFO("No mipmaps in a compressed image");
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                    mipmaps && complete ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+}
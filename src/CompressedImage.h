@@ -0,0 +1,59 @@
+/**
+ * Copyright (c) 2011-2014 Microsoft Mobile.
+ */
+
+#ifndef COMPRESSEDIMAGE_H
+#define COMPRESSEDIMAGE_H
+
+#include <GLES2/gl2.h>
+#include <QByteArray>
+#include <QString>
+
+// Compressed formats of GL_OES_compressed_ETC1_RGB8_texture and
+// GL_IMG_texture_compression_pvrtc
+#ifndef GL_ETC1_RGB8_OES
+#define GL_ETC1_RGB8_OES 0x8D64
+#endif
+
+#ifndef GL_COMPRESSED_RGB_PVRTC_4BPPV1_IMG
+#define GL_COMPRESSED_RGB_PVRTC_4BPPV1_IMG 0x8C00
+#define GL_COMPRESSED_RGB_PVRTC_2BPPV1_IMG 0x8C01
+#define GL_COMPRESSED_RGBA_PVRTC_4BPPV1_IMG 0x8C02
+#define GL_COMPRESSED_RGBA_PVRTC_2BPPV1_IMG 0x8C03
+#endif
+
+// Maximum number of mipmap levels read from a file
+#define COMPRESSED_IMAGE_MAX_LEVELS 16
+
+
+class CompressedImage
+{
+public:
+    CompressedImage();
+    ~CompressedImage();
+
+public:
+    bool load(const QString &fileName);
+    void upload(GLuint texture, bool mipmaps) const;
+
+    inline bool isNull() const { return m_levelCount == 0; }
+    inline GLenum format() const { return m_format; }
+    inline int width() const { return m_width; }
+    inline int height() const { return m_height; }
+    inline int levelCount() const { return m_levelCount; }
+
+protected:
+    bool parseKTX();
+    bool parsePKM();
+
+protected: // Data
+    QByteArray m_data; // The whole file, the levels point into it
+    GLenum m_format;
+    int m_width;
+    int m_height;
+    int m_levelCount;
+    int m_levelOffset[COMPRESSED_IMAGE_MAX_LEVELS];
+    int m_levelSize[COMPRESSED_IMAGE_MAX_LEVELS];
+};
+
+#endif // COMPRESSEDIMAGE_H
@@ -0,0 +1,197 @@
+/**
+ * Copyright (c) 2011-2014 Microsoft Mobile.
+ */
+
+#include "GameAssetLoader.h"
+
+
+/*!
+  \class GameAssetWorker
+  \brief Loader thread of a GameAssetLoader.
+*/
+
+
+/*!
+  Constructor.
+*/
+GameAssetWorker::GameAssetWorker(GameAssetLoader *loader)
+    : QThread(),
+      m_loader(loader)
+{
+}
+
+
+/*!
+  From QThread.
+*/
+void GameAssetWorker::run()
+{
+    m_loader->workerLoop();
+}
+
+
+/*!
+  \class GameAssetLoader
+  \brief Loads assets in background threads while the game keeps running.
+
+  The assets are loaded in the order they are added. The thread owning the
+  GL context calls dispatch() regularly, e.g. once per frame, to finish the
+  assets loaded so far.
+*/
+
+
+/*!
+  Constructor. \a threadCount is the number of loader threads, zero means
+  one per processor core up to ASSET_LOADER_MAX_THREADS.
+*/
+GameAssetLoader::GameAssetLoader(int threadCount)
+    : m_pending(0),
+      m_quit(false),
+      m_workers(0),
+      m_workerCount(0)
+{
+    if (threadCount <= 0) {
+        threadCount = QThread::idealThreadCount();
+
+        if (threadCount > ASSET_LOADER_MAX_THREADS)
+            threadCount = ASSET_LOADER_MAX_THREADS;
+    }
+
+    m_workerCount = threadCount < 1 ? 1 : threadCount;
+    m_workers = new GameAssetWorker*[m_workerCount];
+
+    for (int f = 0; f < m_workerCount; f++) {
+        m_workers[f] = new GameAssetWorker(this);
+        m_workers[f]->start(QThread::LowPriority);
+    }
+}
+
+
+/*!
+  Destructor. Stops the loader threads and drops the assets not finished.
+*/
+GameAssetLoader::~GameAssetLoader()
+{
+    m_mutex.lock();
+    m_quit = true;
+    m_assetAdded.wakeAll();
+    m_mutex.unlock();
+
+    for (int f = 0; f < m_workerCount; f++) {
+        m_workers[f]->wait();
+        delete m_workers[f];
+    }
+
+    delete [] m_workers;
+
+    while (!m_queue.isEmpty())
+        delete m_queue.takeFirst();
+
+    while (!m_loaded.isEmpty())
+        delete m_loaded.takeFirst();
+}
+
+
+/*!
+  Queues \a asset to be loaded. The loader takes the ownership of the
+  asset and deletes it after it has been finished.
+*/
+void GameAssetLoader::add(GameAsset *asset)
+{
+    m_mutex.lock();
+    m_queue.append(asset);
+    m_pending++;
+    m_assetAdded.wakeOne();
+    m_mutex.unlock();
+}
+
+
+/*!
+  Finishes at most \a maxCount of the assets loaded so far, all of them if
+  \a maxCount is negative. Must be called in the thread owning the GL
+  context. Returns the number of assets finished.
+*/
+int GameAssetLoader::dispatch(int maxCount)
+{
+    int finished = 0;
+
+    while (maxCount < 0 || finished < maxCount) {
+        m_mutex.lock();
+
+        if (m_loaded.isEmpty()) {
+            m_mutex.unlock();
+            break;
+        }
+
+        GameAsset *asset = m_loaded.takeFirst();
+        m_mutex.unlock();
+
+        asset->finish();
+        delete asset;
+        finished++;
+
+        m_mutex.lock();
+        m_pending--;
+        m_mutex.unlock();
+    }
+
+    return finished;
+}
+
+
+/*!
+  Waits for all the assets added so far to be loaded and finishes them.
+  Must be called in the thread owning the GL context.
+*/
+void GameAssetLoader::finishAll()
+{
+    m_mutex.lock();
+
+    while (m_pending > 0) {
+        while (m_loaded.isEmpty())
+            m_assetLoaded.wait(&m_mutex);
+
+        m_mutex.unlock();
+        dispatch();
+        m_mutex.lock();
+    }
+
+    m_mutex.unlock();
+}
+
+
+/*!
+  Returns the number of the assets added but not yet finished.
+*/
+int GameAssetLoader::pendingCount()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_pending;
+}
+
+
+/*!
+  Loads the queued assets until the loader is destroyed.
+*/
+void GameAssetLoader::workerLoop()
+{
+    m_mutex.lock();
+
+    while (true) {
+        while (!m_quit && m_queue.isEmpty())
+            m_assetAdded.wait(&m_mutex);
+
+        if (m_quit)
+            break;
+
+        GameAsset *asset = m_queue.takeFirst();
+        m_mutex.unlock();
+        asset->load();
+        m_mutex.lock();
+
+        m_loaded.append(asset);
+        m_assetLoaded.wakeAll();
+    }
+
+    m_mutex.unlock();
+}
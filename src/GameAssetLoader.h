@@ -0,0 +1,76 @@
+/**
+ * Copyright (c) 2011-2014 Microsoft Mobile.
+ */
+
+#ifndef GAMEASSETLOADER_H
+#define GAMEASSETLOADER_H
+
+#include <QList>
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+
+class GameAssetLoader;
+
+// Maximum number of loader threads; decoding is mostly bound by the flash
+#define ASSET_LOADER_MAX_THREADS 2
+
+
+/*!
+  An asset loaded in two steps: decoded in a loader thread and then
+  finished, e.g. uploaded to GL, in the thread owning the GL context.
+*/
+class GameAsset
+{
+public:
+    virtual ~GameAsset() {}
+    virtual void load() = 0;
+    virtual void finish() = 0;
+};
+
+
+class GameAssetWorker : public QThread
+{
+public:
+    GameAssetWorker(GameAssetLoader *loader);
+
+protected:
+    void run();
+
+protected: // Data
+    GameAssetLoader *m_loader; // Not owned
+};
+
+
+class GameAssetLoader
+{
+public:
+    GameAssetLoader(int threadCount = 0);
+    virtual ~GameAssetLoader();
+
+public:
+    void add(GameAsset *asset);
+    int dispatch(int maxCount = -1);
+    void finishAll();
+
+    // Assets added but not yet finished
+    int pendingCount();
+
+protected:
+    void workerLoop();
+
+protected: // Data
+    QMutex m_mutex;
+    QWaitCondition m_assetAdded;
+    QWaitCondition m_assetLoaded;
+    QList<GameAsset*> m_queue; // Owned, waiting to be loaded
+    QList<GameAsset*> m_loaded; // Owned, waiting to be finished
+    int m_pending;
+    bool m_quit;
+    GameAssetWorker **m_workers; // Owned
+    int m_workerCount;
+
+    friend class GameAssetWorker;
+};
+
+#endif // GAMEASSETLOADER_H
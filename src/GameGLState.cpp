@@ -0,0 +1,246 @@
+/**
+ * Copyright (c) 2011-2014 Microsoft Mobile.
+ */
+
+#include "GameGLState.h"
+#include "GameProgram.h"
+
+#ifdef QOTH_COUNT_GL_CALLS
+int GameGLState::s_callCount = 0;
+#endif
+
+
+/*!
+  \class GameGLState
+  \brief Cache of the GL state the renderers change. A state change is
+  passed to GL only when it differs from the cached value.
+
+  The cache assumes that all state changes during a frame go through it.
+  Code changing the state directly, like texture and buffer creation, must
+  call invalidate() afterwards unless it happens between frames.
+*/
+
+
+/*!
+  Constructor.
+*/
+GameGLState::GameGLState()
+    : m_issuedCount(0),
+      m_filteredCount(0)
+{
+    invalidate();
+}
+
+
+/*!
+  Forgets the cached state, so that the next change of each state is
+  passed to GL.
+*/
+void GameGLState::invalidate()
+{
+    for (int f = 0; f < 3; f++) {
+        m_enabled[f] = false;
+        m_enabledKnown[f] = false;
+    }
+
+    m_depthMask = false;
+    m_depthMaskKnown = false;
+    m_blendSource = 0;
+    m_blendDestination = 0;
+    m_blendKnown = false;
+    m_texture = 0;
+    m_textureKnown = false;
+    m_arrayBuffer = 0;
+    m_arrayBufferKnown = false;
+    m_elementBuffer = 0;
+    m_elementBufferKnown = false;
+    m_program = 0;
+    m_programKnown = false;
+    m_attribArrays = 0;
+    m_attribArraysKnown = 0;
+}
+
+
+/*!
+  Starts a new frame. Resets the counters and the cache, since the state
+  may have been changed between the frames.
+*/
+void GameGLState::beginFrame()
+{
+    invalidate();
+    m_issuedCount = 0;
+    m_filteredCount = 0;
+
+#ifdef QOTH_COUNT_GL_CALLS
+    s_callCount = 0;
+#endif
+}
+
+
+/*!
+  Returns the cache index of \a capability or -1 if it is not cached.
+*/
+int GameGLState::capabilityIndex(GLenum capability) const
+{
+    switch (capability) {
+    case GL_BLEND:
+        return 0;
+    case GL_DEPTH_TEST:
+        return 1;
+    case GL_CULL_FACE:
+        return 2;
+    default:
+        return -1;
+    }
+}
+
+
+/*!
+  Enables or disables \a capability.
+*/
+void GameGLState::setEnabled(GLenum capability, bool enabled)
+{
+    int index = capabilityIndex(capability);
+
+    if (index >= 0) {
+        if (m_enabledKnown[index] && m_enabled[index] == enabled) {
+            m_filteredCount++;
+            return;
+        }
+
+        m_enabled[index] = enabled;
+        m_enabledKnown[index] = true;
+    }
+
+    if (enabled)
+        glEnable(capability);
+    else
+        glDisable(capability);
+
+    m_issuedCount++;
+}
+
+
+/*!
+  Enables or disables writing into the depth buffer.
+*/
+void GameGLState::depthMask(bool enabled)
+{
+    if (m_depthMaskKnown && m_depthMask == enabled) {
+        m_filteredCount++;
+        return;
+    }
+
+    m_depthMask = enabled;
+    m_depthMaskKnown = true;
+    glDepthMask(enabled ? GL_TRUE : GL_FALSE);
+    m_issuedCount++;
+}
+
+
+/*!
+  Sets the blending function.
+*/
+void GameGLState::blendFunc(GLenum source, GLenum destination)
+{
+    if (m_blendKnown && m_blendSource == source
+            && m_blendDestination == destination) {
+        m_filteredCount++;
+        return;
+    }
+
+    m_blendSource = source;
+    m_blendDestination = destination;
+    m_blendKnown = true;
+    glBlendFunc(source, destination);
+    m_issuedCount++;
+}
+
+
+/*!
+  Binds \a texture as the 2D texture of the first texture unit.
+*/
+void GameGLState::bindTexture(GLuint texture)
+{
+    if (m_textureKnown && m_texture == texture) {
+        m_filteredCount++;
+        return;
+    }
+
+    m_texture = texture;
+    m_textureKnown = true;
+    glBindTexture(GL_TEXTURE_2D, texture);
+    m_issuedCount++;
+}
+
+
+/*!
+  Binds \a buffer into \a target, GL_ARRAY_BUFFER or
+  GL_ELEMENT_ARRAY_BUFFER.
+*/
+void GameGLState::bindBuffer(GLenum target, GLuint buffer)
+{
+    GLuint *current = &m_arrayBuffer;
+    bool *known = &m_arrayBufferKnown;
+
+    if (target == GL_ELEMENT_ARRAY_BUFFER) {
+        current = &m_elementBuffer;
+        known = &m_elementBufferKnown;
+    }
+
+    if (*known && *current == buffer) {
+        m_filteredCount++;
+        return;
+    }
+
+    *current = buffer;
+    *known = true;
+    glBindBuffer(target, buffer);
+    m_issuedCount++;
+}
+
+
+/*!
+  Makes \a program the current program.
+*/
+void GameGLState::useProgram(const GameProgram &program)
+{
+    if (m_programKnown && m_program == program.program()) {
+        m_filteredCount++;
+        return;
+    }
+
+    m_program = program.program();
+    m_programKnown = true;
+    glUseProgram(m_program);
+    m_issuedCount++;
+}
+
+
+/*!
+  Enables the vertex attribute arrays with their bit set in \a mask and
+  disables the rest.
+*/
+void GameGLState::setVertexAttribArrays(unsigned int mask)
+{
+    unsigned int bit;
+
+    for (int f = 0; f < GL_STATE_MAX_ATTRIBS; f++) {
+        bit = 1u << f;
+
+        if ((m_attribArraysKnown & bit)
+                && (m_attribArrays & bit) == (mask & bit)) {
+            m_filteredCount++;
+            continue;
+        }
+
+        if (mask & bit)
+            glEnableVertexAttribArray(f);
+        else
+            glDisableVertexAttribArray(f);
+
+        m_attribArrays = (m_attribArrays & ~bit) | (mask & bit);
+        m_attribArraysKnown |= bit;
+        m_issuedCount++;
+    }
+}
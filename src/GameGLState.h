@@ -0,0 +1,104 @@
+/**
+ * Copyright (c) 2011-2014 Microsoft Mobile.
+ */
+
+#ifndef GAMEGLSTATE_H
+#define GAMEGLSTATE_H
+
+#include <GLES2/gl2.h>
+
+class GameProgram;
+
+// Number of vertex attribute arrays tracked by GameGLState
+#define GL_STATE_MAX_ATTRIBS 8
+
+
+class GameGLState
+{
+public:
+    GameGLState();
+
+public:
+    void invalidate();
+    void beginFrame();
+
+    void setEnabled(GLenum capability, bool enabled);
+    inline void enable(GLenum capability) { setEnabled(capability, true); }
+    inline void disable(GLenum capability) { setEnabled(capability, false); }
+    void depthMask(bool enabled);
+    void blendFunc(GLenum source, GLenum destination);
+    void bindTexture(GLuint texture);
+    void bindBuffer(GLenum target, GLuint buffer);
+    void useProgram(const GameProgram &program);
+    void setVertexAttribArrays(unsigned int mask);
+
+    // State changes issued and filtered since beginFrame()
+    inline int issuedCount() const { return m_issuedCount; }
+    inline int filteredCount() const { return m_filteredCount; }
+
+#ifdef QOTH_COUNT_GL_CALLS
+    // All GL calls since beginFrame() in the sources including this header
+    static int s_callCount;
+#endif
+
+protected:
+    int capabilityIndex(GLenum capability) const;
+
+protected: // Data
+    // Cached values, valid only when the matching m_*Known flag is set
+    bool m_enabled[3];
+    bool m_enabledKnown[3];
+    bool m_depthMask;
+    bool m_depthMaskKnown;
+    GLenum m_blendSource;
+    GLenum m_blendDestination;
+    bool m_blendKnown;
+    GLuint m_texture;
+    bool m_textureKnown;
+    GLuint m_arrayBuffer;
+    bool m_arrayBufferKnown;
+    GLuint m_elementBuffer;
+    bool m_elementBufferKnown;
+    GLuint m_program;
+    bool m_programKnown;
+    unsigned int m_attribArrays;
+    unsigned int m_attribArraysKnown;
+
+    int m_issuedCount;
+    int m_filteredCount;
+};
+
+
+#ifdef QOTH_COUNT_GL_CALLS
+// Count the GL calls made in the sources including this header.
+#define GL_STATE_COUNT(call) (GameGLState::s_callCount++, call)
+#define glBindBuffer(a, b) GL_STATE_COUNT(glBindBuffer(a, b))
+#define glBindTexture(a, b) GL_STATE_COUNT(glBindTexture(a, b))
+#define glBlendFunc(a, b) GL_STATE_COUNT(glBlendFunc(a, b))
+#define glBufferData(a, b, c, d) GL_STATE_COUNT(glBufferData(a, b, c, d))
+#define glBufferSubData(a, b, c, d) GL_STATE_COUNT(glBufferSubData(a, b, c, d))
+#define glClear(a) GL_STATE_COUNT(glClear(a))
+#define glClearColor(a, b, c, d) GL_STATE_COUNT(glClearColor(a, b, c, d))
+#define glDepthMask(a) GL_STATE_COUNT(glDepthMask(a))
+#define glDisable(a) GL_STATE_COUNT(glDisable(a))
+#define glDisableVertexAttribArray(a) \
+    GL_STATE_COUNT(glDisableVertexAttribArray(a))
+#define glDrawArrays(a, b, c) GL_STATE_COUNT(glDrawArrays(a, b, c))
+#define glDrawElements(a, b, c, d) GL_STATE_COUNT(glDrawElements(a, b, c, d))
+#define glEnable(a) GL_STATE_COUNT(glEnable(a))
+#define glEnableVertexAttribArray(a) \
+    GL_STATE_COUNT(glEnableVertexAttribArray(a))
+#define glGetUniformLocation(a, b) GL_STATE_COUNT(glGetUniformLocation(a, b))
+#define glUniform1f(a, b) GL_STATE_COUNT(glUniform1f(a, b))
+#define glUniform1i(a, b) GL_STATE_COUNT(glUniform1i(a, b))
+#define glUniform3f(a, b, c, d) GL_STATE_COUNT(glUniform3f(a, b, c, d))
+#define glUniform4f(a, b, c, d, e) GL_STATE_COUNT(glUniform4f(a, b, c, d, e))
+#define glUniform4fv(a, b, c) GL_STATE_COUNT(glUniform4fv(a, b, c))
+#define glUniformMatrix4fv(a, b, c, d) \
+    GL_STATE_COUNT(glUniformMatrix4fv(a, b, c, d))
+#define glUseProgram(a) GL_STATE_COUNT(glUseProgram(a))
+#define glVertexAttribPointer(a, b, c, d, e, f) \
+    GL_STATE_COUNT(glVertexAttribPointer(a, b, c, d, e, f))
+#endif
+
+#endif // GAMEGLSTATE_H
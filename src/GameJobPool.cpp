@@ -0,0 +1,160 @@
+/**
+ * Copyright (c) 2011-2014 Microsoft Mobile.
+ */
+
+#include "GameJobPool.h"
+
+
+/*!
+  \class GameJobWorker
+  \brief Worker thread of a GameJobPool.
+*/
+
+
+/*!
+  Constructor.
+*/
+GameJobWorker::GameJobWorker(GameJobPool *pool)
+    : QThread(),
+      m_pool(pool)
+{
+}
+
+
+/*!
+  From QThread.
+*/
+void GameJobWorker::run()
+{
+    m_pool->workerLoop();
+}
+
+
+/*!
+  \class GameJobPool
+  \brief Small pool of threads for splitting the per frame work. The calling
+  thread takes part in running the jobs, so a single core device gets no
+  extra threads at all.
+*/
+
+
+/*!
+  Constructor. \a threadCount is the number of threads to run the jobs
+  with, zero means one per processor core.
+*/
+GameJobPool::GameJobPool(int threadCount)
+    : m_job(0),
+      m_jobCount(0),
+      m_nextJob(0),
+      m_finishedJobs(0),
+      m_quit(false),
+      m_workers(0),
+      m_workerCount(0)
+{
+    if (threadCount <= 0)
+        threadCount = QThread::idealThreadCount();
+
+    m_workerCount = threadCount - 1;
+
+    if (m_workerCount < 0)
+        m_workerCount = 0;
+
+    if (m_workerCount > 0) {
+        m_workers = new GameJobWorker*[m_workerCount];
+
+        for (int f = 0; f < m_workerCount; f++) {
+            m_workers[f] = new GameJobWorker(this);
+            m_workers[f]->start();
+        }
+    }
+}
+
+
+/*!
+  Destructor. Stops the worker threads.
+*/
+GameJobPool::~GameJobPool()
+{
+    m_mutex.lock();
+    m_quit = true;
+    m_jobAvailable.wakeAll();
+    m_mutex.unlock();
+
+    for (int f = 0; f < m_workerCount; f++) {
+        m_workers[f]->wait();
+        delete m_workers[f];
+    }
+
+    delete [] m_workers;
+}
+
+
+/*!
+  Calls \a job's run() with each index in range [0, \a count) spread over
+  the threads of the pool. Returns when all of them are finished.
+*/
+void GameJobPool::run(GameJob *job, int count)
+{
+    if (count <= 0)
+        return;
+
+    if (m_workerCount == 0 || count == 1) {
+        for (int f = 0; f < count; f++)
+            job->run(f);
+
+        return;
+    }
+
+    int index;
+    m_mutex.lock();
+    m_job = job;
+    m_jobCount = count;
+    m_nextJob = 0;
+    m_finishedJobs = 0;
+    m_jobAvailable.wakeAll();
+
+    // Work along the workers.
+    while (m_nextJob < m_jobCount) {
+        index = m_nextJob++;
+        m_mutex.unlock();
+        job->run(index);
+        m_mutex.lock();
+        m_finishedJobs++;
+    }
+
+    while (m_finishedJobs < m_jobCount)
+        m_jobsFinished.wait(&m_mutex);
+
+    m_job = 0;
+    m_mutex.unlock();
+}
+
+
+/*!
+  Runs the jobs given to the pool until the pool is destroyed.
+*/
+void GameJobPool::workerLoop()
+{
+    GameJob *job;
+    int index;
+    m_mutex.lock();
+
+    while (true) {
+        while (!m_quit && (!m_job || m_nextJob >= m_jobCount))
+            m_jobAvailable.wait(&m_mutex);
+
+        if (m_quit)
+            break;
+
+        job = m_job;
+        index = m_nextJob++;
+        m_mutex.unlock();
+        job->run(index);
+        m_mutex.lock();
+
+        if (++m_finishedJobs == m_jobCount)
+            m_jobsFinished.wakeAll();
+    }
+
+    m_mutex.unlock();
+}
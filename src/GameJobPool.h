@@ -0,0 +1,68 @@
+/**
+ * Copyright (c) 2011-2014 Microsoft Mobile.
+ */
+
+#ifndef GAMEJOBPOOL_H
+#define GAMEJOBPOOL_H
+
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+
+class GameJobPool;
+
+
+/*!
+  Work split into independent parts which GameJobPool runs in parallel.
+*/
+class GameJob
+{
+public:
+    virtual ~GameJob() {}
+    virtual void run(int index) = 0;
+};
+
+
+class GameJobWorker : public QThread
+{
+public:
+    GameJobWorker(GameJobPool *pool);
+
+protected:
+    void run();
+
+protected: // Data
+    GameJobPool *m_pool; // Not owned
+};
+
+
+class GameJobPool
+{
+public:
+    GameJobPool(int threadCount = 0);
+    virtual ~GameJobPool();
+
+public:
+    // Number of threads running the jobs, including the calling thread
+    inline int threadCount() const { return m_workerCount + 1; }
+    void run(GameJob *job, int count);
+
+protected:
+    void workerLoop();
+
+protected: // Data
+    QMutex m_mutex;
+    QWaitCondition m_jobAvailable;
+    QWaitCondition m_jobsFinished;
+    GameJob *m_job; // Not owned
+    int m_jobCount;
+    int m_nextJob;
+    int m_finishedJobs;
+    bool m_quit;
+    GameJobWorker **m_workers; // Owned
+    int m_workerCount;
+
+    friend class GameJobWorker;
+};
+
+#endif // GAMEJOBPOOL_H
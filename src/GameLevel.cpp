@@ -4,14 +4,42 @@
 
 #include "GameLevel.h"
 
+#include <QFile>
 #include <math.h>
+#include <stddef.h>
+#include <string.h>
 
+#ifdef QOTH_BENCHMARK_LEVEL
+#include <QDebug>
+#include <QElapsedTimer>
+#endif
+
+// Select the SIMD flavour of the vertex normal kernel. Define QOTH_NO_SIMD
+// to force the scalar version.
+#if !defined(QOTH_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) \
+    || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+    #define LEVEL_KERNEL_SSE2
+    #include <emmintrin.h>
+#elif !defined(QOTH_NO_SIMD) && (defined(__ARM_NEON__) || defined(__ARM_NEON))
+    #define LEVEL_KERNEL_NEON
+    #include <arm_neon.h>
+#endif
+
+#include "GameGLState.h"
 #include "GameInstance.h"
+#include "GameProgramCache.h"
+#include "GameRandom.h"
 #include "TextureManager.h"
 #include "trace.h"
 
 #define LEVEL_Y_MIN -12.0f
 
+// Fixed point steps per unit of the packed vertex attributes. The ground
+// vertex shader divides them out.
+#define LEVEL_UV_SCALE 512.0f
+#define LEVEL_COLOR_SCALE 25.0f
+#define LEVEL_NORMAL_SCALE 127.0f
+
 
 // Rock fragment shader
 const char* strRockFragmentShader =
@@ -79,7 +107,7 @@ const char* strGroundFragmentShader =
 
 const char* strGroundVertexShader =
 "attribute highp vec3 vertex;\n"
-"attribute mediump vec2 uv;\n"
+"attribute highp vec2 uv;\n"
 "attribute mediump vec4 vertexcolor;\n"
 "attribute mediump vec3 vertexnormal;\n"
 "uniform mediump mat4 transMatrix;\n"
@@ -90,185 +118,454 @@ const char* strGroundVertexShader =
 "void main(void)\n"
 "{\n"
 "mediump vec4 temppos = vec4(vertex,1.0)*transMatrix;\n"
-"texCoord = uv;\n"
+"texCoord = uv * (1.0 / 512.0);\n"
 "gl_Position = temppos * projMatrix;\n"
-"color = vertexcolor;\n"
-"mediump float l = clamp((vertexnormal.x + vertexnormal.y*0.4)*3.0, 0.25, 1.0);\n"
+"color = vertexcolor * (1.0 / 25.0);\n"
+"mediump vec3 normal = vertexnormal * (1.0 / 127.0);\n"
+"mediump float l = clamp((normal.x + normal.y*0.4)*3.0, 0.25, 1.0);\n"
 //"colormul = vec4(l, l, l, clamp(1.2+(vertex.y*0.2), 0.0, 1.0));\n"
-"lowp float rockamount = clamp(vertexcolor[3]*0.5, 0.0, 1.0);\n"
+"lowp float rockamount = clamp(color[3]*0.5, 0.0, 1.0);\n"
 "colormul = vec4(l, l, l, clamp(1.0+((vertex.y+10.0)*10.0*rockamount), 0.0, 1.0));\n"
 "}";
 
+static const char *groundAttributes[] = {
+    "vertex", "uv", "vertexcolor", "vertexnormal"
+};
+
+
+/*!
+  Returns \a value in fixed point with \a scale steps per unit, clamped to
+  the range of a short.
+*/
+static inline GLshort packShort(float value, float scale)
+{
+    return (GLshort)qBound(-32768.0f, floorf(value * scale + 0.5f), 32767.0f);
+}
+
+
+/*!
+  Returns \a value in fixed point with \a scale steps per unit, clamped to
+  the range of a byte.
+*/
+static inline GLbyte packByte(float value, float scale)
+{
+    return (GLbyte)qBound(-128.0f, floorf(value * scale + 0.5f), 127.0f);
+}
+
+
+/*!
+  Calculates the normals of \a count vertices on a row of the level grid
+  from central differences. \a y and \a z hold the coordinates of the row
+  starting from the column before the first vertex, \a yLow, \a zLow,
+  \a yHigh and \a zHigh those of the rows before and after it. \a dx is
+  the distance between the columns around a vertex. The normals are
+  written into \a nx, \a ny and \a nz.
+*/
+static void gridNormalKernel(const float *y, const float *z,
+                             const float *yLow, const float *zLow,
+                             const float *yHigh, const float *zHigh,
+                             float dx, int count,
+                             float *nx, float *ny, float *nz)
+{
+    int f = 0;
+
+    // The normal is the cross product of the tangent across the rows,
+    // (0, dyr, dzr), and the tangent along the columns, (dx, dyx, dzx).
+#if defined(LEVEL_KERNEL_SSE2)
+    __m128 vdx = _mm_set1_ps(dx);
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 zero = _mm_setzero_ps();
+
+    for (; f + 4 <= count; f += 4) {
+        __m128 dyx = _mm_sub_ps(_mm_loadu_ps(y + f + 2), _mm_loadu_ps(y + f));
+        __m128 dzx = _mm_sub_ps(_mm_loadu_ps(z + f + 2), _mm_loadu_ps(z + f));
+        __m128 dyr = _mm_sub_ps(_mm_loadu_ps(yHigh + f + 1),
+                                _mm_loadu_ps(yLow + f + 1));
+        __m128 dzr = _mm_sub_ps(_mm_loadu_ps(zHigh + f + 1),
+                                _mm_loadu_ps(zLow + f + 1));
+
+        __m128 x = _mm_sub_ps(_mm_mul_ps(dyr, dzx), _mm_mul_ps(dzr, dyx));
+        __m128 yy = _mm_mul_ps(dzr, vdx);
+        __m128 zz = _mm_sub_ps(zero, _mm_mul_ps(dyr, vdx));
+        __m128 il = _mm_div_ps(one, _mm_sqrt_ps(_mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(yy, yy)),
+                _mm_mul_ps(zz, zz))));
+
+        _mm_storeu_ps(nx + f, _mm_mul_ps(x, il));
+        _mm_storeu_ps(ny + f, _mm_mul_ps(yy, il));
+        _mm_storeu_ps(nz + f, _mm_mul_ps(zz, il));
+    }
+#elif defined(LEVEL_KERNEL_NEON)
+    float32x4_t vdx = vdupq_n_f32(dx);
+
+    for (; f + 4 <= count; f += 4) {
+        float32x4_t dyx = vsubq_f32(vld1q_f32(y + f + 2), vld1q_f32(y + f));
+        float32x4_t dzx = vsubq_f32(vld1q_f32(z + f + 2), vld1q_f32(z + f));
+        float32x4_t dyr = vsubq_f32(vld1q_f32(yHigh + f + 1),
+                                    vld1q_f32(yLow + f + 1));
+        float32x4_t dzr = vsubq_f32(vld1q_f32(zHigh + f + 1),
+                                    vld1q_f32(zLow + f + 1));
+
+        float32x4_t x = vmlsq_f32(vmulq_f32(dyr, dzx), dzr, dyx);
+        float32x4_t yy = vmulq_f32(dzr, vdx);
+        float32x4_t zz = vnegq_f32(vmulq_f32(dyr, vdx));
+        float32x4_t l2 = vmlaq_f32(vmlaq_f32(vmulq_f32(x, x), yy, yy), zz, zz);
+
+        // Reciprocal square root estimate refined with two Newton steps
+        float32x4_t il = vrsqrteq_f32(l2);
+        il = vmulq_f32(il, vrsqrtsq_f32(vmulq_f32(l2, il), il));
+        il = vmulq_f32(il, vrsqrtsq_f32(vmulq_f32(l2, il), il));
+
+        vst1q_f32(nx + f, vmulq_f32(x, il));
+        vst1q_f32(ny + f, vmulq_f32(yy, il));
+        vst1q_f32(nz + f, vmulq_f32(zz, il));
+    }
+#endif
+
+    for (; f < count; f++) {
+        float dyx = y[f + 2] - y[f];
+        float dzx = z[f + 2] - z[f];
+        float dyr = yHigh[f + 1] - yLow[f + 1];
+        float dzr = zHigh[f + 1] - zLow[f + 1];
+
+        float x = dyr * dzx - dzr * dyx;
+        float yy = dzr * dx;
+        float zz = -(dyr * dx);
+        float il = 1.0f / sqrtf(x * x + yy * yy + zz * zz);
+
+        nx[f] = x * il;
+        ny[f] = yy * il;
+        nz[f] = zz * il;
+    }
+}
+
 
 /*!
   \class GameLevel
   \brief -
+
+  The mesh of the level is split into chunks of GAME_LEVEL_CHUNK_COLUMNS
+  quads along the level, each with a vertex buffer of its own. Only the
+  chunks in the view are drawn and only the chunks changed by explosions
+  are updated. The chunks not updated for a while drop their copy of the
+  vertices, which are rebuilt from the column arrays when needed again.
 */
 
 
 /*!
-  Constructor.
+  Constructor. The level grid has \a columns columns.
 */
-GameLevel::GameLevel(GameInstance *gameInstance)
+GameLevel::GameLevel(GameInstance *gameInstance, int columns)
     : m_gameInstance(gameInstance),
-      m_vertices(0),
-      m_indices(0),
-      m_vertexCount(0),
-      m_indexCount(0),
-      m_forceUpdate(false)
+      m_columns(0),
+      m_columnWidth(0.0f),
+      m_seed(0),
+      m_columnData(0),
+      m_normalArray(0),
+      m_chunks(0),
+      m_chunkCount(0),
+      m_frame(0),
+      m_revision(0),
+      m_explosionCount(0)
 {
-    for (int f = 0; f < GAME_LEVEL_GRID_HEIGHT; f++) {
-        for (int g = 0; g < GAME_LEVEL_GRID_WIDTH; g++) {
-            m_randomArray[g][f] = (char)(-127 + (rand() & 255));
+    allocateColumns(columns);
+
+    // There are two different programs for QOTH's ground rendering. Both of
+    // them share the same vertex shader and only the fragment shaders are
+    // program specific.
+    GameProgramCache *programCache = m_gameInstance->getProgramCache();
+    m_program.setProgram(programCache->program(strGroundVertexShader,
+                                               strGroundFragmentShader,
+                                               groundAttributes, 4));
+    m_rockProgram.setProgram(programCache->program(strGroundVertexShader,
+                                                   strRockFragmentShader,
+                                                   groundAttributes, 4));
+
+    // Indices of a chunk, the same for all the chunks. The quads are
+    // ordered column by column, so that a narrower chunk draws the first
+    // part of a section. The ground section holds the quad rows from the
+    // front to the top of the rock wall, the rock section the quad rows of
+    // the rock wall.
+    int stride = GAME_LEVEL_CHUNK_COLUMNS + 1;
+    GLushort *indices = new GLushort[GAME_LEVEL_CHUNK_COLUMNS
+                                     * GAME_LEVEL_GRID_HEIGHT * 6];
+    GLushort *i = indices;
+
+    for (int section = 0; section < 2; section++) {
+        int firstRow = section == 0 ? 0 : GAME_LEVEL_GRID_HEIGHT - 3;
+        int lastRow = section == 0 ? GAME_LEVEL_GRID_HEIGHT - 3
+                                   : GAME_LEVEL_GRID_HEIGHT - 2;
+
+        for (int x = 0; x < GAME_LEVEL_CHUNK_COLUMNS; x++) {
+            for (int y = firstRow; y <= lastRow; y++) {
+                // Triangle 1
+                i[0] = y * stride + x;
+                i[1] = y * stride + x + 1;
+                i[2] = (y + 1) * stride + x + 1;
+
+                // Triangle 2
+                i[3] = y * stride + x;
+                i[4] = (y + 1) * stride + x + 1;
+                i[5] = (y + 1) * stride + x;
+
+                i += 6;
+            }
         }
     }
 
+    GameGLState *glState = m_gameInstance->getGLState();
+    glGenBuffers(1, &m_indexBuffer);
+    glState->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, (i - indices) * sizeof(GLushort),
+                 indices, GL_STATIC_DRAW);
+    glState->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    delete [] indices;
+}
 
-    // There are two different programs for QOTH's ground rendering. Both of them share the same vertex shader and
-    // only fragment shaders are program specific. We could use GameWindow's glhelpCreateShader  for building
-    // them (to simplify the code), but it would take one additional vertex shader.
-    GLint retval;
-    m_fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(m_fragmentShader, 1,
-                   (const char**)&strGroundFragmentShader, NULL);
-    glCompileShader(m_fragmentShader);
-    glGetShaderiv(m_fragmentShader, GL_COMPILE_STATUS, &retval);
 
-    if (!retval)
-        DEBUG_INFO("FAILED TO COMPILE GROUND FRAGMENT SHADER!");
-    else
-        DEBUG_INFO("Ground fragment shader compiled successfully!");
+/*!
+  Destructor.
+*/
+GameLevel::~GameLevel()
+{
+    destroy();
+    delete [] m_columnData;
+    delete [] m_normalArray;
+    glDeleteBuffers(1, &m_indexBuffer);
+}
 
-    m_rockFragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(m_rockFragmentShader, 1,
-                   (const char**)&strRockFragmentShader, NULL);
-    glCompileShader(m_rockFragmentShader);
-    glGetShaderiv(m_rockFragmentShader, GL_COMPILE_STATUS, &retval);
 
-    if (!retval)
-        DEBUG_INFO("FAILED TO COMPILE ROCK FRAGMENT SHADER!");
-    else
-        DEBUG_INFO("Rock fragment shader compiled successfully!");
+/*!
+  Allocates the column arrays for \a columns columns and sets the
+  positions of the columns.
+*/
+void GameLevel::allocateColumns(int columns)
+{
+    destroy();
+    delete [] m_columnData;
+    delete [] m_normalArray;
+
+    m_columns = columns < 2 ? 2 : columns;
+    m_columnWidth = (GAME_LEVEL_END_X - GAME_LEVEL_START_X)
+            / (float)(m_columns - 1);
+
+    m_columnData = new float[m_columns * (GAME_LEVEL_GRID_HEIGHT + 5) + 1];
+    m_peakArray = m_columnData;
+    m_originalPeakArray = m_peakArray + m_columns;
+    m_destroyedArray = m_originalPeakArray + m_columns;
+    m_uArray = m_destroyedArray + m_columns;
+    m_noiseArray = m_uArray + m_columns;
+    m_xposArray = m_noiseArray + m_columns * GAME_LEVEL_GRID_HEIGHT;
+    m_normalArray = new QVector3D[m_columns];
+
+    for (int f = 0; f < m_columns + 1; f++) {
+        m_xposArray[f] = GAME_LEVEL_START_X
+                + (GAME_LEVEL_END_X - GAME_LEVEL_START_X)
+                * (float)f / (float)(m_columns - 1);
+    }
+}
 
-    m_vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(m_vertexShader, 1,
-                   (const char**)&strGroundVertexShader, NULL);
-    glCompileShader(m_vertexShader);
-    glGetShaderiv(m_vertexShader, GL_COMPILE_STATUS, &retval);
 
-    if (!retval)
-        DEBUG_INFO("FAILED TO COMPILE VERTEX SHADER!");
-    else
-        DEBUG_INFO("Vertex shader compiled successfully!");
+/*!
+  Generates a new level from a seed taken from the game's random
+  generator.
+*/
+void GameLevel::recreate()
+{
+    recreate(m_gameInstance->getRandom()->next());
+}
 
-    // Main program for the top.
-    m_program = glCreateProgram();
-    glAttachShader(m_program, m_fragmentShader);
-    glAttachShader(m_program, m_vertexShader);
 
-    // Bind the custom vertex attributes.
-    glBindAttribLocation(m_program, 0, "vertex");
-    glBindAttribLocation(m_program, 1, "uv");
-    glBindAttribLocation(m_program, 2, "vertexcolor");
-    glBindAttribLocation(m_program, 3, "vertexnormal");
+/*!
+  Generates the level of \a seed. The same seed and number of columns
+  always give the same level.
+*/
+void GameLevel::recreate(unsigned int seed)
+{
+    m_seed = seed;
+    GameRandom random(seed);
 
-    glLinkProgram(m_program);
+    for (int f = 0; f < GAME_LEVEL_GRID_HEIGHT; f++) {
+        for (int g = 0; g < GAME_LEVEL_BASE_COLUMNS; g++) {
+            m_randomArray[g][f] = (char)(-127 + random.byte());
+        }
+    }
 
-    // Check if the linking succeeded.
-    glGetProgramiv(m_program, GL_LINK_STATUS, &retval);
+    int randTable[256];
 
-    if (!retval)
-        DEBUG_INFO("FAILED TO LINK PROGRAM!");
-    else
-        DEBUG_INFO("Program linked successfully!");
+    for (int f = 0; f < 256; f++)
+        randTable[f] = (random.next() & 1) * 65536;
 
-    glUniform1i(glGetUniformLocation(m_program, "sampler2d"), 0);
+    float edge;
 
-    // Rock program.
-    m_rockProgram = glCreateProgram();
-    glAttachShader(m_rockProgram, m_rockFragmentShader);
-    glAttachShader(m_rockProgram, m_vertexShader);
+    // Init'n'create peak-array
+    for (int f = 0; f < m_columns; f++) {
+        // Position of the column in the base columns
+        float base = (float)f * (float)(GAME_LEVEL_BASE_COLUMNS - 1)
+                / (float)(m_columns - 1);
+
+        edge = (base - (float)(GAME_LEVEL_BASE_COLUMNS - 1) / 2.0f)
+                / ((float)GAME_LEVEL_BASE_COLUMNS / 2.0f);
+        float fedge = 1.0f - powf(fabsf(edge), 0.75f);
+        float medge = powf(edge, 14.0f);
+
+        // Use a cutted cosine as our levels base form
+        m_peakArray[f] =
+                cosf((base / (float)(GAME_LEVEL_BASE_COLUMNS - 1)
+                      * 1.4f + 0.2f) * 3.14159f) * 4.0f;
+
+        // Lower the very furthest edges exponentially
+        m_peakArray[f] = m_peakArray[f] * (1.0f - medge) + (medge * -14.0f);
+
+        // Add noise to the centre of the level
+        m_peakArray[f] += (getNoiseValue(randTable, (int)(base * 48.0f))
+                           * 14.0f * fedge);
+
+        m_originalPeakArray[f] = m_peakArray[f];
+        m_destroyedArray[f] = -1.0f;
+    }
 
-    // Bind the custom vertex attributes
-    glBindAttribLocation(m_rockProgram, 0, "vertex");
-    glBindAttribLocation(m_rockProgram, 1, "uv");
-    glBindAttribLocation(m_rockProgram, 2, "vertexcolor");
-    glBindAttribLocation(m_rockProgram, 3, "vertexnormal");
+    recreateColumns();
+}
 
-    glLinkProgram(m_rockProgram);
 
-    // Check if the linking succeeded.
-    glGetProgramiv(m_rockProgram, GL_LINK_STATUS, &retval);
+/*!
+  Derives the rest of the level from the peaks and the random array, and
+  recreates the chunks.
+*/
+void GameLevel::recreateColumns()
+{
+    // Interpolate the vertex noise of the base columns to the columns of
+    // the level, so that it stays as smooth with any number of columns.
+    for (int g = 0; g < m_columns; g++) {
+        float base = (float)g * (float)(GAME_LEVEL_BASE_COLUMNS - 1)
+                / (float)(m_columns - 1);
+        int ind = (int)base;
+
+        if (ind > GAME_LEVEL_BASE_COLUMNS - 2)
+            ind = GAME_LEVEL_BASE_COLUMNS - 2;
+
+        float m = base - (float)ind;
+
+        for (int f = 0; f < GAME_LEVEL_GRID_HEIGHT; f++) {
+            m_noiseArray[f * m_columns + g] =
+                    (float)m_randomArray[ind][f] * (1.0f - m)
+                    + (float)m_randomArray[ind + 1][f] * m;
+        }
+    }
 
-    if (!retval)
-        DEBUG_INFO("FAILED TO LINK ROCK PROGRAM!");
-    else
-        DEBUG_INFO("Rock program linked successfully!");
+    // Texture coordinate along the level, in steps scaled to the number of
+    // columns
+    float uStep = 0.1f * (float)(GAME_LEVEL_BASE_COLUMNS - 1)
+            / (float)(m_columns - 1);
+    m_uArray[0] = 0.0f;
 
-    glUniform1i(glGetUniformLocation(m_rockProgram, "sampler2d"), 0);
+    for (int f = 1; f < m_columns; f++) {
+        float dx = m_xposArray[f - 1] - m_xposArray[f];
+        float dy = m_originalPeakArray[f - 1] - m_originalPeakArray[f];
+        m_uArray[f] = m_uArray[f - 1] + uStep + sqrtf(dx * dx + dy * dy) / 4.5f;
+    }
 
-    glGenBuffers(1, &m_vbo);
-    glGenBuffers(1, &m_indexBuffer);
+    recreateNormals(0, m_columns - 1);
+    recreateChunks();
+    m_explosionCount = 0;
+    m_revision++;
 }
 
 
 /*!
-  Destructor.
+  Writes the level into the level file \a fileName. Returns false on an
+  error.
 */
-GameLevel::~GameLevel()
+bool GameLevel::save(const QString &fileName) const
 {
-    destroy();
-    glDeleteBuffers(1, &m_vbo);
-    glDeleteBuffers(1, &m_indexBuffer);
-    glDeleteProgram(m_program);
-    glDeleteProgram(m_rockProgram);
-    glDeleteShader(m_fragmentShader);
-    glDeleteShader(m_rockFragmentShader);
-    glDeleteShader(m_vertexShader);
+    QFile file(fileName);
+
+    if (!file.open(QIODevice::WriteOnly)) {
+        DEBUG_INFO("Failed to write a level file");
+        return false;
+    }
+
+    SLevelFileHeader header;
+    header.magic = GAME_LEVEL_FILE_MAGIC;
+    header.version = GAME_LEVEL_FILE_VERSION;
+    header.columns = m_columns;
+    header.seed = m_seed;
+    header.baseColumns = GAME_LEVEL_BASE_COLUMNS;
+    header.rows = GAME_LEVEL_GRID_HEIGHT;
+
+    // The peaks, the original peaks and the destroyed values are
+    // consecutive in m_columnData
+    qint64 columnSize = m_columns * 3 * sizeof(float);
+    bool ok = file.write((const char*)&header, sizeof(header)) == sizeof(header)
+            && file.write((const char*)m_columnData, columnSize) == columnSize
+            && file.write((const char*)m_randomArray, sizeof(m_randomArray))
+               == sizeof(m_randomArray);
+
+    if (!ok)
+        DEBUG_INFO("Failed to write a level file");
+
+    return ok;
 }
 
 
 /*!
+  Reads the level file \a fileName written by save() in place of the
+  current level. The file is mapped into memory when possible. Returns
+  false, and keeps the current level, if the file can't be read or is not
+  a level file of this version and byte order.
 */
-void GameLevel::recreate()
+bool GameLevel::load(const QString &fileName)
 {
-    int randTable[256];
+    QFile file(fileName);
 
-    for (int f = 0; f < 256; f++)
-        randTable[f] = (rand() & 1) * 65536;
+    if (!file.open(QIODevice::ReadOnly)) {
+        DEBUG_INFO("Failed to open a level file");
+        return false;
+    }
 
-    float edge;
+    qint64 size = file.size();
+    const char *data = (const char*)file.map(0, size);
+    QByteArray contents;
 
-    // Init'n'create peak-array
-    for (int f = 0; f < GAME_LEVEL_GRID_WIDTH + 1; f++) {
-        m_xposArray[f] = GAME_LEVEL_START_X
-                + (GAME_LEVEL_END_X - GAME_LEVEL_START_X)
-                * (float)f / (float)(GAME_LEVEL_GRID_WIDTH - 1);
+    if (!data) {
+        contents = file.readAll();
+        data = contents.constData();
+        size = contents.size();
+    }
 
-        if (f < GAME_LEVEL_GRID_WIDTH) {
-            edge = ((float)f - (float)((GAME_LEVEL_GRID_WIDTH - 1) / 2.0f))
-                    / ((float)GAME_LEVEL_GRID_WIDTH / 2.0f);
-            float fedge = 1.0f - powf(fabsf(edge), 0.75f);
-            float medge = powf(edge, 14.0f);
+    SLevelFileHeader header;
 
-            // Use a cutted cosine as our levels base form
-            m_peakArray[f] =
-                    cosf(((float)f / (float)(GAME_LEVEL_GRID_WIDTH - 1)
-                          * 1.4f + 0.2f) * 3.14159f) * 4.0f;
+    if (size < (qint64)sizeof(header)) {
+        DEBUG_INFO("Not a level file");
+        return false;
+    }
 
-            // Lower the very furthest edges exponentially
-            m_peakArray[f] = m_peakArray[f] * (1.0f - medge) + (medge * -14.0f);
+    memcpy(&header, data, sizeof(header));
 
-            // Add noise to the centre of the level
-            m_peakArray[f] += (getNoiseValue(randTable, f * 48) * 14.0f * fedge);
+    qint64 columnSize = (qint64)header.columns * 3 * sizeof(float);
 
-            m_originalPeakArray[f] = m_peakArray[f];
-            m_destroyedArray[f] = -1.0f;
-        }
+    if (header.magic != GAME_LEVEL_FILE_MAGIC
+            || header.version != GAME_LEVEL_FILE_VERSION
+            || header.baseColumns != GAME_LEVEL_BASE_COLUMNS
+            || header.rows != GAME_LEVEL_GRID_HEIGHT
+            || header.columns < 2
+            || size < (qint64)sizeof(header) + columnSize
+                      + (qint64)sizeof(m_randomArray)) {
+        DEBUG_INFO("Unsupported level file");
+        return false;
     }
 
-    recreateVertices();
-    m_forceUpdate = true;
+    if (header.columns != m_columns)
+        allocateColumns(header.columns);
+
+    data += sizeof(header);
+    memcpy(m_columnData, data, columnSize);
+    memcpy(m_randomArray, data + columnSize, sizeof(m_randomArray));
+    m_seed = header.seed;
+
+    recreateColumns();
+    return true;
 }
 
 
@@ -276,33 +573,42 @@ void GameLevel::recreate()
 */
 void GameLevel::destroy()
 {
-    if (m_vertices)
-        delete [] m_vertices;
-
-    if (m_indices)
-        delete [] m_indices;
+    for (int f = 0; f < m_chunkCount; f++) {
+        delete [] m_chunks[f].vertices;
+        glDeleteBuffers(1, &m_chunks[f].vbo);
+    }
 
-    m_vertices = 0;
-    m_indices = 0;
-    m_vertexCount = 0;
-    m_indexCount = 0;
+    delete [] m_chunks;
+    m_chunks = 0;
+    m_chunkCount = 0;
 }
 
 
 /*!
+  Applies the queued explosions, updates the changed chunks and drops the
+  vertices of the chunks that haven't changed for a while.
 */
 void GameLevel::run(float frameTime)
 {
     Q_UNUSED(frameTime);
 
-    if (!m_forceUpdate)
-        return;
+    m_frame++;
+    applyExplosions();
 
-    m_forceUpdate = false;
+    for (int f = 0; f < m_chunkCount; f++) {
+        SChunk &chunk = m_chunks[f];
 
-    // calculate 2D normals
-    recreateNormals();
-    updateMesh();
+        if (chunk.dirtyFirst <= chunk.dirtyLast) {
+            // calculate 2D normals
+            recreateNormals(chunk.dirtyFirst, chunk.dirtyLast);
+            updateChunk(chunk);
+        }
+        else if (chunk.vertices
+                 && m_frame - chunk.updateFrame > GAME_LEVEL_CHUNK_IDLE_FRAMES) {
+            delete [] chunk.vertices;
+            chunk.vertices = 0;
+        }
+    }
 }
 
 
@@ -310,25 +616,30 @@ void GameLevel::run(float frameTime)
 */
 void GameLevel::render()
 {
-    glEnable(GL_CULL_FACE);
-    glFrontFace(GL_CW);
-    glDepthMask(GL_TRUE);
-
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
-    glEnableVertexAttribArray(2);
-    glEnableVertexAttribArray(3);
+    // Only the chunks in the view are drawn
+    int visibleCount = 0;
+
+    for (int f = 0; f < m_chunkCount; f++) {
+        SChunk &chunk = m_chunks[f];
+        chunk.visible = chunk.radius >= 0.0f
+                && m_gameInstance->isSphereVisible(chunk.center[0],
+                                                   chunk.center[1],
+                                                   chunk.center[2],
+                                                   chunk.radius);
+
+        if (chunk.visible)
+            visibleCount++;
+    }
 
-    glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-    glVertexAttribPointer(0,3, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 12, 0);
-    glVertexAttribPointer(1,2, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 12,
-                          (void*)(sizeof(GLfloat) * 3));
-    glVertexAttribPointer(2,4, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 12,
-                          (void*)(sizeof(GLfloat) * 5));
-    glVertexAttribPointer(3,3, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 12,
-                          (void*)(sizeof(GLfloat) * 9));
+    if (!visibleCount)
+        return;
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+    GameGLState *glState = m_gameInstance->getGLState();
+    glState->enable(GL_CULL_FACE);
+    glFrontFace(GL_CW);
+    glState->depthMask(true);
+    glState->setVertexAttribArrays(0xf);
+    glState->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
 
     float m[16];
     memset(m, 0, sizeof(GLfloat) * 16);
@@ -338,200 +649,371 @@ void GameLevel::render()
     m[15] = 1.0f;
     m_gameInstance->cameraTransform(m);
 
-    glEnable(GL_DEPTH_TEST);
-    glDisable(GL_BLEND);
+    glState->enable(GL_DEPTH_TEST);
+    glState->disable(GL_BLEND);
 
     // Draw the top
-    glBindTexture(GL_TEXTURE_2D,
-        m_gameInstance->getTextureManager()->getTexture(":/ground.png"));
-
+    glState->bindTexture(
+        m_gameInstance->texture(GameInstance::TextureGround));
 
-    glUseProgram(m_program);
-    glUniformMatrix4fv(glGetUniformLocation(m_program, "transMatrix"),
+    glState->useProgram(m_program);
+    glUniformMatrix4fv(m_program.location(GameProgram::TransMatrix),
                        1, GL_FALSE, m);
-    glUniformMatrix4fv(glGetUniformLocation(m_program, "projMatrix"),
+    glUniformMatrix4fv(m_program.location(GameProgram::ProjMatrix),
                        1, GL_FALSE, m_gameInstance->getProjectionMatrix());
-    glUniform1i(glGetUniformLocation(m_program, "sampler2d"), 0);
 
-    glDrawElements(GL_TRIANGLES,
-                   (m_indexCount - (GAME_LEVEL_GRID_WIDTH - 1) * 6),
-                   GL_UNSIGNED_SHORT, 0);
+    drawChunks(0, GAME_LEVEL_GRID_HEIGHT - 2);
 
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glState->enable(GL_BLEND);
+    glState->blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
     glDepthFunc(GL_LEQUAL);
 
-    glUseProgram(m_rockProgram);
-    glUniformMatrix4fv(glGetUniformLocation(m_rockProgram, "transMatrix"),
+    glState->useProgram(m_rockProgram);
+    glUniformMatrix4fv(m_rockProgram.location(GameProgram::TransMatrix),
                        1, GL_FALSE, m);
-    glUniformMatrix4fv(glGetUniformLocation(m_rockProgram, "projMatrix"),
+    glUniformMatrix4fv(m_rockProgram.location(GameProgram::ProjMatrix),
                        1, GL_FALSE, m_gameInstance->getProjectionMatrix());
-    glUniform1i(glGetUniformLocation(m_rockProgram, "sampler2d"), 0);
 
-    glBindTexture(GL_TEXTURE_2D,
-        m_gameInstance->getTextureManager()->getTexture(":/rock_wall.png"));
+    glState->bindTexture(
+        m_gameInstance->texture(GameInstance::TextureRockWall));
 
-    int start = (6 * (GAME_LEVEL_GRID_WIDTH - 1) * 1);
-    start = 12 * (GAME_LEVEL_GRID_WIDTH - 1) * 2;
-    glDrawElements(GL_TRIANGLES,
-                   6 * (GAME_LEVEL_GRID_WIDTH - 1) * 2,
-                   GL_UNSIGNED_SHORT, (void*)start);
+    // The rock wall follows the ground section in the index buffer
+    drawChunks(GAME_LEVEL_CHUNK_COLUMNS * (GAME_LEVEL_GRID_HEIGHT - 2) * 6,
+               2);
 
     glDepthFunc(GL_LESS);
-    glDisable(GL_CULL_FACE);
-
-    glDisableVertexAttribArray(0);
-    glDisableVertexAttribArray(1);
-    glDisableVertexAttribArray(2);
-    glDisableVertexAttribArray(3);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glState->disable(GL_CULL_FACE);
+    glState->bindBuffer(GL_ARRAY_BUFFER, 0);
+    glState->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
 
 
 /*!
+  Returns the height of the ground at \a x and writes its normal into
+  \a normalTarget, if not 0.
 */
 float GameLevel::getHeightAndNormalAt(float x, QVector3D *normalTarget)
 {
-    if (x < GAME_LEVEL_START_X || x > GAME_LEVEL_END_X) {
-        normalTarget->setX(0.0f);
-        normalTarget->setY(1.0f);
-        normalTarget->setZ(0.0f);
-        return -100.0f;
-    }
+    float height;
+    QVector3D normal;
+    getHeightsAndNormals(&x, 1, &height, &normal);
 
-    int ind1 = 0;
-    int ind2 = 1;
+    if (normalTarget)
+        *normalTarget = normal;
 
-    while (m_xposArray[ind2] < x && ind2 < GAME_LEVEL_GRID_WIDTH)
-	ind2++;
+    return height;
+}
+
+
+/*!
+  Writes the heights and the normals of the ground at the \a n positions
+  \a xs into \a heights and \a normals. The columns are evenly spaced, so
+  each position is looked up directly and the height and the normal are
+  interpolated between the two columns around it. Outside the level the
+  height is -100 and the normal points up.
+*/
+void GameLevel::getHeightsAndNormals(const float *xs, int n, float *heights,
+                                     QVector3D *normals)
+{
+    float scale = 1.0f / m_columnWidth;
+    int lastColumn = m_columns - 2;
 
-    if (ind2 > 0)
-        ind1 = ind2-1;
+    for (int f = 0; f < n; f++) {
+        float x = xs[f];
 
-    float m2 = ((x - m_xposArray[ind1]) / (m_xposArray[1] - m_xposArray[0]));
-    float height = m_peakArray[ind1] * (1.0f - m2) + m_peakArray[ind2] * m2;
+        if (x < GAME_LEVEL_START_X || x > GAME_LEVEL_END_X) {
+            heights[f] = -100.0f;
+            normals[f] = QVector3D(0.0f, 1.0f, 0.0f);
+            continue;
+        }
 
-    if (normalTarget) {
-        *normalTarget = m_normalArray[ind1] * (1.0f - m2)
-                + m_normalArray[ind1] * m2;
+        float pos = (x - GAME_LEVEL_START_X) * scale;
+        int ind1 = (int)pos;
+        ind1 = ind1 < lastColumn ? ind1 : lastColumn;
+
+        float m2 = pos - (float)ind1;
+        heights[f] = m_peakArray[ind1] * (1.0f - m2)
+                + m_peakArray[ind1 + 1] * m2;
+
+        // The 2D normals are on the xy plane
+        const QVector3D &n1 = m_normalArray[ind1];
+        const QVector3D &n2 = m_normalArray[ind1 + 1];
+        float nx = n1.x() * (1.0f - m2) + n2.x() * m2;
+        float ny = n1.y() * (1.0f - m2) + n2.y() * m2;
+        float il = 1.0f / sqrtf(nx * nx + ny * ny);
+        normals[f] = QVector3D(nx * il, ny * il, 0.0f);
     }
-
-    return height;
 }
 
 
 /*!
+  Queues an explosion lowering the ground inside the circle at \a x, \a y
+  with radius \a r. The craters of a frame are cut into the ground
+  together by the next run().
 */
 void GameLevel::explosion(float x, float y, float r)
 {
+    if (m_explosionCount == GAME_LEVEL_MAX_EXPLOSIONS)
+        applyExplosions();
+
+    // Only the columns within the radius can change
+    int from = (int)floorf((x - r - GAME_LEVEL_START_X) / m_columnWidth);
+    int to = (int)ceilf((x + r - GAME_LEVEL_START_X) / m_columnWidth);
+
+    if (from < 0)
+        from = 0;
+
+    if (to > m_columns - 1)
+        to = m_columns - 1;
+
+    if (from > to)
+        return;
+
+    SExplosion &explosion = m_explosions[m_explosionCount++];
+    explosion.x = x;
+    explosion.y = y;
+    explosion.r = r;
+    explosion.from = from;
+    explosion.to = to;
+}
+
+
+/*!
+  Cuts the queued craters into the ground in one pass over the columns
+  they reach and marks the changed columns for the mesh update. Each
+  column meets the craters in the order they were queued, so the ground
+  ends up as if they were cut one after another.
+*/
+void GameLevel::applyExplosions()
+{
+    if (!m_explosionCount)
+        return;
+
+    // Changed columns of each explosion, first > last when none
+    int first[GAME_LEVEL_MAX_EXPLOSIONS];
+    int last[GAME_LEVEL_MAX_EXPLOSIONS];
+    int from = m_columns;
+    int to = -1;
+    int e;
+
+    for (e = 0; e < m_explosionCount; e++) {
+        first[e] = m_columns;
+        last[e] = -1;
+        from = qMin(from, m_explosions[e].from);
+        to = qMax(to, m_explosions[e].to);
+    }
+
     float distance;
     float dx;
     float dy;
 
-    for (int f = 0; f < GAME_LEVEL_GRID_WIDTH; f++) {
-        dx = (x - m_xposArray[f]);
-        dy = (y - m_peakArray[f]);
-        distance = sqrtf(dx * dx + dy * dy);
+    for (int f = from; f <= to; f++) {
+        float peak = m_peakArray[f];
+        float destroyed = m_destroyedArray[f];
+
+        for (e = 0; e < m_explosionCount; e++) {
+            const SExplosion &explosion = m_explosions[e];
+
+            if (f < explosion.from || f > explosion.to)
+                continue;
+
+            dx = (explosion.x - m_xposArray[f]);
+            dy = (explosion.y - peak);
+            distance = sqrtf(dx * dx + dy * dy);
+
+            if (distance < explosion.r) {
+                peak -= (explosion.r - distance);
+                destroyed += (explosion.r - distance) / 2.0f;
+
+                if (destroyed > 3.0f)
+                    destroyed = 3.0f;
 
-        if (distance < r) {
-            m_peakArray[f] -= (r - distance);
-            m_destroyedArray[f] +=(r - distance) / 2.0f;
+                if (f < first[e])
+                    first[e] = f;
 
-            if (m_destroyedArray[f] > 3.0f)
-                m_destroyedArray[f] = 3.0f;
+                last[e] = f;
+            }
         }
+
+        m_peakArray[f] = peak;
+        m_destroyedArray[f] = destroyed;
     }
 
-    m_forceUpdate = true;
+    bool changed = false;
+
+    for (e = 0; e < m_explosionCount; e++) {
+        if (first[e] <= last[e]) {
+            markChanged(first[e], last[e]);
+            changed = true;
+        }
+    }
+
+    m_explosionCount = 0;
+
+    if (changed)
+        m_revision++;
 }
 
 
 /*!
+  Marks the columns from \a first to \a last as changed in the chunks
+  holding them. The chunks merge the ranges and update them into the mesh
+  in the next run().
 */
-void GameLevel::recreateVertices()
+void GameLevel::markChanged(int first, int last)
 {
-    destroy();
-    int x;
-    int y;
-    m_vertexCount = GAME_LEVEL_GRID_WIDTH * GAME_LEVEL_GRID_HEIGHT;
-    m_vertices = new GLfloat[m_vertexCount * 12];
-    GLfloat *v = m_vertices;
+    // The normals of the neighbouring columns use the changed faces too
+    first = first > 0 ? first - 1 : 0;
+    last = last < m_columns - 1 ? last + 1 : last;
 
-    for (y = 0; y < GAME_LEVEL_GRID_HEIGHT; y++) {
-        float u = 0.0f;
-
-        for (x = 0; x < GAME_LEVEL_GRID_WIDTH; x++) {
-            v[0] = m_xposArray[x];
-            v[2] = zarray[y] + GAME_LEVEL_ZBASE
-                   + (float)m_randomArray[GAME_LEVEL_GRID_WIDTH - 1 - x][GAME_LEVEL_GRID_HEIGHT - 1 - y]
-                   / 1024.0f * noise_mul[y];
-            v[1] = m_peakArray[x] * height_mul[y]
-                   + LEVEL_Y_MIN * (1.0f - height_mul[y]);
-
-            if (x > 0) {
-                float dx = m_xposArray[x-1] - m_xposArray[x];
-                float dy = m_peakArray[x-1] - m_peakArray[x];
-                u += 0.1f + sqrtf(dx * dx + dy * dy) / 4.5f;
-            }
+    // A column at the edge of two chunks is in both
+    int firstChunk = first > 0 ? (first - 1) / GAME_LEVEL_CHUNK_COLUMNS : 0;
+    int lastChunk = last / GAME_LEVEL_CHUNK_COLUMNS;
 
-            v[3] = u + (float)((rand() & 255) - 128) / 2000.0f;
-            v[4] = varray[y];
-            v[5] = -3.0f;
-            v[6] = 3.0f - (float)(rand() & 255) * 6.0f / 255.0f;
+    if (lastChunk > m_chunkCount - 1)
+        lastChunk = m_chunkCount - 1;
 
-            if (y >= GAME_LEVEL_GRID_HEIGHT-2)
-                v[8] = 2.0f;
-            else
-                v[8] = -2.0f;
+    for (int f = firstChunk; f <= lastChunk; f++) {
+        SChunk &chunk = m_chunks[f];
 
-            v += 12;
-        }
+        if (first < chunk.dirtyFirst)
+            chunk.dirtyFirst = qMax(first, chunk.firstColumn);
+
+        if (last > chunk.dirtyLast)
+            chunk.dirtyLast = qMin(last, chunk.lastColumn);
     }
+}
 
-    // Indices
-    m_indexCount = (GAME_LEVEL_GRID_WIDTH - 1)
-            * (GAME_LEVEL_GRID_HEIGHT - 1) * 6;
-    m_indices = new GLushort[m_indexCount];
-    GLushort *i = m_indices;
 
-    for (y = 0; y < GAME_LEVEL_GRID_HEIGHT - 1; y++) {
-        for (x = 0; x < GAME_LEVEL_GRID_WIDTH - 1; x++) {
-            // Triangle 1
-            i[0] = y * GAME_LEVEL_GRID_WIDTH + x;
-            i[1] = y * GAME_LEVEL_GRID_WIDTH + x + 1;
-            i[2] = (y + 1) * GAME_LEVEL_GRID_WIDTH + x + 1;
-
-            // Triangle 2
-            i[3] = y * GAME_LEVEL_GRID_WIDTH + x;
-            i[4] = (y + 1) * GAME_LEVEL_GRID_WIDTH + x + 1;
-            i[5] = (y + 1) * GAME_LEVEL_GRID_WIDTH + x;
-
-            i += 6;
-        }
+/*!
+  Returns the y coordinate of the vertex of column \a x on row \a y.
+*/
+inline float GameLevel::vertexY(int x, int y) const
+{
+    float vy = m_peakArray[x] * modify_mul[y]
+            + m_originalPeakArray[x] * (1.0f - modify_mul[y]);
+    vy = vy * height_mul[y] + LEVEL_Y_MIN * (1.0f - height_mul[y]);
+    return vy - m_noiseArray[y * m_columns + x] / 256.0f * noise_mul[y];
+}
+
+
+/*!
+  Returns the z coordinate of the vertex of column \a x on row \a y.
+*/
+inline float GameLevel::vertexZ(int x, int y) const
+{
+    return zarray[y] + GAME_LEVEL_ZBASE
+            + m_noiseArray[(GAME_LEVEL_GRID_HEIGHT - 1 - y) * m_columns
+                           + m_columns - 1 - x] / 1024.0f * noise_mul[y];
+}
+
+
+/*!
+  Returns the random byte \a n of the vertex of column \a x on row \a y.
+  The value follows from the seed of the level and the vertex alone.
+*/
+inline int GameLevel::vertexRandom(int x, int y, int n) const
+{
+    unsigned int h = m_seed ^ ((unsigned int)x * 0x9e3779b1u)
+            ^ ((unsigned int)(y * 2 + n) * 0x85ebca6bu);
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return (int)(h >> 24);
+}
+
+
+/*!
+  Creates the chunks and their vertex buffers for the columns of the
+  level. The vertices are created by the next run().
+*/
+void GameLevel::recreateChunks()
+{
+    destroy();
+
+    m_chunkCount = (m_columns - 2) / GAME_LEVEL_CHUNK_COLUMNS + 1;
+    m_chunks = new SChunk[m_chunkCount];
+
+    GameGLState *glState = m_gameInstance->getGLState();
+
+    int size = (GAME_LEVEL_CHUNK_COLUMNS + 1) * GAME_LEVEL_GRID_HEIGHT
+            * sizeof(SVertex);
+
+    for (int f = 0; f < m_chunkCount; f++) {
+        SChunk &chunk = m_chunks[f];
+        chunk.firstColumn = f * GAME_LEVEL_CHUNK_COLUMNS;
+        chunk.lastColumn = qMin(chunk.firstColumn + GAME_LEVEL_CHUNK_COLUMNS,
+                                m_columns - 1);
+        chunk.vertices = 0;
+        chunk.dirtyFirst = chunk.firstColumn;
+        chunk.dirtyLast = chunk.lastColumn;
+        chunk.updateFrame = m_frame;
+        chunk.visible = false;
+        chunk.radius = -1.0f; // Nothing to draw yet
+
+        glGenBuffers(1, &chunk.vbo);
+        glState->bindBuffer(GL_ARRAY_BUFFER, chunk.vbo);
+        glBufferData(GL_ARRAY_BUFFER, size, 0, GL_DYNAMIC_DRAW);
     }
 
-    // Update index buffer
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                 m_indexCount * sizeof(GLushort),
-                 m_indices, GL_STATIC_DRAW);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glState->bindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
 
-    recreateNormals();
+/*!
+  Creates the vertices of \a chunk and sets the attributes that don't
+  change when the ground changes. The random attributes depend only on the
+  seed of the level and the vertex, so that a dropped chunk is rebuilt the
+  same and the chunks sharing an edge column agree on it.
+*/
+void GameLevel::buildChunk(SChunk &chunk)
+{
+    int stride = GAME_LEVEL_CHUNK_COLUMNS + 1;
+    chunk.vertices = new SVertex[stride * GAME_LEVEL_GRID_HEIGHT]();
+
+    for (int y = 0; y < GAME_LEVEL_GRID_HEIGHT; y++) {
+        SVertex *v = chunk.vertices + y * stride;
+
+        for (int x = chunk.firstColumn; x <= chunk.lastColumn; x++) {
+            v->position[0] = m_xposArray[x];
+            v->position[2] = vertexZ(x, y);
+            v->uv[0] = packShort(m_uArray[x]
+                                 + (float)(vertexRandom(x, y, 0) - 128)
+                                 / 2000.0f,
+                                 LEVEL_UV_SCALE);
+            v->uv[1] = packShort(varray[y], LEVEL_UV_SCALE);
+            v->color[1] = packByte(3.0f - (float)vertexRandom(x, y, 1)
+                                   * 6.0f / 255.0f,
+                                   LEVEL_COLOR_SCALE);
+
+            if (y >= GAME_LEVEL_GRID_HEIGHT-2)
+                v->color[3] = packByte(2.0f, LEVEL_COLOR_SCALE);
+            else
+                v->color[3] = packByte(-2.0f, LEVEL_COLOR_SCALE);
+
+            v++;
+        }
+    }
+
+    // All of it is uploaded again
+    chunk.dirtyFirst = chunk.firstColumn;
+    chunk.dirtyLast = chunk.lastColumn;
 }
 
 
 /*!
+  Calculates the 2D normals of the columns from \a first to \a last.
 */
-void GameLevel::recreateNormals()
+void GameLevel::recreateNormals(int first, int last)
 {
-    float iw = m_xposArray[1] - m_xposArray[0];
+    float iw = m_columnWidth;
     float nextPeak;
 
-    for (int f = 0; f < GAME_LEVEL_GRID_WIDTH; f++) {
-        if (f < GAME_LEVEL_GRID_WIDTH - 1)
+    for (int f = first; f <= last; f++) {
+        if (f < m_columns - 1)
             nextPeak = m_peakArray[f + 1];
         else
             nextPeak = m_peakArray[f];
@@ -543,91 +1025,273 @@ void GameLevel::recreateNormals()
 
 
 /*!
+  Updates the vertices of the changed columns of \a chunk and uploads them
+  into its vertex buffer. The vertex normals depend on the neighbouring
+  vertices, so the changed columns include the neighbours of the columns
+  whose peaks have changed.
 */
-void GameLevel::updateMesh()
+void GameLevel::updateChunk(SChunk &chunk)
 {
+    if (!chunk.vertices)
+        buildChunk(chunk);
+
+    int first = chunk.dirtyFirst;
+    int last = chunk.dirtyLast;
+    int stride = GAME_LEVEL_CHUNK_COLUMNS + 1;
     int x;
     int y;
-    int f;
+    SVertex *v;
 
     // Update the vertices with new information
-    GLfloat *v = m_vertices;
-
     for (y = 0; y < GAME_LEVEL_GRID_HEIGHT; y++) {
-        for (x = 0; x < GAME_LEVEL_GRID_WIDTH; x++) {
-            // Update the y coordinate of the vertex
-            v[1] = m_peakArray[x] * modify_mul[y]
-                   + m_originalPeakArray[x] * (1.0f - modify_mul[y]);
-            v[1] = v[1] * height_mul[y] + LEVEL_Y_MIN * (1.0f - height_mul[y]);
-            v[1] -= (float)m_randomArray[x][y] / 256.0f * noise_mul[y];
+        v = chunk.vertices + y * stride + first - chunk.firstColumn;
+
+        for (x = first; x <= last; x++) {
+            v->position[1] = vertexY(x, y);
 
             // Update the destroyed - color attribute of the vertex
-            v[5] = m_destroyedArray[x] - (1.0f - modify_mul[y]) * 4.0f;
-            v += 12;
+            v->color[0] = packByte(m_destroyedArray[x]
+                                   - (1.0f - modify_mul[y]) * 4.0f,
+                                   LEVEL_COLOR_SCALE);
+            v++;
         }
     }
 
-    v = m_vertices;
+#ifdef QOTH_FACE_NORMALS
+    faceNormals(chunk, first, last);
+#else
+    gridNormals(chunk, first, last);
+#endif
 
-    // Clear the vertex normals
-    for (f = 0; f < GAME_LEVEL_GRID_WIDTH * GAME_LEVEL_GRID_HEIGHT; f++) {
-        v[9] = 0.0f;
-        v[10] = 0.0f;
-        v[11] = 0.0f;
-        v += 12;
+    // Upload the columns, the rows are contiguous in the buffer only when
+    // all the columns changed
+    GameGLState *glState = m_gameInstance->getGLState();
+    glState->bindBuffer(GL_ARRAY_BUFFER, chunk.vbo);
+
+    int columns = last - first + 1;
+    bool whole = columns == stride;
+    int rows = whole ? 1 : GAME_LEVEL_GRID_HEIGHT;
+    int rowVertices = whole ? stride * GAME_LEVEL_GRID_HEIGHT : columns;
+
+    for (y = 0; y < rows; y++) {
+        int offset = y * stride + first - chunk.firstColumn;
+        glBufferSubData(GL_ARRAY_BUFFER, offset * sizeof(SVertex),
+                        rowVertices * sizeof(SVertex),
+                        chunk.vertices + offset);
     }
 
-    // Loop through all the faces and calculate their normals.
-    // Add the face normal to each contributed vertices normal.
-    QVector3D tv1;
-    QVector3D tv2;
+    glState->bindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // Bounding sphere of the chunk for culling
+    float minY = LEVEL_Y_MIN;
+    float maxY = LEVEL_Y_MIN;
+    float minZ = zarray[0] + GAME_LEVEL_ZBASE;
+    float maxZ = minZ;
+
+    for (y = 0; y < GAME_LEVEL_GRID_HEIGHT; y++) {
+        v = chunk.vertices + y * stride;
+
+        for (x = chunk.firstColumn; x <= chunk.lastColumn; x++) {
+            minY = qMin(minY, v->position[1]);
+            maxY = qMax(maxY, v->position[1]);
+            minZ = qMin(minZ, v->position[2]);
+            maxZ = qMax(maxZ, v->position[2]);
+            v++;
+        }
+    }
+
+    float minX = m_xposArray[chunk.firstColumn];
+    float maxX = m_xposArray[chunk.lastColumn];
+    chunk.center[0] = (minX + maxX) * 0.5f;
+    chunk.center[1] = (minY + maxY) * 0.5f;
+    chunk.center[2] = (minZ + maxZ) * 0.5f;
+    chunk.radius = 0.5f * sqrtf((maxX - minX) * (maxX - minX)
+                                + (maxY - minY) * (maxY - minY)
+                                + (maxZ - minZ) * (maxZ - minZ));
+
+    chunk.dirtyFirst = m_columns;
+    chunk.dirtyLast = -1;
+    chunk.updateFrame = m_frame;
+}
+
+
+/*!
+  Calculates the vertex normals of the columns from \a first to \a last
+  of \a chunk by summing the normals of the faces around each vertex. The
+  faces are calculated from the column arrays, as the neighbouring quads
+  may be in the next chunk. The reference for gridNormals().
+*/
+void GameLevel::faceNormals(SChunk &chunk, int first, int last)
+{
+    int stride = GAME_LEVEL_CHUNK_COLUMNS + 1;
+    int x;
+    int y;
+    int f;
+    float *n;
+
+    // The normal sums of the columns, from the first one
+    float sums[GAME_LEVEL_GRID_HEIGHT][GAME_LEVEL_CHUNK_COLUMNS + 1][3];
+    memset(sums, 0, sizeof(sums));
+
+    // Loop through the faces touching the columns and calculate their
+    // normals. Add the face normal to the sums of its vertices within
+    // the columns.
+    QVector3D corner[4];
     QVector3D facenormal;
-    v = m_vertices;
-    GLushort *i = m_indices;
-    int faceCount = (GAME_LEVEL_GRID_WIDTH - 1)
-            * (GAME_LEVEL_GRID_HEIGHT - 1) * 2;
-
-    for (f = 0; f < faceCount; f++) {
-        tv1 = QVector3D(v[i[1] * 12] - v[i[0] * 12], v[i[1] * 12 + 1]
-                        - v[i[0] * 12 + 1], v[i[1] * 12 + 2] - v[i[0] * 12 + 2]);
-        tv2 = QVector3D(v[i[2] * 12] - v[i[0] * 12], v[i[2] * 12 + 1]
-                        - v[i[0] * 12 + 1], v[i[2] * 12 + 2] - v[i[0] * 12 + 2]);
-        facenormal = QVector3D::crossProduct(tv2, tv1);
-        facenormal.normalize();
-
-        // Distribute normal to each contributed vertex
-        m_vertices[i[0] * 12 + 9] += facenormal.x();
-        m_vertices[i[0] * 12 + 10] += facenormal.y();
-        m_vertices[i[0] * 12 + 11] += facenormal.z();
-
-        m_vertices[i[1] * 12 + 9] += facenormal.x();
-        m_vertices[i[1] * 12 + 10] += facenormal.y();
-        m_vertices[i[1] * 12 + 11] += facenormal.z();
-
-        m_vertices[i[2] * 12 + 9] += facenormal.x();
-        m_vertices[i[2] * 12 + 10] += facenormal.y();
-        m_vertices[i[2] * 12 + 11] += facenormal.z();
-        i += 3;
+    int firstQuad = first > 0 ? first - 1 : 0;
+    int lastQuad = last < m_columns - 1 ? last : m_columns - 2;
+
+    // Corners of a quad, the first triangle is 0, 1, 2 and the second
+    // 0, 2, 3 as in the index buffer
+    static const int cornerX[4] = { 0, 1, 1, 0 };
+    static const int cornerY[4] = { 0, 0, 1, 1 };
+    static const int triangles[2][3] = { { 0, 1, 2 }, { 0, 2, 3 } };
+
+    for (y = 0; y < GAME_LEVEL_GRID_HEIGHT - 1; y++) {
+        for (x = firstQuad; x <= lastQuad; x++) {
+            for (f = 0; f < 4; f++) {
+                int cx = x + cornerX[f];
+                int cy = y + cornerY[f];
+                corner[f] = QVector3D(m_xposArray[cx], vertexY(cx, cy),
+                                      vertexZ(cx, cy));
+            }
+
+            for (int t = 0; t < 2; t++) {
+                const int *i = triangles[t];
+                facenormal = QVector3D::crossProduct(corner[i[2]] - corner[i[0]],
+                                                     corner[i[1]] - corner[i[0]]);
+                facenormal.normalize();
+
+                // Distribute normal to each contributed vertex
+                for (int c = 0; c < 3; c++) {
+                    int column = x + cornerX[i[c]];
+
+                    if (column < first || column > last)
+                        continue;
+
+                    n = sums[y + cornerY[i[c]]][column - first];
+                    n[0] += facenormal.x();
+                    n[1] += facenormal.y();
+                    n[2] += facenormal.z();
+                }
+            }
+        }
     }
 
     float ftemp;
 
-    // Normalize freshly updated vertex normals
-    v = m_vertices;
+    // Normalize freshly updated vertex normals into the vertices
+    for (y = 0; y < GAME_LEVEL_GRID_HEIGHT; y++) {
+        SVertex *v = chunk.vertices + y * stride + first - chunk.firstColumn;
+        n = sums[y][0];
+
+        for (x = first; x <= last; x++) {
+            ftemp = LEVEL_NORMAL_SCALE
+                    / sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            v->normal[0] = packByte(n[0], ftemp);
+            v->normal[1] = packByte(n[1], ftemp);
+            v->normal[2] = packByte(n[2], ftemp);
+            n += 3;
+            v++;
+        }
+    }
+}
 
-    for (f = 0; f < GAME_LEVEL_GRID_WIDTH * GAME_LEVEL_GRID_HEIGHT; f++) {
-        ftemp = 1.0f / sqrtf(v[9] * v[9] + v[10] * v[10] + v[11] * v[11]);
-        v[9] *= ftemp;
-        v[10] *= ftemp;
-        v[11] *= ftemp;
-        v += 12;
+
+/*!
+  Calculates the vertex normals of the columns from \a first to \a last
+  of \a chunk directly from the regular grid, with central differences
+  between the neighbouring vertices. The coordinates are gathered into
+  rows first, so that the kernel runs over the columns with SIMD.
+*/
+void GameLevel::gridNormals(SChunk &chunk, int first, int last)
+{
+    int stride = GAME_LEVEL_CHUNK_COLUMNS + 1;
+    int count = last - first + 1;
+    int x;
+    int y;
+    int f;
+
+    // The coordinates of the columns and of one more on each side. Beyond
+    // the ends of the level they are extrapolated from the last two
+    // columns.
+    for (y = 0; y < GAME_LEVEL_GRID_HEIGHT; y++) {
+        float *sy = m_scratchY[y];
+        float *sz = m_scratchZ[y];
+
+        for (f = 0; f < count + 2; f++) {
+            x = first - 1 + f;
+
+            if (x < 0) {
+                sy[f] = 2.0f * vertexY(0, y) - vertexY(1, y);
+                sz[f] = 2.0f * vertexZ(0, y) - vertexZ(1, y);
+            }
+            else if (x > m_columns - 1) {
+                sy[f] = 2.0f * vertexY(m_columns - 1, y)
+                        - vertexY(m_columns - 2, y);
+                sz[f] = 2.0f * vertexZ(m_columns - 1, y)
+                        - vertexZ(m_columns - 2, y);
+            }
+            else {
+                sy[f] = vertexY(x, y);
+                sz[f] = vertexZ(x, y);
+            }
+        }
     }
 
-    // Update the data in our vbo
-    glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-    glBufferData(GL_ARRAY_BUFFER,
-                 m_vertexCount * sizeof(GLfloat) * 12,
-                 m_vertices, GL_STATIC_DRAW);
+    for (y = 0; y < GAME_LEVEL_GRID_HEIGHT; y++) {
+        int low = y > 0 ? y - 1 : 0;
+        int high = y < GAME_LEVEL_GRID_HEIGHT - 1 ? y + 1 : y;
+
+        gridNormalKernel(m_scratchY[y], m_scratchZ[y],
+                         m_scratchY[low], m_scratchZ[low],
+                         m_scratchY[high], m_scratchZ[high],
+                         2.0f * m_columnWidth, count,
+                         m_scratchNormal[0], m_scratchNormal[1],
+                         m_scratchNormal[2]);
+
+        // Interleave the normals into the vertices
+        SVertex *v = chunk.vertices + y * stride + first - chunk.firstColumn;
+
+        for (f = 0; f < count; f++) {
+            v->normal[0] = packByte(m_scratchNormal[0][f], LEVEL_NORMAL_SCALE);
+            v->normal[1] = packByte(m_scratchNormal[1][f], LEVEL_NORMAL_SCALE);
+            v->normal[2] = packByte(m_scratchNormal[2][f], LEVEL_NORMAL_SCALE);
+            v++;
+        }
+    }
+}
+
+
+/*!
+  Draws the visible chunks with \a quadRows rows of quads per column of
+  the index buffer, starting from the index \a firstIndex.
+*/
+void GameLevel::drawChunks(int firstIndex, int quadRows)
+{
+    GameGLState *glState = m_gameInstance->getGLState();
+
+    for (int f = 0; f < m_chunkCount; f++) {
+        const SChunk &chunk = m_chunks[f];
+
+        if (!chunk.visible)
+            continue;
+
+        glState->bindBuffer(GL_ARRAY_BUFFER, chunk.vbo);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(SVertex),
+                              (void*)offsetof(SVertex, position));
+        glVertexAttribPointer(1, 2, GL_SHORT, GL_FALSE, sizeof(SVertex),
+                              (void*)offsetof(SVertex, uv));
+        glVertexAttribPointer(2, 4, GL_BYTE, GL_FALSE, sizeof(SVertex),
+                              (void*)offsetof(SVertex, color));
+        glVertexAttribPointer(3, 3, GL_BYTE, GL_FALSE, sizeof(SVertex),
+                              (void*)offsetof(SVertex, normal));
+
+        glDrawElements(GL_TRIANGLES,
+                       (chunk.lastColumn - chunk.firstColumn) * quadRows * 6,
+                       GL_UNSIGNED_SHORT,
+                       (void*)(firstIndex * sizeof(GLushort)));
+    }
 }
 
 
@@ -656,3 +1320,106 @@ float GameLevel::getNoiseValue(int *rtable, int fx)
     return rval;
 }
 
+
+#ifdef QOTH_BENCHMARK_LEVEL
+/*!
+  Measures recreate(), explosion() and the mesh updates of run() with 64,
+  512 and 4096 columns and prints the times. Must be called in the GL
+  thread.
+*/
+void GameLevel::benchmark(GameInstance *gameInstance)
+{
+    static const int columns[] = { 64, 512, 4096 };
+    const int explosionCount = 200;
+    const int normalRounds = 100;
+    GameRandom *random = gameInstance->getRandom();
+    float xs[explosionCount];
+    QElapsedTimer timer;
+
+    for (int f = 0; f < explosionCount; f++) {
+        xs[f] = GAME_LEVEL_START_X
+                + (GAME_LEVEL_END_X - GAME_LEVEL_START_X) * random->unit();
+    }
+
+    for (int c = 0; c < 3; c++) {
+        GameLevel level(gameInstance, columns[c]);
+        timer.start();
+        level.recreate();
+        level.run(0.0f);
+        glFinish();
+        qint64 recreateTime = timer.elapsed();
+
+        // The craters alone
+        timer.restart();
+
+        for (int f = 0; f < explosionCount; f++)
+            level.explosion(xs[f], level.getHeightAndNormalAt(xs[f], 0),
+                            2.8f);
+
+        level.applyExplosions();
+        qint64 explosionTime = timer.elapsed();
+
+        // Each crater updated into the mesh as in the game
+        level.recreate();
+        level.run(0.0f);
+        glFinish();
+        timer.restart();
+
+        for (int f = 0; f < explosionCount; f++) {
+            level.explosion(xs[f], level.getHeightAndNormalAt(xs[f], 0),
+                            2.8f);
+            level.run(0.0f);
+        }
+
+        glFinish();
+        qint64 updateTime = timer.elapsed();
+
+        // Ten craters a frame, as from simultaneous hits
+        level.recreate();
+        level.run(0.0f);
+        glFinish();
+        timer.restart();
+
+        for (int f = 0; f < explosionCount; f++) {
+            level.explosion(xs[f], level.getHeightAndNormalAt(xs[f], 0),
+                            2.8f);
+
+            if (f % 10 == 9)
+                level.run(0.0f);
+        }
+
+        glFinish();
+        qint64 batchTime = timer.elapsed();
+
+        qDebug() << "Level of" << level.columns() << "columns: recreate"
+                 << recreateTime << "ms," << explosionCount << "explosions"
+                 << explosionTime << "ms, with mesh updates"
+                 << updateTime << "ms, ten a frame" << batchTime << "ms";
+
+        // The vertex normals of the whole level, summed from the faces and
+        // taken from the grid
+        timer.restart();
+
+        for (int f = 0; f < normalRounds; f++)
+            for (int g = 0; g < level.m_chunkCount; g++)
+                level.faceNormals(level.m_chunks[g],
+                                  level.m_chunks[g].firstColumn,
+                                  level.m_chunks[g].lastColumn);
+
+        qint64 faceTime = timer.elapsed();
+        timer.restart();
+
+        for (int f = 0; f < normalRounds; f++)
+            for (int g = 0; g < level.m_chunkCount; g++)
+                level.gridNormals(level.m_chunks[g],
+                                  level.m_chunks[g].firstColumn,
+                                  level.m_chunks[g].lastColumn);
+
+        qint64 gridTime = timer.elapsed();
+
+        qDebug() << "Level of" << level.columns() << "columns:"
+                 << normalRounds << "normal updates from faces" << faceTime
+                 << "ms, from the grid" << gridTime << "ms";
+    }
+}
+#endif
@@ -6,13 +6,37 @@
 #ifndef GAMELEVEL_H
 #define GAMELEVEL_H
 
+#include <QString>
 #include <QVector3D>
 #include <GLES2/gl2.h>
 
-// Size of the level grid
-#define GAME_LEVEL_GRID_WIDTH 64
+#include "GameProgram.h"
+
+// Default number of columns in the level grid. More columns make the
+// craters rounder.
+#ifndef GAME_LEVEL_COLUMNS
+#define GAME_LEVEL_COLUMNS 256
+#endif
+
+// The level shape and its noise are defined for this many columns, the
+// other resolutions sample them.
+#define GAME_LEVEL_BASE_COLUMNS 64
+
+// Rows of the level grid, from the front edge to the back
 #define GAME_LEVEL_GRID_HEIGHT 5
 
+// Quads along the level in one chunk of the mesh. Each chunk has a vertex
+// buffer of its own and is culled and updated separately.
+#define GAME_LEVEL_CHUNK_COLUMNS 64
+
+// Frames after its last update when a chunk drops its copy of the
+// vertices, it is rebuilt when needed again
+#define GAME_LEVEL_CHUNK_IDLE_FRAMES 600
+
+// Explosions queued for the next run(), more than these apply the queue
+// right away
+#define GAME_LEVEL_MAX_EXPLOSIONS 32
+
 // Attributes for level vertex creation
 const float noise_mul[GAME_LEVEL_GRID_HEIGHT] =
     {0.1f, 0.1f, 0.5f, 0.7f, 0.0f};
@@ -25,6 +49,10 @@ const float zarray[GAME_LEVEL_GRID_HEIGHT] =
 const float varray[GAME_LEVEL_GRID_HEIGHT] =
     { -1.5f/3.0f, 1.5f/3.0f, 3.0f/3.0f, 4.5/3.0, 4.0f };
 
+// Identifies the level files and their layout
+#define GAME_LEVEL_FILE_MAGIC 0x4c564c51
+#define GAME_LEVEL_FILE_VERSION 1
+
 // Level base size
 #define GAME_LEVEL_START_X -29.0f
 #define GAME_LEVEL_END_X 29.0f
@@ -36,46 +64,137 @@ class GameInstance;
 
 class GameLevel
 {
+public: // Data types
+
+    // Header of a level file. The peaks, the original peaks and the
+    // destroyed values of the columns follow it as floats, and then the
+    // random array. All in the byte order of the device.
+    struct SLevelFileHeader {
+        quint32 magic;
+        quint32 version;
+        qint32 columns;
+        quint32 seed;
+        qint32 baseColumns;
+        qint32 rows;
+    };
+
+    // Packed vertex of the level mesh. The position is in floats and the
+    // other attributes in fixed point, the shaders scale them back.
+    struct SVertex {
+        GLfloat position[3];
+        GLshort uv[2];
+        GLbyte color[4]; // Destroyed, snow, unused, rock
+        GLbyte normal[4]; // The last one only pads the vertex
+    };
+
+    // Explosion waiting for the next run()
+    struct SExplosion {
+        float x;
+        float y;
+        float r;
+
+        // Columns within the radius
+        int from;
+        int to;
+    };
+
+    struct SChunk {
+        int firstColumn;
+        int lastColumn; // Shared with the next chunk
+        GLuint vbo;
+        SVertex *vertices; // Owned, 0 while dropped
+
+        // Columns changed since the last update, first > last when none
+        int dirtyFirst;
+        int dirtyLast;
+        int updateFrame;
+        bool visible;
+
+        // Bounding sphere
+        float center[3];
+        float radius;
+    };
+
 public:
-    GameLevel(GameInstance *gameInstance);
+    GameLevel(GameInstance *gameInstance,
+              int columns = GAME_LEVEL_COLUMNS);
     ~GameLevel();
 
 public:
     void recreate();
+    void recreate(unsigned int seed);
+    bool save(const QString &fileName) const;
+    bool load(const QString &fileName);
     void destroy();
     void run(float frameTime);
     void render();
     float getHeightAndNormalAt(float x, QVector3D *normalTarget);
+    void getHeightsAndNormals(const float *xs, int n, float *heights,
+                              QVector3D *normals);
     void explosion(float x, float y, float r);
+    void applyExplosions();
+
+    inline int columns() const { return m_columns; }
+    inline unsigned int seed() const { return m_seed; }
+    inline int chunkCount() const { return m_chunkCount; }
+
+    // Changes whenever the ground changes shape
+    inline int revision() const { return m_revision; }
+
+#ifdef QOTH_BENCHMARK_LEVEL
+    static void benchmark(GameInstance *gameInstance);
+#endif
 
 protected:
-    void recreateVertices();
-    void recreateNormals();
-    void updateMesh();
+    void allocateColumns(int columns);
+    void recreateColumns();
+    void recreateChunks();
+    void recreateNormals(int first, int last);
+    void markChanged(int first, int last);
+    void buildChunk(SChunk &chunk);
+    void updateChunk(SChunk &chunk);
+    void faceNormals(SChunk &chunk, int first, int last);
+    void gridNormals(SChunk &chunk, int first, int last);
+    void drawChunks(int firstIndex, int quadRows);
+    float vertexY(int x, int y) const;
+    float vertexZ(int x, int y) const;
+    int vertexRandom(int x, int y, int n) const;
 
 private:
     float getNoiseValue(int *rtable, int fx);
 
 protected: // Data
     GameInstance *m_gameInstance;
-    QVector3D m_normalArray[GAME_LEVEL_GRID_WIDTH];
-    char m_randomArray[GAME_LEVEL_GRID_WIDTH][GAME_LEVEL_GRID_HEIGHT];
-    float m_peakArray[GAME_LEVEL_GRID_WIDTH];
-    float m_originalPeakArray[GAME_LEVEL_GRID_WIDTH];
-    float m_destroyedArray[GAME_LEVEL_GRID_WIDTH];
-    float m_xposArray[GAME_LEVEL_GRID_WIDTH + 1];
-    GLfloat *m_vertices;
-    GLushort *m_indices;
-    int m_vertexCount;
-    int m_indexCount;
-    bool m_forceUpdate;
-    GLint m_rockProgram;
-    GLint m_rockFragmentShader;
-    GLint m_program;
-    GLint m_fragmentShader;
-    GLint m_vertexShader;
-    GLuint m_vbo;
-    GLuint m_indexBuffer;
+    int m_columns;
+    float m_columnWidth;
+    unsigned int m_seed;
+    char m_randomArray[GAME_LEVEL_BASE_COLUMNS][GAME_LEVEL_GRID_HEIGHT];
+
+    // The column arrays share one allocation, m_columnData
+    float *m_columnData; // Owned
+    float *m_peakArray;
+    float *m_originalPeakArray;
+    float *m_destroyedArray;
+    float *m_xposArray; // m_columns + 1 entries
+    float *m_noiseArray; // m_columns * GAME_LEVEL_GRID_HEIGHT entries
+    float *m_uArray; // Texture coordinate along the level
+    QVector3D *m_normalArray; // Owned
+
+    SChunk *m_chunks; // Owned
+    int m_chunkCount;
+    int m_frame;
+    int m_revision;
+    SExplosion m_explosions[GAME_LEVEL_MAX_EXPLOSIONS];
+    int m_explosionCount;
+    GameProgram m_rockProgram;
+    GameProgram m_program;
+    GLuint m_indexBuffer; // Shared by the chunks
+
+    // Rows of coordinates and normals for gridNormals(), the coordinates
+    // with one more column on each side
+    float m_scratchY[GAME_LEVEL_GRID_HEIGHT][GAME_LEVEL_CHUNK_COLUMNS + 3];
+    float m_scratchZ[GAME_LEVEL_GRID_HEIGHT][GAME_LEVEL_CHUNK_COLUMNS + 3];
+    float m_scratchNormal[3][GAME_LEVEL_CHUNK_COLUMNS + 1];
 };
 
 
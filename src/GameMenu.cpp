@@ -7,6 +7,7 @@
 #include <QApplication>
 #include <math.h>
 
+#include "GameGLState.h"
 #include "GameInstance.h"
 #include "GameObject.h"
 #include "TextureManager.h"
@@ -34,7 +35,9 @@ GameMenu::GameMenu(GameInstance *gameInstance,
       m_counter(0.0f),
       m_finished(false)
 {
-    m_textTexture = gameInstance->getTextureManager()->getTexture(":/texts.png");
+    TextureManager *textureManager = gameInstance->getTextureManager();
+    m_textHandle = textureManager->handle(GAME_MENU_TEXTURE);
+    m_textTexture = textureManager->texture(m_textHandle);
 }
 
 
@@ -50,6 +53,10 @@ GameMenu::~GameMenu()
 */
 bool GameMenu::run(float frameTime)
 {
+    // The menu appears when its texture has been loaded.
+    if (!m_gameInstance->getTextureManager()->isLoaded(m_textHandle))
+        return true;
+
     m_counter += frameTime;
     if (m_selected != -1)
         m_selectedCounter += frameTime * 6.0f;
@@ -89,21 +96,24 @@ bool GameMenu::run(float frameTime)
 */
 void GameMenu::render()
 {
-    GLuint program = m_gameInstance->getObjectManager()->m_program;
+    if (!m_gameInstance->getTextureManager()->isLoaded(m_textHandle))
+        return;
+
+    const GameProgram &program = m_gameInstance->getObjectManager()->m_program;
+    GameGLState *glState = m_gameInstance->getGLState();
 
-    glUseProgram(program);
+    glState->useProgram(program);
 
-    glDisable(GL_DEPTH_TEST);
-    glDepthMask(GL_FALSE);
+    glState->disable(GL_DEPTH_TEST);
+    glState->depthMask(false);
 
-    glUniformMatrix4fv(glGetUniformLocation(program, "projMatrix"),
+    glUniformMatrix4fv(program.location(GameProgram::ProjMatrix),
                        1, GL_FALSE, m_gameInstance->getProjectionMatrix());
-    glUniform1i(glGetUniformLocation(program, "sampler2d"), 0);
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
-    glBindTexture(GL_TEXTURE_2D, m_textTexture);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
+    glState->bindBuffer(GL_ARRAY_BUFFER, 0);
+    glState->setVertexAttribArrays(0x3);
+    glState->bindTexture(m_textTexture);
+    glState->enable(GL_BLEND);
+    glState->blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
     GLfloat col[4];
     col[0] = 1.0f;
@@ -115,7 +125,7 @@ void GameMenu::render()
         col[3] = 1.0f;
 
     col[3] -= m_selectedCounter;
-    glUniform4fv(glGetUniformLocation(program, "pcol"), 1, col);
+    glUniform4fv(program.location(GameProgram::Color), 1, col);
 
     // Vertex coordinates
     GLfloat vertices[] = { -4.0f, -1.0f, 0.0f, 4.0f, -1.0f, 0.0f,
@@ -157,7 +167,7 @@ void GameMenu::select(int button)
 
 /*!
 */
-void GameMenu::drawText(GLuint program,
+void GameMenu::drawText(const GameProgram &program,
                         float x, float y,
                         float scale, float angle, int index)
 {
@@ -179,7 +189,7 @@ void GameMenu::drawText(GLuint program,
     m[3] = x;
     m[7] = y;
     m[11] = -10.0f;
-    glUniformMatrix4fv(glGetUniformLocation(program, "transMatrix"),
+    glUniformMatrix4fv(program.location(GameProgram::TransMatrix),
                        1, GL_FALSE, m);
 
     // Render the quad
@@ -10,6 +10,7 @@
 
 // Forward declarations
 class GameInstance;
+class GameProgram;
 
 
 class GameMenu
@@ -27,7 +28,7 @@ public:
     void select(int button); // "press" button
 
 protected:
-    void drawText(GLuint program,
+    void drawText(const GameProgram &program,
                   float x,
                   float y,
                   float scale,
@@ -36,6 +37,7 @@ protected:
 
 protected: // Data
     GameInstance *m_gameInstance;
+    int m_textHandle; // Handle of the text texture in the TextureManager
     GLuint m_textTexture;
     int m_logoIndex;
     int m_button1Index;
@@ -7,8 +7,12 @@
 #include <math.h>
 
 #include "GameWindow.h"
+#include "GameGLState.h"
 #include "GameInstance.h"
 #include "GameLevel.h"
+#include "GameProgramCache.h"
+#include "GameRandom.h"
+#include "GameSpriteBatch.h"
 #include "trace.h"
 
 
@@ -37,6 +41,8 @@ const char* strGOVertexShader =
      //   "texCoord = uv;"
 "}";
 
+static const char *objectAttributes[] = { "vertex", "uv" };
+
 
 /*!
   \class GameObject
@@ -49,6 +55,9 @@ const char* strGOVertexShader =
 */
 GameObject::GameObject(GameInstance *gameInstance)
     : m_gameInstance(gameInstance),
+      m_groundQueryX(0.0f),
+      m_groundQueryHeight(0.0f),
+      m_groundQueryRevision(-1),
       m_lightness(1.0f),
       m_alpha(1.0f),
       m_depthEnabled(true),
@@ -69,6 +78,7 @@ GameObject::GameObject(GameInstance *gameInstance)
 {
     m_upvector[0] = 0.0f;
     m_upvector[1] = 1.0f;
+    setTextureID(0);
 }
 
 
@@ -101,7 +111,18 @@ void GameObject::run(float frameTime)
     if (!l)
         return;
 
-    float gheight = l->getHeightAndNormalAt(m_pos.x(), &m_groundNormal);
+    float gheight;
+
+    // The ground looked up by GameObjectManager is valid if the object
+    // moved where it was expected to and the ground hasn't changed since.
+    if (m_groundQueryRevision == l->revision()
+            && m_groundQueryX == m_pos.x()) {
+        gheight = m_groundQueryHeight;
+        m_groundNormal = m_groundQueryNormal;
+    }
+    else {
+        gheight = l->getHeightAndNormalAt(m_pos.x(), &m_groundNormal);
+    }
 
     if (fabsf(m_pos.z()) > 0.8f) {
         float zofs = m_pos.z() - 0.8f;
@@ -167,32 +188,11 @@ void GameObject::run(float frameTime)
 
 
 /*!
+  Adds the object's quad, transformed with \a m, into \a batch.
 */
-void GameObject::render(GameObjectManager *gameObjectMgr, float *m)
+void GameObject::render(GameSpriteBatch *batch, float *m)
 {
-    GLfloat col[4];
-
-    if (m_flipX)
-        col[0] = -1.0f;
-    else
-        col[0] = 1.0f;
-
-    if (m_flipY)
-        col[1] = -1.0f;
-    else
-        col[1] = 1.0f;
-
-    col[2] = m_lightness;
-    col[3] = m_alpha; // General alpha
-
-    int colorLocation = glGetUniformLocation(gameObjectMgr->m_program, "pcol");
-    glUniform4fv(colorLocation, 1, col);
-
-    int location = glGetUniformLocation(gameObjectMgr->m_program, "transMatrix");
-    glUniformMatrix4fv(location, 1, GL_FALSE, m);
-
-    // Draws the object as quad
-    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+    batch->addQuad(m, m_uv, m_flipX, m_flipY, m_lightness, m_alpha);
 }
 
 
@@ -213,7 +213,7 @@ void GameObject::pushForce(QVector3D &pos, float r, float power)
 
     m_dir += temp * d;
 
-    if ((rand() & 255) < 128)
+    if (m_gameInstance->getRandom()->byte() < 128)
         m_dir.setZ(0.0f);
 
     m_onGround = false;
@@ -243,64 +243,17 @@ bool GameObject::isDead()
 */
 GameObjectManager::GameObjectManager(GameInstance *gameInstance)
     : m_gameInstance(gameInstance),
-      m_objectList(0)
+      m_objectList(0),
+      m_renderList(0),
+      m_renderListCapacity(0),
+      m_groundXs(0),
+      m_groundHeights(0),
+      m_groundNormals(0),
+      m_groundCapacity(0)
 {
-
-    // Shader
-    GLint retval;
-    m_fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(m_fragmentShader, 1,
-                   (const char**)&strGOFragmentShader, NULL);
-    glCompileShader(m_fragmentShader);
-    glGetShaderiv(m_fragmentShader, GL_COMPILE_STATUS, &retval);
-
-    if (!retval)
-        DEBUG_INFO("FAILED TO COMPILE FRAGMENT SHADER!");
-    else
-        DEBUG_INFO("Fragment shader compiled successfully!");
-
-    m_vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(m_vertexShader, 1,
-                   (const char**)&strGOVertexShader, NULL);
-    glCompileShader(m_vertexShader);
-    glGetShaderiv(m_vertexShader, GL_COMPILE_STATUS, &retval);
-
-    if (!retval)
-        DEBUG_INFO("FAILED TO COMPILE VERTEX SHADER!");
-    else
-        DEBUG_INFO("Vertex shader compiled successfully!");
-
-    // Program
-    m_program = glCreateProgram();
-    glAttachShader(m_program, m_fragmentShader);
-    glAttachShader(m_program, m_vertexShader);
-
-    // Bind the custom vertex attributes
-    glBindAttribLocation(m_program, 0, "vertex");
-    glBindAttribLocation(m_program, 1, "uv");
-
-    glLinkProgram(m_program);
-    glGetProgramiv(m_program, GL_LINK_STATUS, &retval);
-
-    if (!retval)
-        DEBUG_INFO("FAILED TO LINK PROGRAM!");
-    else
-        DEBUG_INFO("Program linked successfully!");
-
-    glUniform1i(glGetUniformLocation(m_program, "sampler2d"), 0);
-    glGenBuffers(1, &m_vbo);
-
-    // Pass the vertex data
-    GLfloat vertices[] = { -1.0f, -1.0f, 0.0f, 0.0f, 0.0f,
-                           1.0f, -1.0f, 0.0f, 1.0f, 0.0f,
-                           1.0f, 1.0f, 0.0f,  1.0f, 1.0f,
-                           -1.0f, 1.0f, 0.0f, 0.0f, 1.0f };
-
-    glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-    glBufferData(GL_ARRAY_BUFFER, 4 * sizeof(GLfloat) * 5,
-                 vertices, GL_STATIC_DRAW);
-
-
+    m_program.setProgram(m_gameInstance->getProgramCache()->program(
+            strGOVertexShader, strGOFragmentShader, objectAttributes, 2));
+    m_spriteBatch = new GameSpriteBatch(m_gameInstance);
 }
 
 
@@ -310,10 +263,11 @@ GameObjectManager::GameObjectManager(GameInstance *gameInstance)
 GameObjectManager::~GameObjectManager()
 {
     destroyAll();
-    glDeleteBuffers(1, &m_vbo);
-    glDeleteProgram(m_program);
-    glDeleteShader(m_fragmentShader);
-    glDeleteShader(m_vertexShader);
+    delete m_spriteBatch;
+    delete [] m_renderList;
+    delete [] m_groundXs;
+    delete [] m_groundHeights;
+    delete [] m_groundNormals;
 }
 
 
@@ -325,6 +279,8 @@ void GameObjectManager::run(float frameTime)
     GameObject *l = m_objectList;
     GameObject *next;
 
+    queryGround(frameTime);
+
     // Run the objects and destoy the dead ones from the list.
     while (l) {
         next = l->m_next;
@@ -378,40 +334,34 @@ void GameObjectManager::run(float frameTime)
 
 
 /*!
+  Renders the background (\a bgObjects true) or the foreground objects.
+  The visible objects are drawn through the sprite batch, sorted by texture
+  within each run of depth tested objects so that the objects sharing a
+  texture end up in the same draw call. The objects without depth test keep
+  their Z order.
 */
 void GameObjectManager::render(bool bgObjects)
 {
-    bool depthTest(true);
-    glEnable(GL_DEPTH_TEST);
-    glDepthMask(GL_FALSE);
-
-    glUseProgram(m_program);
-    glUniformMatrix4fv(glGetUniformLocation(m_program, "projMatrix"),
-                       1, GL_FALSE, m_gameInstance->getProjectionMatrix());
-    glUniform1i(glGetUniformLocation(m_program, "sampler2d"), 0);
-
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
+    int objectCount = 0;
+    GameObject *l = m_objectList;
 
-    glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
+    while (l) {
+        objectCount++;
+        l = l->m_next;
+    }
 
-    glVertexAttribPointer(0,3, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 5, 0);
-    glVertexAttribPointer(1,2, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 5,
-                          (void*)(sizeof(GLfloat) * 3));
+    if (objectCount > m_renderListCapacity) {
+        delete [] m_renderList;
+        m_renderListCapacity = objectCount * 2;
+        m_renderList = new GameObject*[m_renderListCapacity];
+    }
 
-    float id[16];
-    float m[16];
-    memset(id, 0, sizeof(float) * 16);
-    id[0] = 1.0f;
-    id[5] = 1.0f;
-    id[10] = 1.0f;
-    id[15] = 1.0f;
-    GLuint currentTexture = 90000;
     bool isBgObj;
+    float extent;
+    int count = 0;
+    int culled = 0;
 
-    GameObject *l = m_objectList;
+    l = m_objectList;
 
     while (l) {
         if (l->pos().z() < 0.3f)
@@ -424,54 +374,161 @@ void GameObjectManager::render(bool bgObjects)
 
         if ((bgObjects == true && isBgObj == true) ||
             (bgObjects == false && isBgObj == false)) {
-            if (l->depthEnabled() != depthTest) {
-                if (l->depthEnabled()) {
-                    glEnable(GL_DEPTH_TEST);
-                }
-                else {
-                    glDisable(GL_DEPTH_TEST);
-                }
-
-                depthTest = l->depthEnabled();
-            }
+            // Bounding sphere of the quad, including the offset of the
+            // sprites not centered at their position.
+            extent = l->r() * 1.415f
+                    * (l->aspect() > 1.0f ? l->aspect() : 1.0f / l->aspect());
+
+            if (l->isCenterSprite() == false)
+                extent += l->r();
+
+            if (m_gameInstance->isSphereVisible(
+                        l->pos().x(), l->pos().y(),
+                        l->pos().z() + GAME_LEVEL_ZBASE, extent))
+                m_renderList[count++] = l;
+            else
+                culled++;
+        }
 
-            memcpy(m, id, sizeof(float) * 16);
-            m[3] = l->pos().x();
-            m[7] = l->pos().y();
-            m[11] = l->pos().z() + GAME_LEVEL_ZBASE;
+        l = l->m_next;
+    }
 
-            m[0] = l->getUpVector()[1] * l->r();
-            m[1] = l->getUpVector()[0] * l->r();
-            m[4] = m[1];
-            m[5] = -m[0];
+    m_gameInstance->addRenderCounts(count, culled);
 
-            if (l->isCenterSprite() == false) {
-                m[3] -= m[1];
-                m[7] += m[0];
-            }
+    if (count == 0)
+        return;
 
-            if (l->aspect() != 1.0f) {
-                m[4] *= l->aspect();
-                m[5] *= l->aspect();
-                m[0] *= (1.0f / l->aspect());
-                m[1] *= (1.0f / l->aspect());
-            }
+    sortByTexture(count);
 
-            if (currentTexture != l->m_textureID) {
-                currentTexture = l->m_textureID;
-                glBindTexture(GL_TEXTURE_2D, l->m_textureID);
-            }
+    float id[16];
+    float m[16];
+    memset(id, 0, sizeof(float) * 16);
+    id[0] = 1.0f;
+    id[5] = 1.0f;
+    id[10] = 1.0f;
+    id[15] = 1.0f;
+
+    m_spriteBatch->begin();
+
+    for (int f = 0; f < count; f++) {
+        l = m_renderList[f];
+        m_spriteBatch->setState(l->m_textureID, l->depthEnabled());
 
-            m_gameInstance->cameraTransform(m);
-            l->render(this, m);
+        memcpy(m, id, sizeof(float) * 16);
+        m[3] = l->pos().x();
+        m[7] = l->pos().y();
+        m[11] = l->pos().z() + GAME_LEVEL_ZBASE;
+
+        m[0] = l->getUpVector()[1] * l->r();
+        m[1] = l->getUpVector()[0] * l->r();
+        m[4] = m[1];
+        m[5] = -m[0];
+
+        if (l->isCenterSprite() == false) {
+            m[3] -= m[1];
+            m[7] += m[0];
         }
 
-        l = l->m_next;
+        if (l->aspect() != 1.0f) {
+            m[4] *= l->aspect();
+            m[5] *= l->aspect();
+            m[0] *= (1.0f / l->aspect());
+            m[1] *= (1.0f / l->aspect());
+        }
+
+        m_gameInstance->cameraTransform(m);
+        l->render(m_spriteBatch, m);
     }
 
-    glDisableVertexAttribArray(0);
-    glDisableVertexAttribArray(1);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    m_spriteBatch->end();
+}
+
+
+/*!
+  Looks the ground up for all the running objects with one call to
+  GameLevel::getHeightsAndNormals(), at the positions they move to in
+  \a frameTime.
+*/
+void GameObjectManager::queryGround(float frameTime)
+{
+    GameLevel *level = m_gameInstance->getLevel();
+
+    if (!level)
+        return;
+
+    int objectCount = 0;
+    GameObject *l;
+
+    for (l = m_objectList; l; l = l->m_next)
+        objectCount++;
+
+    if (objectCount > m_groundCapacity) {
+        delete [] m_groundXs;
+        delete [] m_groundHeights;
+        delete [] m_groundNormals;
+        m_groundCapacity = objectCount * 2;
+        m_groundXs = new float[m_groundCapacity];
+        m_groundHeights = new float[m_groundCapacity];
+        m_groundNormals = new QVector3D[m_groundCapacity];
+    }
+
+    int count = 0;
+
+    for (l = m_objectList; l; l = l->m_next) {
+        if (l->isRunEnabled())
+            m_groundXs[count++] = (l->pos() + l->dir() * frameTime).x();
+    }
+
+    level->getHeightsAndNormals(m_groundXs, count, m_groundHeights,
+                                m_groundNormals);
+
+    int revision = level->revision();
+    count = 0;
+
+    for (l = m_objectList; l; l = l->m_next) {
+        if (l->isRunEnabled()) {
+            l->setGroundQuery(m_groundXs[count], m_groundHeights[count],
+                              m_groundNormals[count], revision);
+            count++;
+        }
+    }
+}
+
+
+/*!
+  Stable sorts the first \a count objects of the render list by their
+  texture within each run of consecutive depth tested objects.
+*/
+void GameObjectManager::sortByTexture(int count)
+{
+    int runStart = 0;
+
+    while (runStart < count) {
+        if (m_renderList[runStart]->depthEnabled() == false) {
+            runStart++;
+            continue;
+        }
+
+        int runEnd = runStart + 1;
+
+        while (runEnd < count && m_renderList[runEnd]->depthEnabled())
+            runEnd++;
+
+        for (int f = runStart + 1; f < runEnd; f++) {
+            GameObject *o = m_renderList[f];
+            int g = f - 1;
+
+            while (g >= runStart
+                   && m_renderList[g]->m_textureID > o->m_textureID) {
+                m_renderList[g + 1] = m_renderList[g];
+                g--;
+            }
+
+            m_renderList[g + 1] = o;
+        }
+
+        runStart = runEnd;
+    }
 }
 
 
@@ -8,8 +8,11 @@
 #include <QVector3D>
 #include <GLES2/gl2.h>
 
+#include "GameProgram.h"
+#include "TextureManager.h"
+
 class GameInstance;
-class GameObjectManager;
+class GameSpriteBatch;
 
 // A speed below bouncing/movement stops completely
 #define BOUNCE_SPEED_LIMIT 15.0f
@@ -28,6 +31,17 @@ public:
     inline void setTextureID(unsigned int textureID)
     {
         m_textureID = textureID;
+        m_uv[0] = 0.0f;
+        m_uv[1] = 0.0f;
+        m_uv[2] = 1.0f;
+        m_uv[3] = 1.0f;
+    }
+
+    // Uses the image's \a region, e.g. in a texture atlas, as the sprite
+    inline void setTextureRegion(const TextureManager::STextureRegion &region)
+    {
+        m_textureID = region.textureID;
+        memcpy(m_uv, region.uv, sizeof(m_uv));
     }
 
     void setDepthEnabled(bool set) { m_depthEnabled = set; }
@@ -50,7 +64,7 @@ public:
     inline void setLightness(float lightness) { m_lightness = lightness; }
 
     virtual void run(float frameTime);
-    virtual void render(GameObjectManager *gameObjectMgr, float *m);
+    virtual void render(GameSpriteBatch *batch, float *m);
     virtual void pushForce(QVector3D &pos, float r, float power);
 
     virtual void hit(GameObject *target,
@@ -82,6 +96,17 @@ public:
     inline bool isCenterSprite() { return m_centerSprite; }
     inline void setCenterSprite(bool set) { m_centerSprite = set; }
 
+    // Ground at \a x looked up ahead of run(), while the level is at
+    // \a revision
+    inline void setGroundQuery(float x, float height,
+                               const QVector3D &normal, int revision)
+    {
+        m_groundQueryX = x;
+        m_groundQueryHeight = height;
+        m_groundQueryNormal = normal;
+        m_groundQueryRevision = revision;
+    }
+
 public: // Data
     GameObject *m_next; // Next item in game object list
     unsigned int m_textureID;
@@ -89,6 +114,10 @@ public: // Data
 protected: // Data
     GameInstance *m_gameInstance;
     QVector3D m_groundNormal;
+    QVector3D m_groundQueryNormal;
+    float m_groundQueryX;
+    float m_groundQueryHeight;
+    int m_groundQueryRevision;
     float m_lightness;
     float m_alpha;
     bool m_depthEnabled;
@@ -106,6 +135,7 @@ protected: // Data
     bool m_moveOnGround;
     float m_powerResponse;
     bool m_centerSprite;
+    GLfloat m_uv[4]; // Texture rectangle: left, top, right, bottom
     QVector3D m_pos;
     QVector3D m_dir;
 };
@@ -125,15 +155,27 @@ public:
     void destroyAll();
     void pushObjects(QVector3D &pos, float r, float power);
 
+protected:
+    void queryGround(float frameTime);
+    void sortByTexture(int count);
+
 public: // Data
     GameInstance *m_gameInstance;
-    GLuint m_program;
+    GameProgram m_program;
 
 protected: // Data
     GameObject *m_objectList;
-    GLuint m_fragmentShader;
-    GLuint m_vertexShader;
-    GLuint m_vbo;
+    GameSpriteBatch *m_spriteBatch; // Owned
+
+    // Visible objects of the render pass in drawing order
+    GameObject **m_renderList;
+    int m_renderListCapacity;
+
+    // Positions and results of the batched ground lookup
+    float *m_groundXs;
+    float *m_groundHeights;
+    QVector3D *m_groundNormals;
+    int m_groundCapacity;
 };
 
 
@@ -11,6 +11,7 @@
 
 #include "GameInstance.h"
 #include "GameLevel.h"
+#include "GameRandom.h"
 #include "ParticleEngine.h"
 #include "TextureManager.h"
 
@@ -31,7 +32,7 @@ GameAmmunition::GameAmmunition(GameInstance *gameInstance)
     : GameObject(gameInstance),
       m_whistleInstance(0)
 {
-    setTextureID(gameInstance->getTextureManager()->getTexture(":/ammo1.png"));
+    setTextureRegion(gameInstance->textureRegion(GameInstance::TextureAmmo));
     m_r = 0.1f;
     m_powerResponse = 0.05f;
 
@@ -67,18 +68,13 @@ void GameAmmunition::run(float frameTime)
     ParticleEngine *particleEngine = m_gameInstance->getParticleEngine();
 
     // Emit particles among the line our position is moved according dir.
-    QVector3D ofs = m_pos - expos;
-    float len = ofs.length();
+    float len = (m_pos - expos).length();
     int steps = (int)(len / 0.05f) + 1;
     QVector3D d;
-    ofs /= (float)steps;
 
-    while (steps > 0) {
-        QVector3D p = expos + ofs*(float)steps;
-        particleEngine->emitParticles(
-            1, m_gameInstance->m_smallSmokeParticle, p, 0.025f, d, 0.5f);
-        steps--;
-    }
+    particleEngine->emitParticleLine(
+        steps, m_gameInstance->m_smallSmokeParticle, m_pos, expos,
+        0.025f, d, 0.5f);
 
     // Play'n'control whistling sound as we go.
     if (m_whistleInstance) {
@@ -126,7 +122,7 @@ void GameAmmunition::hit(GameObject *hitObj,
     if (m_gameInstance->audioEnabled()) {
         m_gameInstance->m_sampleExplosion->playWithMixer(
                     *m_gameInstance->getMixer())->setSpeed(
-                        0.8f + (rand() & 255) / 255.0f * 0.2f);
+                        0.8f + m_gameInstance->getRandom()->unit() * 0.2f);
     }
 
     // Emit different types of particles
@@ -155,14 +151,15 @@ void GameAmmunition::hit(GameObject *hitObj,
     m_gameInstance->getObjectManager()->pushObjects(m_pos, 5.0f, 100.0f);
 
     // Add few burning pieces flying away from the blast site.
-    int bp = 4 + (rand() & 3);
+    GameRandom *random = m_gameInstance->getRandom();
+    int bp = 4 + (random->byte() & 3);
 
     while (bp > 0) {
         GameObject *o = m_gameInstance->getObjectManager()->addObject(
                     new GameBurningPiece(m_gameInstance));
         o->pos() = m_pos;
-        o->dir().setX(((float)(rand() & 255) - 128.0f) / 3.0f);
-        o->dir().setY(((float)(rand() & 255) - 128.0f) / 3.0f);
+        o->dir().setX(((float)random->byte() - 128.0f) / 3.0f);
+        o->dir().setY(((float)random->byte() - 128.0f) / 3.0f);
         bp--;
     }
 
@@ -183,11 +180,11 @@ void GameAmmunition::hit(GameObject *hitObj,
 */
 GameBurningPiece::GameBurningPiece(GameInstance *gameInstance)
     : GameObject(gameInstance),
-      m_lifeTime(0.25f + (float)(rand() & 255) / 128.0f),
-      m_burnParticleCounter((float)(rand() & 255) / 255.0f)
+      m_lifeTime(0.25f + (float)gameInstance->getRandom()->byte() / 128.0f),
+      m_burnParticleCounter(gameInstance->getRandom()->unit())
 {
-    setTextureID(gameInstance->getTextureManager()->getTexture(":/ammo1.png"));
-    m_r = 0.05f + (float)(rand() & 255) / 10000.0f;
+    setTextureRegion(gameInstance->textureRegion(GameInstance::TextureAmmo));
+    m_r = 0.05f + (float)m_gameInstance->getRandom()->byte() / 10000.0f;
     m_gravity = 200.0f;
     m_airFraction = 2.0f;
 }
@@ -249,7 +246,7 @@ void GameBurningPiece::hit(GameObject *hitObj,
     Q_UNUSED(collisionNormal);
 
     // About 50% change to die when hitted (bouncing)
-    if ((rand() & 255) < 128)
+    if (m_gameInstance->getRandom()->byte() < 128)
         die();
 }
 
@@ -269,12 +266,12 @@ GamePlayer::GamePlayer(GameInstance *gameInstance)
       m_health(1.0f),
       m_aiming(false),
       m_hit(0.0f),
-      m_breath((float)(rand() & 255) / 64.0f),
+      m_breath((float)gameInstance->getRandom()->byte() / 64.0f),
       m_head(0),
       m_gun(0),
       m_previousShootArrow(0)
 {
-    setTextureID(gameInstance->getTextureManager()->getTexture(":/player.png"));
+    setTextureRegion(gameInstance->textureRegion(GameInstance::TexturePlayer));
 
     m_r = 0.4f * PLAYER_SCALE;
     m_upvectorTarget[0] = 0.0f;
@@ -286,9 +283,8 @@ GamePlayer::GamePlayer(GameInstance *gameInstance)
 
     m_gun = m_gameInstance->getObjectManager()->addObject(
                 new GameStaticObject(m_gameInstance,
-                                      m_gameInstance
-                                      ->getTextureManager()
-                                      ->getTexture(":/gun.png")));
+                                      m_gameInstance->textureRegion(
+                                          GameInstance::TextureGun)));
     m_gun->setRunEnabled(false);
     m_gun->setr(0.4f * PLAYER_SCALE);
     m_gun->setAspect(0.8f);
@@ -310,8 +306,8 @@ void GamePlayer::createAssets()
 {
     m_head = m_gameInstance->getObjectManager()->addObject(
                 new GameStaticObject(m_gameInstance,
-                                      m_gameInstance->getTextureManager()
-                                      ->getTexture(":/player_head.png")));
+                                      m_gameInstance->textureRegion(
+                                          GameInstance::TexturePlayerHead)));
     m_head->setRunEnabled(false);
     m_head->setr(0.3f * PLAYER_SCALE);
 }
@@ -380,9 +376,9 @@ void GamePlayer::run(float frameTime)
             m_gun->setRunEnabled(true);
             m_head->setRunEnabled(true);
             ((GameStaticObject*)m_gun)->m_angleInc =
-                ((rand() & 255) / 255.0f - 0.5f) * 50.0f;
+                (m_gameInstance->getRandom()->unit() - 0.5f) * 50.0f;
             ((GameStaticObject*)m_head)->m_angleInc =
-                ((rand() & 255) / 255.0f - 0.5f) * 50.0f;
+                (m_gameInstance->getRandom()->unit() - 0.5f) * 50.0f;
         }
 
         return;
@@ -474,9 +470,8 @@ void GamePlayer::setShootVector(QVector3D shootVector)
     if (!m_previousShootArrow) {
         m_previousShootArrow = m_gameInstance->getObjectManager()->addObject(
                     new GameStaticObject(m_gameInstance,
-                                          m_gameInstance
-                                          ->getTextureManager()
-                                          ->getTexture(":/arrow_down.png")));
+                                          m_gameInstance->textureRegion(
+                                              GameInstance::TextureArrowDown)));
 
         m_previousShootArrow->setRunEnabled(false);
         m_previousShootArrow->setDepthEnabled(false);
@@ -498,19 +493,20 @@ void GamePlayer::setShootVector(QVector3D shootVector)
 /*!
   Constructor.
 */
-GameTree::GameTree(GameInstance *gameInstance, unsigned int texture)
+GameTree::GameTree(GameInstance *gameInstance,
+                   const TextureManager::STextureRegion &region)
     : GameObject(gameInstance),
-      m_angle(((float)(rand() & 255) / 255.0f - 0.5f) * 0.2f),
+      m_angle((gameInstance->getRandom()->unit() - 0.5f) * 0.2f),
       m_angleInc(0.0f)
 
 {
-    setTextureID(texture);
-    m_r = 0.9f + (float)(rand() & 255) / 512.0f;
+    setTextureRegion(region);
+    m_r = 0.9f + (float)m_gameInstance->getRandom()->byte() / 512.0f;
     setAspect(1.2f);
     m_centerSprite = false;
     m_moveOnGround = false;
 
-    if ((rand() & 255) < 128)
+    if (m_gameInstance->getRandom()->byte() < 128)
         m_flipX = true;
 
     m_onGround = true;
@@ -544,27 +540,28 @@ void GameTree::pushForce(QVector3D &pos, float r, float power)
 
     if (d > 75.0f) {
         die();
+        GameRandom *random = m_gameInstance->getRandom();
 
         for (int f = 0; f < 4; f++) {
             GameStaticObject *dobj = (GameStaticObject*)
                 m_gameInstance->getObjectManager()->addObject(
-                    new GameStaticObject(m_gameInstance, m_gameInstance
-                                         ->getTextureManager()
-                                         ->getTexture(":/treepart1.png")));
+                    new GameStaticObject(m_gameInstance,
+                                         m_gameInstance->textureRegion(
+                                             GameInstance::TextureTreePart)));
 
             dobj->pos() = QVector3D(
-                m_pos.x() + (((float)(rand() & 255) - 128.0f) / 128.0f) * m_r/2.0f,
+                m_pos.x() + (((float)random->byte() - 128.0f) / 128.0f) * m_r/2.0f,
                 m_pos.y() + m_r * 0.5 + (float)f / 3.0f * m_r,
                 m_pos.z());
 
             dobj->setAirFraction(10.0f);
             dobj->setGravity(300.0f);
 
-            if ((rand() & 255) < 16)
+            if (random->byte() < 16)
                 dobj->burn();
 
             dobj->m_angle = 0.0f;
-            dobj->m_angleInc = 50.0f * ((float)(rand() & 255) / 255.0f - 0.5f);
+            dobj->m_angleInc = 50.0f * (random->unit() - 0.5f);
             dobj->setr(m_r / 2.0f);
         }
     }
@@ -586,8 +583,10 @@ void GameTree::run(float frameTime)
         m_angleInc -= m_angle * frameTime * 15.0f;
         m_angleInc -= m_angleInc * frameTime * 3.0f;
 
-        if ((rand() & 255) < 2) {
-            m_angleInc += (float)((rand() & 255) - 128.0f) / 2048.0f;
+        GameRandom *random = m_gameInstance->getRandom();
+
+        if (random->byte() < 2) {
+            m_angleInc += (float)(random->byte() - 128.0f) / 2048.0f;
         }
     }
 
@@ -608,15 +607,16 @@ void GameTree::run(float frameTime)
 /*!
   Constructor.
 */
-GameStaticObject::GameStaticObject(GameInstance *gameInstance,
-                                   unsigned int texture)
+GameStaticObject::GameStaticObject(
+        GameInstance *gameInstance,
+        const TextureManager::STextureRegion &region)
     : GameObject(gameInstance),
       m_angle(0.0f),
       m_angleInc(0.0f),
       m_burnCounter(-1.0f),
       m_burnParticleCounter(0.0f)
 {
-    setTextureID(texture);
+    setTextureRegion(region);
     m_r = 1.0f;
 }
 
@@ -633,8 +633,8 @@ GameStaticObject::~GameStaticObject()
 */
 void GameStaticObject::burn()
 {
-    m_burnCounter = ((rand() & 255) / 255.0f) * 2.0f;
-    m_burnParticleCounter = (float)(rand() & 255) / 255.0f;
+    m_burnCounter = m_gameInstance->getRandom()->unit() * 2.0f;
+    m_burnParticleCounter = m_gameInstance->getRandom()->unit();
 }
 
 
@@ -695,7 +695,7 @@ void GameStaticObject::hit(GameObject *hitObj,
 
     m_angleInc *= -0.5f;
 
-    if ((rand() & 255) < 100) {
+    if (m_gameInstance->getRandom()->byte() < 100) {
         QVector3D d = collisionNormal * 10.0f;
         ParticleEngine *particleEngine = m_gameInstance->getParticleEngine();
 
@@ -718,10 +718,10 @@ void GameStaticObject::hit(GameObject *hitObj,
   Constructor.
 */
 GameUIObject::GameUIObject(GameInstance *gameInstance,
-                           unsigned int texture)
+                           const TextureManager::STextureRegion &region)
     : GameObject(gameInstance)
 {
-    setTextureID(texture);
+    setTextureRegion(region);
     m_r = 1.0f;
 }
 
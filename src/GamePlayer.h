@@ -111,7 +111,8 @@ protected: // Data
 class GameTree : public GameObject
 {
 public:
-    GameTree(GameInstance *gameInstance, unsigned int texture);
+    GameTree(GameInstance *gameInstance,
+             const TextureManager::STextureRegion &region);
     virtual ~GameTree();
 
 public:
@@ -128,7 +129,8 @@ protected: // Data
 class GameStaticObject : public GameObject
 {
 public:
-    GameStaticObject(GameInstance *gameInstance, unsigned int texture);
+    GameStaticObject(GameInstance *gameInstance,
+                     const TextureManager::STextureRegion &region);
     virtual ~GameStaticObject();
 
 public:
@@ -152,7 +154,8 @@ protected: // Data
 class GameUIObject : public GameObject
 {
 public:
-    GameUIObject(GameInstance *gameInstance, unsigned int texture);
+    GameUIObject(GameInstance *gameInstance,
+                 const TextureManager::STextureRegion &region);
     virtual ~GameUIObject();
 
 public:
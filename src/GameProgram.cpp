@@ -0,0 +1,51 @@
+/**
+ * Copyright (c) 2011-2014 Microsoft Mobile.
+ */
+
+#include "GameProgram.h"
+
+// Names of the GameProgram::Uniform values in the shaders
+static const char *uniformNames[GameProgram::UniformCount] = {
+    "projMatrix",
+    "viewMatrix",
+    "transMatrix",
+    "sampler2d",
+    "pcol",
+    "time",
+    "motion",
+    "fade"
+};
+
+
+/*!
+  \class GameProgram
+  \brief A linked shader program with its uniform locations resolved once,
+  so that the renderers don't need to query them for every draw.
+*/
+
+
+/*!
+  Constructor.
+*/
+GameProgram::GameProgram()
+    : m_program(0)
+{
+    for (int f = 0; f < UniformCount; f++)
+        m_locations[f] = -1;
+}
+
+
+/*!
+  Sets \a program as the wrapped program and resolves its uniform
+  locations. The program must already be linked.
+*/
+void GameProgram::setProgram(GLuint program)
+{
+    m_program = program;
+
+    for (int f = 0; f < UniformCount; f++) {
+        m_locations[f] = program ? glGetUniformLocation(program,
+                                                        uniformNames[f])
+                                 : -1;
+    }
+}
@@ -0,0 +1,44 @@
+/**
+ * Copyright (c) 2011-2014 Microsoft Mobile.
+ */
+
+#ifndef GAMEPROGRAM_H
+#define GAMEPROGRAM_H
+
+#include <GLES2/gl2.h>
+
+
+class GameProgram
+{
+public:
+    // The uniforms used by the game's shaders
+    enum Uniform {
+        ProjMatrix,
+        ViewMatrix,
+        TransMatrix,
+        Sampler,
+        Color,
+        Time,
+        Motion,
+        Fade,
+        UniformCount
+    };
+
+    GameProgram();
+
+public:
+    void setProgram(GLuint program);
+    inline GLuint program() const { return m_program; }
+
+    // Location of the uniform, -1 if the program doesn't have it
+    inline GLint location(Uniform uniform) const
+    {
+        return m_locations[uniform];
+    }
+
+protected: // Data
+    GLuint m_program;
+    GLint m_locations[UniformCount];
+};
+
+#endif // GAMEPROGRAM_H
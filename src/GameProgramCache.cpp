@@ -0,0 +1,340 @@
+/**
+ * Copyright (c) 2011-2014 Microsoft Mobile.
+ */
+
+#include "GameProgramCache.h"
+
+#include <EGL/egl.h>
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDesktopServices>
+#include <QDir>
+#include <QFile>
+#include <string.h>
+
+#include "trace.h"
+
+
+/*!
+  \class GameProgramCache
+  \brief Compiles and links the shader programs of the game and keeps
+  them for its lifetime.
+
+  Each program is identified by the hash of its sources and attributes, so
+  asking for the same program again returns the program already linked.
+  With GL_OES_get_program_binary the linked binaries are stored into a
+  cache file, and on later launches the programs are loaded from the
+  binaries instead of compiling the sources. The cache file is tied to the
+  GL driver it was written with and is dropped when the driver changes.
+  A binary rejected by the driver is compiled from the sources again.
+
+  Define QOTH_NO_PROGRAM_BINARIES to always compile the sources.
+*/
+
+
+/*!
+  Constructor. Must be called in the GL thread. Reads the binaries cached
+  by the previous launches.
+*/
+GameProgramCache::GameProgramCache()
+    : m_dirty(false),
+      m_compiledCount(0),
+      m_loadedCount(0),
+      m_getProgramBinary(0),
+      m_programBinary(0)
+{
+    m_driver.append((const char*)glGetString(GL_VENDOR));
+    m_driver.append('\n');
+    m_driver.append((const char*)glGetString(GL_RENDERER));
+    m_driver.append('\n');
+    m_driver.append((const char*)glGetString(GL_VERSION));
+
+#ifndef QOTH_NO_PROGRAM_BINARIES
+    const char *extensions = (const char*)glGetString(GL_EXTENSIONS);
+    GLint formatCount = 0;
+
+    if (extensions && strstr(extensions, "GL_OES_get_program_binary"))
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formatCount);
+
+    if (formatCount > 0) {
+        m_getProgramBinary = (PFNGLGETPROGRAMBINARYOESPROC)
+                eglGetProcAddress("glGetProgramBinaryOES");
+        m_programBinary = (PFNGLPROGRAMBINARYOESPROC)
+                eglGetProcAddress("glProgramBinaryOES");
+    }
+#endif
+
+    if (!m_getProgramBinary || !m_programBinary) {
+        DEBUG_INFO("No program binaries, compiling the shaders");
+        m_getProgramBinary = 0;
+        m_programBinary = 0;
+        return;
+    }
+
+    QString directory =
+            QDesktopServices::storageLocation(QDesktopServices::CacheLocation);
+
+    if (!directory.isEmpty() && QDir().mkpath(directory)) {
+        m_fileName = directory + "/" + PROGRAM_CACHE_FILE;
+        load();
+    }
+}
+
+
+/*!
+  Destructor. Stores the binaries linked since save() and deletes the
+  programs.
+*/
+GameProgramCache::~GameProgramCache()
+{
+    save();
+
+    QHash<QByteArray, GLuint>::const_iterator i;
+
+    for (i = m_programs.constBegin(); i != m_programs.constEnd(); ++i)
+        glDeleteProgram(i.value());
+
+    for (i = m_shaders.constBegin(); i != m_shaders.constEnd(); ++i)
+        glDeleteShader(i.value());
+}
+
+
+/*!
+  Returns the program of \a vertexSource and \a fragmentSource, with the
+  vertex attributes \a attributes bound to the locations from 0 up to
+  \a attributeCount - 1. The program is owned by the cache. Returns 0 if
+  the program can't be linked.
+*/
+GLuint GameProgramCache::program(const char *vertexSource,
+                                 const char *fragmentSource,
+                                 const char * const *attributes,
+                                 int attributeCount)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(vertexSource, strlen(vertexSource) + 1);
+    hash.addData(fragmentSource, strlen(fragmentSource) + 1);
+
+    for (int f = 0; f < attributeCount; f++)
+        hash.addData(attributes[f], strlen(attributes[f]) + 1);
+
+    QByteArray key = hash.result();
+    GLuint program = m_programs.value(key, 0);
+
+    if (program)
+        return program;
+
+    if (m_binaries.contains(key)) {
+        program = glCreateProgram();
+
+        if (loadBinary(program, m_binaries.value(key))) {
+            m_loadedCount++;
+            m_programs.insert(key, program);
+            return program;
+        }
+
+        DEBUG_INFO("Program binary rejected, compiling the shaders");
+        glDeleteProgram(program);
+        m_binaries.remove(key);
+        m_dirty = true;
+    }
+
+    program = compile(vertexSource, fragmentSource, attributes,
+                      attributeCount);
+
+    if (program) {
+        m_compiledCount++;
+        m_programs.insert(key, program);
+        storeBinary(key, program);
+    }
+
+    return program;
+}
+
+
+/*!
+  Writes the binaries into the cache file if programs have been linked
+  since the file was read or written.
+*/
+void GameProgramCache::save()
+{
+    if (!m_dirty || m_fileName.isEmpty())
+        return;
+
+    m_dirty = false;
+
+    QFile file(m_fileName);
+
+    if (!file.open(QIODevice::WriteOnly)) {
+        DEBUG_INFO("Failed to write the program cache");
+        return;
+    }
+
+    QDataStream out(&file);
+    out << (quint32)PROGRAM_CACHE_MAGIC << (quint32)PROGRAM_CACHE_VERSION;
+    out << m_driver << (qint32)m_binaries.size();
+
+    QHash<QByteArray, SProgramBinary>::const_iterator i;
+
+    for (i = m_binaries.constBegin(); i != m_binaries.constEnd(); ++i)
+        out << i.key() << (quint32)i.value().format << i.value().data;
+}
+
+
+/*!
+  Reads the binaries of the cache file. A file written with another
+  driver or in another layout is ignored.
+*/
+void GameProgramCache::load()
+{
+    QFile file(m_fileName);
+
+    if (!file.open(QIODevice::ReadOnly))
+        return;
+
+    QDataStream in(&file);
+    quint32 magic = 0;
+    quint32 version = 0;
+    QByteArray driver;
+    qint32 count = 0;
+    in >> magic >> version >> driver >> count;
+
+    if (in.status() != QDataStream::Ok || magic != PROGRAM_CACHE_MAGIC
+            || version != PROGRAM_CACHE_VERSION || driver != m_driver) {
+        DEBUG_INFO("Program cache out of date");
+        m_dirty = true;
+        return;
+    }
+
+    for (int f = 0; f < count; f++) {
+        QByteArray key;
+        quint32 format = 0;
+        SProgramBinary binary;
+        in >> key >> format >> binary.data;
+
+        if (in.status() != QDataStream::Ok) {
+            DEBUG_INFO("Program cache truncated");
+            m_binaries.clear();
+            m_dirty = true;
+            return;
+        }
+
+        binary.format = format;
+        m_binaries.insert(key, binary);
+    }
+}
+
+
+/*!
+  Compiles and links a program from the sources. The shaders are kept for
+  the other programs sharing them.
+*/
+GLuint GameProgramCache::compile(const char *vertexSource,
+                                 const char *fragmentSource,
+                                 const char * const *attributes,
+                                 int attributeCount)
+{
+    GLuint vertexShader = shader(GL_VERTEX_SHADER, vertexSource);
+    GLuint fragmentShader = shader(GL_FRAGMENT_SHADER, fragmentSource);
+
+    if (!vertexShader || !fragmentShader)
+        return 0;
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, fragmentShader);
+    glAttachShader(program, vertexShader);
+
+    // Bind the custom vertex attributes
+    for (int f = 0; f < attributeCount; f++)
+        glBindAttribLocation(program, f, attributes[f]);
+
+    glLinkProgram(program);
+
+    GLint retval;
+    glGetProgramiv(program, GL_LINK_STATUS, &retval);
+
+    if (!retval) {
+        DEBUG_INFO("FAILED TO LINK PROGRAM!");
+        glDeleteProgram(program);
+        return 0;
+    }
+
+    return program;
+}
+
+
+/*!
+  Returns the compiled shader of \a type and \a source, compiling it unless
+  it has been compiled for another program already. Returns 0 on an error.
+*/
+GLuint GameProgramCache::shader(GLenum type, const char *source)
+{
+    QByteArray key(source);
+    GLuint shader = m_shaders.value(key, 0);
+
+    if (shader)
+        return shader;
+
+    shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+
+    GLint retval;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &retval);
+
+    if (!retval) {
+        if (type == GL_VERTEX_SHADER)
+            DEBUG_INFO("FAILED TO COMPILE VERTEX SHADER!");
+        else
+            DEBUG_INFO("FAILED TO COMPILE FRAGMENT SHADER!");
+
+        glDeleteShader(shader);
+        return 0;
+    }
+
+    m_shaders.insert(key, shader);
+    return shader;
+}
+
+
+/*!
+  Loads \a binary into \a program. Returns false if the driver rejects it.
+*/
+bool GameProgramCache::loadBinary(GLuint program,
+                                  const SProgramBinary &binary)
+{
+    m_programBinary(program, binary.format, binary.data.constData(),
+                    binary.data.size());
+
+    GLint retval;
+    glGetProgramiv(program, GL_LINK_STATUS, &retval);
+    return retval != 0;
+}
+
+
+/*!
+  Reads the binary of the linked \a program for the cache file.
+*/
+void GameProgramCache::storeBinary(const QByteArray &key, GLuint program)
+{
+    if (!m_getProgramBinary)
+        return;
+
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+
+    if (length <= 0)
+        return;
+
+    SProgramBinary binary;
+    binary.data.resize(length);
+    GLsizei written = 0;
+    m_getProgramBinary(program, length, &written, &binary.format,
+                       binary.data.data());
+
+    if (written <= 0)
+        return;
+
+    binary.data.resize(written);
+    m_binaries.insert(key, binary);
+    m_dirty = true;
+}
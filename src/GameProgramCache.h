@@ -0,0 +1,67 @@
+/**
+ * Copyright (c) 2011-2014 Microsoft Mobile.
+ */
+
+#ifndef GAMEPROGRAMCACHE_H
+#define GAMEPROGRAMCACHE_H
+
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+
+// Name of the program binary cache file in the cache directory
+#define PROGRAM_CACHE_FILE "programs.bin"
+
+// Identifies the cache file and its layout
+#define PROGRAM_CACHE_MAGIC 0x51505243
+#define PROGRAM_CACHE_VERSION 1
+
+
+class GameProgramCache
+{
+public: // Data types
+
+    struct SProgramBinary {
+        GLenum format;
+        QByteArray data;
+    };
+
+public:
+    GameProgramCache();
+    ~GameProgramCache();
+
+public:
+    GLuint program(const char *vertexSource, const char *fragmentSource,
+                   const char * const *attributes, int attributeCount);
+    void save();
+
+    // Programs linked from the sources and loaded as binaries
+    inline int compiledCount() const { return m_compiledCount; }
+    inline int loadedCount() const { return m_loadedCount; }
+
+protected:
+    void load();
+    GLuint compile(const char *vertexSource, const char *fragmentSource,
+                   const char * const *attributes, int attributeCount);
+    GLuint shader(GLenum type, const char *source);
+    bool loadBinary(GLuint program, const SProgramBinary &binary);
+    void storeBinary(const QByteArray &key, GLuint program);
+
+protected: // Data
+    QString m_fileName;
+    QByteArray m_driver; // Vendor, renderer and version of the GL
+    QHash<QByteArray, GLuint> m_programs; // Owned, by the key of the sources
+    QHash<QByteArray, GLuint> m_shaders; // Owned, by the source
+    QHash<QByteArray, SProgramBinary> m_binaries;
+    bool m_dirty;
+    int m_compiledCount;
+    int m_loadedCount;
+
+    // Entry points of GL_OES_get_program_binary, 0 without the extension
+    PFNGLGETPROGRAMBINARYOESPROC m_getProgramBinary;
+    PFNGLPROGRAMBINARYOESPROC m_programBinary;
+};
+
+#endif // GAMEPROGRAMCACHE_H
@@ -0,0 +1,69 @@
+/**
+ * Copyright (c) 2011-2014 Microsoft Mobile.
+ */
+
+#include "GameRandom.h"
+
+
+/*!
+  \class GameRandom
+  \brief Small seeded pseudo random generator. The same seed always gives
+  the same sequence, which makes the game's randomness reproducible.
+*/
+
+
+/*!
+  Constructor.
+*/
+GameRandom::GameRandom(unsigned int seed)
+    : m_seed(0),
+      m_state(0)
+{
+    setSeed(seed);
+}
+
+
+/*!
+  Restarts the sequence from \a seed.
+*/
+void GameRandom::setSeed(unsigned int seed)
+{
+    m_seed = seed;
+
+    // Xorshift never leaves the zero state; scramble the seed so that also
+    // small consecutive seeds give unrelated sequences.
+    m_state = seed * 2654435761u + 0x9e3779b9u;
+
+    if (m_state == 0)
+        m_state = 0x9e3779b9u;
+}
+
+
+/*!
+  Fills \a count bytes of \a target with random values, four bytes per
+  generator step.
+*/
+void GameRandom::fillBytes(unsigned char *target, int count)
+{
+    unsigned int r;
+
+    while (count >= 4) {
+        r = next();
+        target[0] = (unsigned char)r;
+        target[1] = (unsigned char)(r >> 8);
+        target[2] = (unsigned char)(r >> 16);
+        target[3] = (unsigned char)(r >> 24);
+        target += 4;
+        count -= 4;
+    }
+
+    if (count > 0) {
+        r = next();
+
+        while (count > 0) {
+            *target++ = (unsigned char)r;
+            r >>= 8;
+            count--;
+        }
+    }
+}
@@ -0,0 +1,40 @@
+/**
+ * Copyright (c) 2011-2014 Microsoft Mobile.
+ */
+
+#ifndef GAMERANDOM_H
+#define GAMERANDOM_H
+
+
+class GameRandom
+{
+public:
+    GameRandom(unsigned int seed = 1);
+
+public:
+    void setSeed(unsigned int seed);
+    inline unsigned int seed() const { return m_seed; }
+
+    // Next 32 random bits (xorshift32)
+    inline unsigned int next()
+    {
+        m_state ^= m_state << 13;
+        m_state ^= m_state >> 17;
+        m_state ^= m_state << 5;
+        return m_state;
+    }
+
+    // Random value in range [0, 255], replaces (rand() & 255)
+    inline int byte() { return (int)(next() >> 24); }
+
+    // Random value in range [0, 1]
+    inline float unit() { return (float)byte() / 255.0f; }
+
+    void fillBytes(unsigned char *target, int count);
+
+protected: // Data
+    unsigned int m_seed;
+    unsigned int m_state;
+};
+
+#endif // GAMERANDOM_H
@@ -0,0 +1,238 @@
+/**
+ * Copyright (c) 2011-2014 Microsoft Mobile.
+ */
+
+#include "GameSpriteBatch.h"
+
+#include "GameGLState.h"
+#include "GameInstance.h"
+#include "GameProgramCache.h"
+#include "trace.h"
+
+
+// Shader for the batched sprites. The vertices are in the camera space and
+// carry the lightness and the alpha of their sprite.
+const char* strSpriteBatchFragmentShader =
+    "uniform sampler2D sampler2d;\n"
+    "varying mediump vec2 texCoord;\n"
+    "varying mediump vec2 shade;\n"
+    "void main (void)\n"
+    "{\n"
+    "    gl_FragColor = texture2D(sampler2d, texCoord)*vec4(shade.x, shade.x, shade.x, shade.y);\n"
+    "}";
+
+const char* strSpriteBatchVertexShader =
+    "attribute highp vec3 vertex;\n"
+    "attribute mediump vec2 uv;\n"
+    "attribute mediump vec2 shadeIn;\n"
+    "uniform mediump mat4 projMatrix;\n"
+    "varying mediump vec2 texCoord;\n"
+    "varying mediump vec2 shade;\n"
+    "void main(void)\n"
+    "{\n"
+    "    gl_Position = vec4(vertex, 1.0) * projMatrix;\n"
+    "    texCoord = uv;\n"
+    "    shade = shadeIn;\n"
+    "}";
+
+static const char *spriteBatchAttributes[] = { "vertex", "uv", "shadeIn" };
+
+
+/*!
+  \class GameSpriteBatch
+  \brief Collects the sprite quads of consecutive draws sharing a texture
+  and depth state and draws them with a single call.
+
+  The quads are transformed on the CPU and streamed into a vertex buffer.
+  The collected quads are drawn when the texture or the depth state
+  changes, when the batch is full and at end().
+*/
+
+
+/*!
+  Constructor.
+*/
+GameSpriteBatch::GameSpriteBatch(GameInstance *gameInstance)
+    : m_gameInstance(gameInstance),
+      m_streamOffset(0),
+      m_quadCount(0),
+      m_texture(0),
+      m_depthEnabled(true),
+      m_drawCount(0)
+{
+    m_program.setProgram(m_gameInstance->getProgramCache()->program(
+            strSpriteBatchVertexShader, strSpriteBatchFragmentShader,
+            spriteBatchAttributes, 3));
+
+    glGenBuffers(1, &m_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+    glBufferData(GL_ARRAY_BUFFER,
+                 SPRITE_BATCH_STREAM_QUADS * 4 * sizeof(SpriteVertex),
+                 0, GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // Static indices for two triangles per quad
+    GLushort indices[SPRITE_BATCH_MAX_QUADS * 6];
+
+    for (int f = 0; f < SPRITE_BATCH_MAX_QUADS; f++) {
+        indices[f * 6 + 0] = (GLushort)(f * 4 + 0);
+        indices[f * 6 + 1] = (GLushort)(f * 4 + 1);
+        indices[f * 6 + 2] = (GLushort)(f * 4 + 2);
+        indices[f * 6 + 3] = (GLushort)(f * 4 + 0);
+        indices[f * 6 + 4] = (GLushort)(f * 4 + 2);
+        indices[f * 6 + 5] = (GLushort)(f * 4 + 3);
+    }
+
+    glGenBuffers(1, &m_indexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices,
+                 GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+
+/*!
+  Destructor.
+*/
+GameSpriteBatch::~GameSpriteBatch()
+{
+    glDeleteBuffers(1, &m_vbo);
+    glDeleteBuffers(1, &m_indexBuffer);
+}
+
+
+/*!
+  Starts collecting sprites. Sets up the program and the blending shared
+  by all the batches.
+*/
+void GameSpriteBatch::begin()
+{
+    GameGLState *glState = m_gameInstance->getGLState();
+    glState->useProgram(m_program);
+    glUniformMatrix4fv(m_program.location(GameProgram::ProjMatrix),
+                       1, GL_FALSE, m_gameInstance->getProjectionMatrix());
+
+    glState->enable(GL_BLEND);
+    glState->blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glState->depthMask(false);
+
+    m_quadCount = 0;
+    m_drawCount = 0;
+}
+
+
+/*!
+  Sets the \a texture and the depth test state for the following quads.
+  The quads collected so far are drawn if either of them changes.
+*/
+void GameSpriteBatch::setState(GLuint texture, bool depthEnabled)
+{
+    if (m_quadCount > 0
+            && (texture != m_texture || depthEnabled != m_depthEnabled))
+        flush();
+
+    m_texture = texture;
+    m_depthEnabled = depthEnabled;
+}
+
+
+/*!
+  Adds a unit quad transformed with the row-major matrix \a m, already
+  including the camera transform. The quad is textured with the rectangle
+  \a uv (left, top, right, bottom) of the current texture. \a flipX and
+  \a flipY mirror the rectangle.
+*/
+void GameSpriteBatch::addQuad(const float *m, const GLfloat *uv,
+                              bool flipX, bool flipY,
+                              float lightness, float alpha)
+{
+    if (m_quadCount >= SPRITE_BATCH_MAX_QUADS)
+        flush();
+
+    static const float corners[4][2] = {
+        { -1.0f, -1.0f }, { 1.0f, -1.0f }, { 1.0f, 1.0f }, { -1.0f, 1.0f }
+    };
+
+    SpriteVertex *v = m_vertices + m_quadCount * 4;
+
+    for (int c = 0; c < 4; c++) {
+        float cx = corners[c][0];
+        float cy = corners[c][1];
+        float u = (cx + 1.0f) * 0.5f;
+        float t = (cy + 1.0f) * 0.5f;
+
+        v->m_pos[0] = m[0] * cx + m[1] * cy + m[3];
+        v->m_pos[1] = m[4] * cx + m[5] * cy + m[7];
+        v->m_pos[2] = m[8] * cx + m[9] * cy + m[11];
+
+        if (flipX)
+            u = 1.0f - u;
+
+        if (flipY)
+            t = 1.0f - t;
+
+        v->m_uv[0] = uv[0] + (uv[2] - uv[0]) * u;
+        v->m_uv[1] = uv[1] + (uv[3] - uv[1]) * t;
+        v->m_shade[0] = lightness;
+        v->m_shade[1] = alpha;
+        v++;
+    }
+
+    m_quadCount++;
+}
+
+
+/*!
+  Draws the collected quads with one call.
+*/
+void GameSpriteBatch::flush()
+{
+    if (m_quadCount == 0)
+        return;
+
+    // Stream the quads into the vertex buffer. When the buffer is full its
+    // storage is orphaned so that the draws still using it do not stall.
+    int bytes = m_quadCount * 4 * sizeof(SpriteVertex);
+    int streamSize = SPRITE_BATCH_STREAM_QUADS * 4 * sizeof(SpriteVertex);
+    GameGLState *glState = m_gameInstance->getGLState();
+    glState->bindBuffer(GL_ARRAY_BUFFER, m_vbo);
+
+    if (m_streamOffset + bytes > streamSize) {
+        glBufferData(GL_ARRAY_BUFFER, streamSize, 0, GL_STREAM_DRAW);
+        m_streamOffset = 0;
+    }
+
+    glBufferSubData(GL_ARRAY_BUFFER, m_streamOffset, bytes, m_vertices);
+
+    glState->setEnabled(GL_DEPTH_TEST, m_depthEnabled);
+    glState->bindTexture(m_texture);
+    glState->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+    glState->setVertexAttribArrays(0x7);
+
+    char *base = (char*)0 + m_streamOffset;
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(SpriteVertex),
+                          base);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(SpriteVertex),
+                          base + 3 * sizeof(GLfloat));
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(SpriteVertex),
+                          base + 5 * sizeof(GLfloat));
+
+    glDrawElements(GL_TRIANGLES, m_quadCount * 6, GL_UNSIGNED_SHORT, 0);
+
+    m_streamOffset += bytes;
+    m_quadCount = 0;
+    m_drawCount++;
+}
+
+
+/*!
+  Draws the remaining quads and releases the buffers.
+*/
+void GameSpriteBatch::end()
+{
+    flush();
+
+    GameGLState *glState = m_gameInstance->getGLState();
+    glState->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glState->bindBuffer(GL_ARRAY_BUFFER, 0);
+}
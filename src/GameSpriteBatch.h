@@ -0,0 +1,65 @@
+/**
+ * Copyright (c) 2011-2014 Microsoft Mobile.
+ */
+
+#ifndef GAMESPRITEBATCH_H
+#define GAMESPRITEBATCH_H
+
+#include <GLES2/gl2.h>
+
+#include "GameProgram.h"
+
+class GameInstance;
+
+// Maximum number of quads collected before they are drawn
+#define SPRITE_BATCH_MAX_QUADS 256
+
+// Size of the streaming vertex buffer in quads
+#define SPRITE_BATCH_STREAM_QUADS 2048
+
+
+/*!
+  Vertex of a sprite quad in the batched rendering. The position is already
+  transformed to the camera space.
+*/
+struct SpriteVertex
+{
+    GLfloat m_pos[3];
+    GLfloat m_uv[2];
+    GLfloat m_shade[2]; // lightness, alpha
+};
+
+
+class GameSpriteBatch
+{
+public:
+    GameSpriteBatch(GameInstance *gameInstance);
+    virtual ~GameSpriteBatch();
+
+public:
+    void begin();
+    void setState(GLuint texture, bool depthEnabled);
+    void addQuad(const float *m, const GLfloat *uv, bool flipX, bool flipY,
+                 float lightness, float alpha);
+    void flush();
+    void end();
+
+    // Draw calls issued since begin()
+    inline int drawCount() const { return m_drawCount; }
+
+protected: // Data
+    GameInstance *m_gameInstance; // Not owned
+    GameProgram m_program;
+    GLuint m_vbo;
+    GLuint m_indexBuffer;
+    int m_streamOffset;
+
+    // Quads waiting to be drawn and the state they are drawn with
+    SpriteVertex m_vertices[SPRITE_BATCH_MAX_QUADS * 4];
+    int m_quadCount;
+    GLuint m_texture;
+    bool m_depthEnabled;
+    int m_drawCount;
+};
+
+#endif // GAMESPRITEBATCH_H
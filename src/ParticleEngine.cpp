@@ -5,11 +5,46 @@
 #include "ParticleEngine.h"
 
 #include <QMatrix4x4>
+#include <limits.h>
 #include <math.h>
 #include <stdlib.h>
 
+// Select the SIMD flavour of the particle run kernel. Define QOTH_NO_SIMD
+// to force the scalar version. The compact particle state has a kernel of
+// its own.
+#if defined(QOTH_COMPACT_PARTICLES)
+#elif !defined(QOTH_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) \
+    || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+    #define PARTICLE_KERNEL_SSE2
+    #include <emmintrin.h>
+#elif !defined(QOTH_NO_SIMD) && (defined(__ARM_NEON__) || defined(__ARM_NEON))
+    #define PARTICLE_KERNEL_NEON
+    #include <arm_neon.h>
+#endif
+
+#if defined(PARTICLE_KERNEL_SSE2)
+// 32 bit multiply keeping the low halves, SSE2 lacks _mm_mullo_epi32.
+static inline __m128i sse2Mul(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+// Per lane (mask ? a : b)
+static inline __m128i sse2Select(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+#endif
+
+#include "GameGLState.h"
 #include "GameInstance.h"
-#include "GameLevel.h" // For GAME_LEVEL_ZBASE
+#include "GameJobPool.h"
+#include "GameLevel.h" // For the level bounds and GAME_LEVEL_ZBASE
+#include "GameProgramCache.h"
+#include "GameRandom.h"
 #include "trace.h"
 
 
@@ -56,96 +91,401 @@ const char* strParticleVertexShader =
     "}";
 
 
+    // Batched particle programs. The quads are expanded on the CPU; each
+    // vertex carries the particle center, its corner and the size scaled
+    // rotation (cos, sin) of the particle.
+const char* strBatchParticleVertexShader =
+    "attribute highp vec3 vertex;\n"
+    "attribute mediump vec4 corner;\n"
+    "attribute lowp vec4 color;\n"
+    "uniform mediump mat4 viewMatrix;\n"
+    "uniform mediump mat4 projMatrix;\n"
+    "varying mediump vec2 texCoord;\n"
+    "varying lowp vec4 pcol;\n"
+    "varying mediump vec2 rotation;\n"
+    "void main(void)\n"
+    "{\n"
+    "    highp vec3 pos = vertex + vec3(corner.x*corner.z + corner.y*corner.w,\n"
+    "                                   corner.x*corner.w - corner.y*corner.z,\n"
+    "                                   0.0);\n"
+    "    gl_Position = (vec4(pos, 1.0)*viewMatrix) * projMatrix;\n"
+    "    texCoord = vec2(0.5, 0.5)-corner.xy*0.5;\n"
+    "    pcol = color;\n"
+    "    rotation = normalize(corner.zw);\n"
+    "}";
+
+    // GPU evaluated particles. The state at the time since birth is the
+    // closed form solution of the motion in ParticleEngine::runRangeScalar:
+    // the direction decays exponentially by the fraction while the gravity
+    // pulls it down. motion = (fraction, gravity, size inc inc, angle inc inc)
+    // and fade = (fade in, fade out, general visibility).
+const char* strGpuParticleVertexShader =
+    "attribute highp vec4 vertex;\n"
+    "attribute mediump vec2 corner;\n"
+    "attribute lowp vec4 color;\n"
+    "attribute mediump vec4 direction;\n"
+    "attribute mediump vec4 growth;\n"
+    "uniform highp float time;\n"
+    "uniform mediump vec4 motion;\n"
+    "uniform mediump vec3 fade;\n"
+    "uniform mediump mat4 viewMatrix;\n"
+    "uniform mediump mat4 projMatrix;\n"
+    "varying mediump vec2 texCoord;\n"
+    "varying lowp vec4 pcol;\n"
+    "varying mediump vec2 rotation;\n"
+    "void main(void)\n"
+    "{\n"
+    "    highp float t = time - vertex.w;\n"
+    "    highp vec3 pos;\n"
+    "    if (motion.x > 0.0001) {\n"
+    "        highp float drift = motion.y / motion.x;\n"
+    "        pos = vertex.xyz + (direction.xyz + vec3(0.0, drift, 0.0))\n"
+    "              * ((1.0 - exp(-motion.x*t)) / motion.x)\n"
+    "              - vec3(0.0, drift*t, 0.0);\n"
+    "    } else {\n"
+    "        pos = vertex.xyz + direction.xyz*t - vec3(0.0, 0.5*motion.y*t*t, 0.0);\n"
+    "    }\n"
+    "    mediump float size = growth.x + (growth.y + 0.5*motion.z*t)*t;\n"
+    "    mediump float angle = growth.z + (growth.w + 0.5*motion.w*t)*t;\n"
+    "    if (t >= direction.w || size < 0.01)\n"
+    "        size = 0.0;\n"
+    "    rotation = vec2(cos(angle), -sin(angle));\n"
+    "    mediump vec2 r = rotation*size;\n"
+    "    pos += vec3(corner.x*r.x + corner.y*r.y, corner.x*r.y - corner.y*r.x, 0.0);\n"
+    "    gl_Position = (vec4(pos, 1.0)*viewMatrix) * projMatrix;\n"
+    "    texCoord = vec2(0.5, 0.5)-corner*0.5;\n"
+    "    mediump float alpha = min(fade.z, (direction.w - t)*fade.y*fade.z);\n"
+    "    alpha = clamp(min(alpha, t*fade.x), 0.0, 1.0);\n"
+    "    pcol = vec4(color.rgb, alpha);\n"
+    "}";
+
+const char* strBatchParticleFragmentShader =
+    "uniform sampler2D sampler2d;\n"
+    "varying mediump vec2 texCoord;\n"
+    "varying lowp vec4 pcol;\n"
+    "void main (void)\n"
+    "{\n"
+    "    gl_FragColor = texture2D(sampler2d, texCoord)*pcol;\n"
+    "}";
+
+const char* strBatchSmokeParticleFragmentShader =
+    "uniform sampler2D sampler2d;\n"
+    "varying mediump vec2 texCoord;\n"
+    "varying lowp vec4 pcol;\n"
+    "varying mediump vec2 rotation;\n"
+    "void main (void)\n"
+    "{\n"
+    "    mediump vec3 transuv = vec3(-(0.5-texCoord[0]), -(0.5-texCoord[1]), 0.0);\n"
+    "    transuv.z = 1.0-length(transuv)*2.0;\n"
+    "    transuv = normalize(transuv);\n"
+    "    mediump float cmx = -(transuv[0]*rotation.x + transuv[1]*rotation.y);\n"
+    "    mediump float cmy = -(transuv[0]*rotation.y - transuv[1]*rotation.x);\n"
+    "    mediump float cm = clamp(transuv.z*0.3+cmx*1.4 + cmy*0.7, 0.0, 1.0);\n"
+    "    gl_FragColor = texture2D(sampler2d, texCoord)*vec4(pcol.yyz*cm, pcol[3]);\n"
+    "}";
+
+// Vertex attributes of the per particle and the batched programs
+static const char *particleAttributes[] = { "vertex", "uv" };
+static const char *batchAttributes[] = {
+    "vertex", "corner", "color", "direction", "growth"
+};
+
+
 
 /*!
-  \class Particle
-  \brief -
+  Runs one chunk of the particles for ParticleEngine::run.
 */
+class ParticleRunJob : public GameJob
+{
+public:
+    ParticleRunJob(ParticleEngine *engine, int count, int chunkSize,
+                   int fixedFrameTime)
+        : m_engine(engine),
+          m_count(count),
+          m_chunkSize(chunkSize),
+          m_fixedFrameTime(fixedFrameTime)
+    {
+    }
+
+    void run(int index)
+    {
+        int first = index * m_chunkSize;
+        int last = first + m_chunkSize;
+
+        if (last > m_count)
+            last = m_count;
+
+        m_engine->runRange(first, last, m_fixedFrameTime);
+    }
+
+protected: // Data
+    ParticleEngine *m_engine;
+    int m_count;
+    int m_chunkSize;
+    int m_fixedFrameTime;
+};
+
 
 
 /*!
-  Constructor.
+  \class ParticleStore
+  \brief Structure-of-arrays storage for the particles of a ParticleEngine.
 */
-Particle::Particle()
-    : m_type(0),
-      m_lifeTime(0),
-      m_aliveCounter(0),
-      m_angle(0),
-      m_angleInc(0),
-      m_size(0),
-      m_sizeInc(0),
-      m_color(0)
 
+
+/*!
+  Constructor. Allocates room for \a capacity particles, rounded up to
+  PARTICLE_STORE_ALIGN.
+*/
+ParticleStore::ParticleStore(int capacity)
+    : m_data(0),
+      m_capacity(0)
 {
-    memset(m_pos, 0, sizeof(int) * 3);
-    memset(m_dir, 0, sizeof(int) * 3);
+    m_capacity = (capacity + PARTICLE_STORE_ALIGN - 1)
+            & ~(PARTICLE_STORE_ALIGN - 1);
+
+#ifdef QOTH_COMPACT_PARTICLES
+    void **arrays[] = { (void**)&m_pos[0], (void**)&m_pos[1],
+                        (void**)&m_pos[2],
+                        (void**)&m_dir[0], (void**)&m_dir[1],
+                        (void**)&m_dir[2],
+                        (void**)&m_lifeTime, (void**)&m_aliveCounter,
+                        (void**)&m_angle, (void**)&m_angleInc,
+                        (void**)&m_size, (void**)&m_sizeInc,
+                        (void**)&m_color[0], (void**)&m_color[1],
+                        (void**)&m_color[2],
+                        (void**)&m_typeIndex, (void**)&m_bucketIndex };
+
+    const int elementSizes[] = { 2, 2, 2, 2, 2, 2, 2, 2,
+                                 2, 2, 2, 2, 1, 1, 1, 1, 2 };
+
+    for (int f = 0; f < PARTICLE_MAX_TYPES; f++) {
+        m_maxLifeTime[f] = 1;
+        m_angleIncShift[f] = 0;
+        m_sizeShift[f] = 0;
+        m_sizeIncShift[f] = 0;
+    }
+
+    m_originX = (int)((GAME_LEVEL_START_X + GAME_LEVEL_END_X) * 2048.0f);
+#else
+    void **arrays[] = { (void**)&m_pos[0], (void**)&m_pos[1],
+                        (void**)&m_pos[2],
+                        (void**)&m_dir[0], (void**)&m_dir[1],
+                        (void**)&m_dir[2],
+                        (void**)&m_lifeTime, (void**)&m_aliveCounter,
+                        (void**)&m_angle, (void**)&m_angleInc,
+                        (void**)&m_size, (void**)&m_sizeInc,
+                        (void**)&m_color,
+                        (void**)&m_fraction, (void**)&m_gravity,
+                        (void**)&m_turbulenceMul,
+                        (void**)&m_sizeIncInc, (void**)&m_angleIncInc,
+                        (void**)&m_bucketIndex, (void**)&m_type };
+
+    const int elementSizes[] = { 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+                                 4, 4, 4, 4, 4, 4, sizeof(ParticleType*) };
+#endif
+
+    const int arrayCount = sizeof(arrays) / sizeof(void**);
+
+    // Every array starts at 16 byte boundary.
+    int totalSize = 15;
+
+    for (int f = 0; f < arrayCount; f++)
+        totalSize += ((m_capacity * elementSizes[f]) + 15) & ~15;
+
+    m_data = new char[totalSize];
+    memset(m_data, 0, totalSize);
+
+    char *d = (char*)(((size_t)m_data + 15) & ~(size_t)15);
+
+    for (int f = 0; f < arrayCount; f++) {
+        *arrays[f] = d;
+        d += ((m_capacity * elementSizes[f]) + 15) & ~15;
+    }
+
+    for (int f = 0; f < m_capacity; f++)
+        m_bucketIndex[f] = -1;
 }
 
 
 /*!
   Destructor.
 */
-Particle::~Particle()
+ParticleStore::~ParticleStore()
+{
+    delete [] m_data;
+}
+
+
+/*!
+  Copies the particle at slot \a from over the one at slot \a to.
+*/
+void ParticleStore::copy(int from, int to)
 {
+    m_pos[0][to] = m_pos[0][from];
+    m_pos[1][to] = m_pos[1][from];
+    m_pos[2][to] = m_pos[2][from];
+    m_dir[0][to] = m_dir[0][from];
+    m_dir[1][to] = m_dir[1][from];
+    m_dir[2][to] = m_dir[2][from];
+    m_lifeTime[to] = m_lifeTime[from];
+    m_aliveCounter[to] = m_aliveCounter[from];
+    m_angle[to] = m_angle[from];
+    m_angleInc[to] = m_angleInc[from];
+    m_size[to] = m_size[from];
+    m_sizeInc[to] = m_sizeInc[from];
+#ifdef QOTH_COMPACT_PARTICLES
+    m_color[0][to] = m_color[0][from];
+    m_color[1][to] = m_color[1][from];
+    m_color[2][to] = m_color[2][from];
+    m_typeIndex[to] = m_typeIndex[from];
+#else
+    m_color[to] = m_color[from];
+    m_fraction[to] = m_fraction[from];
+    m_gravity[to] = m_gravity[from];
+    m_turbulenceMul[to] = m_turbulenceMul[from];
+    m_sizeIncInc[to] = m_sizeIncInc[from];
+    m_angleIncInc[to] = m_angleIncInc[from];
+    m_type[to] = m_type[from];
+#endif
+    m_bucketIndex[to] = m_bucketIndex[from];
 }
 
 
 /*!
+  Sets \a type as the type of the particle at slot \a p. The type must
+  already have a live list.
 */
-void Particle::run(ParticleEngine *engine, int fixedFrameTime)
+void ParticleStore::setType(int p, ParticleType *type)
 {
-    // Move
-    m_pos[0] += (((m_dir[0] >> 2) * fixedFrameTime) >> 10);
-    m_pos[1] += (((m_dir[1] >> 2) * fixedFrameTime) >> 10);
-    m_pos[2] += (((m_dir[2] >> 2) * fixedFrameTime) >> 10);
+#ifdef QOTH_COMPACT_PARTICLES
+    int b = type->m_bucket;
+    int maxLifeTime = type->m_lifeTime + type->m_lifeTimeRandom;
+    m_maxLifeTime[b] = (maxLifeTime > 0) ? maxLifeTime : 1;
+    m_typeIndex[p] = (unsigned char)b;
+
+    // The largest values the particles of the type can reach during their
+    // lifetime
+    qint64 life = m_maxLifeTime[b];
+    qint64 angleInc = qAbs(type->m_angleInc) + qAbs(type->m_angleIncRandom)
+            + (qint64)qAbs(type->m_angleIncInc) * life;
+    qint64 sizeInc = qAbs(type->m_sizeInc) + qAbs(type->m_sizeIncRandom)
+            + (qint64)qAbs(type->m_sizeIncInc) * life;
+    qint64 size = qAbs(type->m_size) + qAbs(type->m_sizeRandom)
+            + sizeInc * life / 4096;
+
+    m_angleIncShift[b] = compactShift(angleInc, 32767);
+    m_sizeShift[b] = compactShift(size, 65535);
+    m_sizeIncShift[b] = compactShift(sizeInc, 32767);
+#else
+    m_type[p] = type;
+    m_fraction[p] = type->m_fraction;
+    m_gravity[p] = type->m_gravity;
+    m_turbulenceMul[p] = type->m_turbulenceMul;
+    m_sizeIncInc[p] = type->m_sizeIncInc;
+    m_angleIncInc[p] = type->m_angleIncInc;
+#endif
+}
 
-    // Fraction
-    int te = ((m_type->m_fraction * fixedFrameTime) >> 12);
 
-    if (te > 4096)
-        te = 4096;
+/*!
+  Returns the live list of the type of the particle at slot \a p.
+*/
+int ParticleStore::bucket(int p) const
+{
+#ifdef QOTH_COMPACT_PARTICLES
+    return m_typeIndex[p];
+#else
+    return m_type[p]->m_bucket;
+#endif
+}
 
-    m_dir[0] -= (((m_dir[0]>>2) * te) >> 10);
-    m_dir[1] -= (((m_dir[1]>>2) * te) >> 10);
-    m_dir[2] -= (((m_dir[2]>>2) * te) >> 10);
 
-    // Gravity
-    m_dir[1] -= (((m_type->m_gravity >> 2) * fixedFrameTime) >> 10);
+#ifdef QOTH_COMPACT_PARTICLES
+/*!
+  Returns the smallest shift that brings \a value within \a limit.
+*/
+int ParticleStore::compactShift(qint64 value, int limit)
+{
+    int shift = 0;
+
+    while (value > ((qint64)limit << shift))
+        shift++;
+
+    return shift;
+}
 
-    // Turbulence
-    int turmul = ((m_type->m_turbulenceMul * fixedFrameTime) >> 12);
 
-    if (turmul > 0) {
-        m_dir[0] += ((engine->m_turbulenceMap[
-                      (((engine->m_turbulencePhase+m_pos[1]) >> 10) & 127)]
-                     [(((engine->m_turbulencePhase+m_pos[0]) >> 10) & 127)][0])
-                     * turmul) >> 12;
-        m_dir[1] += ((engine->m_turbulenceMap[
-                      (((engine->m_turbulencePhase+m_pos[1]) >> 10) & 127)]
-                     [(((engine->m_turbulencePhase+m_pos[0]) >> 10) & 127)][1])
-                     * turmul) >> 12;
+/*!
+  Sets the lifetime of the particle at slot \a p. The lifetime is stored
+  relative to the longest lifetime of the particle's type, so the type has
+  to be set first.
+*/
+void ParticleStore::setLifeTime(int p, int fixedLifeTime)
+{
+    if (fixedLifeTime <= 0) {
+        m_lifeTime[p] = 0;
+        return;
     }
 
-    // Size increment
-    m_size += (((m_sizeInc >> 4) * fixedFrameTime) >> 8);
+    qint64 life = (qint64)fixedLifeTime * PARTICLE_COMPACT_LIFE_MAX
+            / m_maxLifeTime[m_typeIndex[p]];
 
-    // Angle increment
-    m_angle += (((m_angleInc >> 4) * fixedFrameTime) >> 8);
+    // A living particle never rounds to zero.
+    if (life < 1)
+        life = 1;
+    else if (life > PARTICLE_COMPACT_LIFE_MAX)
+        life = PARTICLE_COMPACT_LIFE_MAX;
+
+    m_lifeTime[p] = (unsigned short)life;
+}
+#endif
+
+
+/*!
+  \class ParticleRing
+  \brief Vertex buffer and bookkeeping of the GPU evaluated particles of one
+  ParticleType.
+*/
+
+
+/*!
+  Constructor. Creates the vertex buffer for \a capacity particles.
+*/
+ParticleRing::ParticleRing(int capacity)
+    : m_vertices(0),
+      m_deathTime(0),
+      m_capacity(capacity),
+      m_emitted(0),
+      m_uploaded(0),
+      m_retired(0),
+      m_vbo(0)
+{
+    m_vertices = new ParticleGpuVertex[m_capacity * 4];
+    m_deathTime = new float[m_capacity];
+    memset(m_vertices, 0, m_capacity * 4 * sizeof(ParticleGpuVertex));
 
-    // Second phase increments for size and angle increments.
-    m_sizeInc += ((m_type->m_sizeIncInc * fixedFrameTime));
-    m_angleInc += ((m_type->m_angleIncInc * fixedFrameTime));
+    glGenBuffers(1, &m_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+    glBufferData(GL_ARRAY_BUFFER, m_capacity * 4 * sizeof(ParticleGpuVertex),
+                 m_vertices, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
 
-    m_lifeTime -= fixedFrameTime;
-    m_aliveCounter += fixedFrameTime;
 
-    // Particle is dead if size has been dropped below one.
-    if (m_size < 1 << 12)
-        m_lifeTime = 0;
+/*!
+  Destructor.
+*/
+ParticleRing::~ParticleRing()
+{
+    glDeleteBuffers(1, &m_vbo);
+    delete [] m_vertices;
+    delete [] m_deathTime;
 }
 
 
 
+
 /*!
   \class ParticleEngine
   \brief -
@@ -156,224 +496,574 @@ void Particle::run(ParticleEngine *engine, int fixedFrameTime)
   Constructor.
 */
 ParticleEngine::ParticleEngine(GameInstance *gameInstance, int maxParticles)
-    : m_gameInstance(gameInstance),
+    : m_turbulencePhase(0),
+      m_gameInstance(gameInstance),
       m_particles(0),
       m_maxParticles(maxParticles),
-      m_currentParticle(0)
+      m_liveCount(0),
+      m_overflowPolicy(OverflowReplaceOldest),
+      m_victimCursor(0),
+      m_droppedCount(0),
+      m_stolenCount(0),
+      m_bucketCount(0),
+      m_spawnStore(0),
+      m_time(0.0f),
+      m_batchVertices(0),
+      m_streamSize(0),
+      m_streamOffset(0)
 {
-    m_particles = new Particle[maxParticles];
-    memset(m_particles, 0, sizeof(Particle) * maxParticles);
+#ifdef QOTH_COMPACT_PARTICLES
+    // The positions in the live lists are stored in shorts
+    if (m_maxParticles > SHRT_MAX) {
+        DEBUG_INFO("Too many particles for the compact particle state!");
+        m_maxParticles = SHRT_MAX;
+    }
+#endif
+
+    m_particles = new ParticleStore(m_maxParticles);
+
+    for (int f = 0; f < PARTICLE_MAX_TYPES; f++) {
+        m_bucketTypes[f] = 0;
+        m_buckets[f] = 0;
+        m_bucketCounts[f] = 0;
+        m_rings[f] = 0;
+    }
+
+    m_spawnStore = new ParticleStore(1);
 
     for (int f = 0; f < 512; f++) {
         m_cosTable[f] = cosf((float)f / 256.0f  * 3.14159265f);
     }
 
-    // There are two different programs for particles in QOTH. Both of them share the same vertex shader and
-    // only fragment shaders are program specific. We could use GameWindow's glhelpCreateShader  for building
-    // them (to simplify the code), but it would take one additional vertex shader.
-    GLint retval;
-    m_fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(m_fragmentShader, 1,
-                   (const char**)&strParticleFragmentShader, NULL);
-    glCompileShader(m_fragmentShader);
-    glGetShaderiv(m_fragmentShader, GL_COMPILE_STATUS, &retval);
+    // There are two different programs for particles in QOTH. Both of them
+    // share the same vertex shader and only the fragment shaders are
+    // program specific.
+    GameProgramCache *programCache = m_gameInstance->getProgramCache();
+    m_program.setProgram(programCache->program(strParticleVertexShader,
+                                               strParticleFragmentShader,
+                                               particleAttributes, 2));
+    m_smokeProgram.setProgram(
+                programCache->program(strParticleVertexShader,
+                                      strSmokeParticleFragmentShader,
+                                      particleAttributes, 2));
+
+    // Create turbulence map
+    for (int y = 0; y < 128; y++) {
+        for (int x = 0; x < 128; x++) {
+            m_turbulenceMap[y][x][0] =
+                (short)(cosf((float)y / 127.0f * 3.14159f * 6.0f) * 40000.0f);
+            m_turbulenceMap[y][x][1] =
+                (short)(sinf((float)x / 127.0f * 3.14159f * 4.0f)
+                        * sinf((float)y / 127.0f * 3.14159f * 8.0f) * 40000.0f);
+        }
+    }
+
+    // Programs for the batched rendering. The per particle programs above
+    // are still used by the menu background.
+    m_batchProgram.setProgram(
+                programCache->program(strBatchParticleVertexShader,
+                                      strBatchParticleFragmentShader,
+                                      batchAttributes, 5));
+    m_batchSmokeProgram.setProgram(
+                programCache->program(strBatchParticleVertexShader,
+                                      strBatchSmokeParticleFragmentShader,
+                                      batchAttributes, 5));
+    m_gpuProgram.setProgram(
+                programCache->program(strGpuParticleVertexShader,
+                                      strBatchParticleFragmentShader,
+                                      batchAttributes, 5));
+    m_gpuSmokeProgram.setProgram(
+                programCache->program(strGpuParticleVertexShader,
+                                      strBatchSmokeParticleFragmentShader,
+                                      batchAttributes, 5));
+
+    // Streaming vertex buffer, large enough for every particle of the engine
+    // as a quad. The render calls of a frame fill it one after another and
+    // it is orphaned when it runs out of space.
+    m_batchVertices = new ParticleVertex[m_particles->capacity() * 4];
+    m_streamSize = m_particles->capacity() * 4 * sizeof(ParticleVertex);
 
-    if (!retval)
-        DEBUG_INFO("FAILED TO COMPILE FRAGMENT SHADER!");
-    else
-        DEBUG_INFO("Fragment shader compiled successfully!");
+    glGenBuffers(1, &m_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+    glBufferData(GL_ARRAY_BUFFER, m_streamSize, 0, GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-    m_smokeFragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(m_smokeFragmentShader, 1,
-                   (const char**)&strSmokeParticleFragmentShader, NULL);
-    glCompileShader(m_smokeFragmentShader);
-    glGetShaderiv(m_smokeFragmentShader, GL_COMPILE_STATUS, &retval);
+    // Static indices for two triangles per quad. Batches larger than
+    // PARTICLE_BATCH_MAX_QUADS are drawn in several parts reusing these.
+    int quads = m_particles->capacity();
 
-    if (!retval)
-        DEBUG_INFO("FAILED TO COMPILE FRAGMENT SHADER FOR SMOKE PARTICLES!");
-    else
-        DEBUG_INFO("Smoke particle fragment shader compiled successfully!");
+    if (quads > PARTICLE_BATCH_MAX_QUADS)
+        quads = PARTICLE_BATCH_MAX_QUADS;
 
-    m_vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(m_vertexShader, 1,
-                   (const char**)&strParticleVertexShader, NULL);
-    glCompileShader(m_vertexShader);
-    glGetShaderiv(m_vertexShader, GL_COMPILE_STATUS, &retval);
+    GLushort *indices = new GLushort[quads * 6];
 
-    if (!retval)
-        DEBUG_INFO("FAILED TO COMPILE VERTEX SHADER!");
-    else
-        DEBUG_INFO("Vertex shader compiled successfully!");
+    for (int f = 0; f < quads; f++) {
+        indices[f * 6 + 0] = (GLushort)(f * 4 + 0);
+        indices[f * 6 + 1] = (GLushort)(f * 4 + 1);
+        indices[f * 6 + 2] = (GLushort)(f * 4 + 2);
+        indices[f * 6 + 3] = (GLushort)(f * 4 + 0);
+        indices[f * 6 + 4] = (GLushort)(f * 4 + 2);
+        indices[f * 6 + 5] = (GLushort)(f * 4 + 3);
+    }
 
-    m_program = glCreateProgram();
-    glAttachShader(m_program, m_fragmentShader);
-    glAttachShader(m_program, m_vertexShader);
+    glGenBuffers(1, &m_indexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, quads * 6 * sizeof(GLushort),
+                 indices, GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    delete [] indices;
+}
 
-    // Bind the custom vertex attributes
-    glBindAttribLocation(m_program, 0, "vertex");
-    glBindAttribLocation(m_program, 1, "uv");
 
-    glLinkProgram(m_program);
+/*!
+  Destructor.
+*/
+ParticleEngine::~ParticleEngine()
+{
+    glDeleteBuffers(1, &m_vbo);
+    glDeleteBuffers(1, &m_indexBuffer);
+    delete [] m_batchVertices;
+
+    for (int f = 0; f < m_bucketCount; f++) {
+        // Let the type be registered again with another engine.
+        m_bucketTypes[f]->m_bucket = -1;
+        delete [] m_buckets[f];
+        delete m_rings[f];
+    }
 
-    // Check if the linking succeeded in the same way we checked the
-    // compilation success.
-    glGetProgramiv(m_program, GL_LINK_STATUS, &retval);
+    delete m_spawnStore;
+    delete m_particles;
+}
 
-    if (!retval)
-        DEBUG_INFO("FAILED TO LINK PROGRAM!");
-    else
-        DEBUG_INFO("Program linked successfully!");
 
-    glUniform1i(glGetUniformLocation(m_program, "sampler2d"), 0);
+/*!
+  Resets the dropped and stolen particle counters.
+*/
+void ParticleEngine::resetCounters()
+{
+    m_droppedCount = 0;
+    m_stolenCount = 0;
+}
 
-    // Smoke program
-    m_smokeProgram = glCreateProgram();
-    glAttachShader(m_smokeProgram, m_smokeFragmentShader);
-    glAttachShader(m_smokeProgram, m_vertexShader);
 
-     // Bind the custom vertex attributes
-    glBindAttribLocation(m_smokeProgram, 0, "vertex");
-    glBindAttribLocation(m_smokeProgram, 1, "uv");
+/*!
+  Returns a slot for a new particle. Dead slots are used first; when every
+  particle is alive the overflow policy decides whether a live particle is
+  replaced or -1 is returned. The oldest or smallest particle is searched
+  from a window of PARTICLE_VICTIM_WINDOW particles which advances on every
+  replacement, so the choice is approximate but constant time.
+*/
+int ParticleEngine::allocateParticle()
+{
+    if (m_liveCount < m_maxParticles)
+        return m_liveCount++;
 
-    glLinkProgram(m_smokeProgram);
+    if (m_overflowPolicy == OverflowDropNew || m_liveCount == 0)
+        return -1;
 
-    // Check if the linking succeeded.
-    glGetProgramiv(m_smokeProgram, GL_LINK_STATUS, &retval);
+    const ParticleStore *ps = m_particles;
+    int victim = -1;
+    int q;
 
-    if (!retval)
-        DEBUG_INFO("FAILED TO LINK SMOKE PROGRAM!");
-    else
-        DEBUG_INFO("Smoke program linked successfully!");
+    for (int f = 0; f < PARTICLE_VICTIM_WINDOW; f++) {
+        q = m_victimCursor + f;
 
-    glUniform1i(glGetUniformLocation(m_smokeProgram, "sampler2d"), 0);
+        if (q >= m_liveCount)
+            q -= m_liveCount;
 
-    // Create turbulence map
-    for (int y = 0; y < 128; y++) {
-        for (int x = 0; x < 128; x++) {
-            m_turbulenceMap[y][x][0] =
-                (short)(cosf((float)y / 127.0f * 3.14159f * 6.0f) * 40000.0f);
-            m_turbulenceMap[y][x][1] =
-                (short)(sinf((float)x / 127.0f * 3.14159f * 4.0f)
-                        * sinf((float)y / 127.0f * 3.14159f * 8.0f) * 40000.0f);
+        if (victim < 0) {
+            victim = q;
+        }
+        else if (m_overflowPolicy == OverflowReplaceOldest) {
+            if (ps->aliveCounter(q) > ps->aliveCounter(victim))
+                victim = q;
+        }
+        else if (ps->size(q) < ps->size(victim)) {
+            victim = q;
         }
     }
 
-    // create VBO for particles.
-    glGenBuffers(1, &m_vbo);
+    m_victimCursor = (m_victimCursor + PARTICLE_VICTIM_WINDOW) % m_liveCount;
 
-    GLfloat vertices[] = { -1.0f, -1.0f, 0.0f, 1.0f, -1.0f, 0.0f,
-                           1.0f, 1.0f, 0.0f, -1.0f, 1.0f, 0.0f };
+    removeFromBucket(victim);
+    m_stolenCount++;
+    return victim;
+}
 
-    glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-    glBufferData(GL_ARRAY_BUFFER,
-                 4 * sizeof(GLfloat) * 3,
-                 vertices, GL_STATIC_DRAW);
+
+/*!
+  Kills the particle at \a particleIndex and moves the last live particle
+  into its slot to keep the live particles packed.
+*/
+void ParticleEngine::killParticle(int particleIndex)
+{
+    ParticleStore *ps = m_particles;
+    removeFromBucket(particleIndex);
+    int last = --m_liveCount;
+
+    if (particleIndex != last) {
+        ps->copy(last, particleIndex);
+        int bucketIndex = ps->m_bucketIndex[particleIndex];
+
+        if (bucketIndex >= 0)
+            m_buckets[ps->bucket(particleIndex)][bucketIndex] = particleIndex;
+    }
+
+    ps->setLifeTime(last, 0);
+    ps->m_bucketIndex[last] = -1;
 }
 
 
 /*!
-  Destructor.
+  Assigns a live list for \a type. Returns the index of the list or -1 if
+  all PARTICLE_MAX_TYPES lists are already in use.
 */
-ParticleEngine::~ParticleEngine()
+int ParticleEngine::registerType(ParticleType *type)
 {
-    glDeleteBuffers(1, &m_vbo);
-    delete [] m_particles;
+    if (type->m_bucket >= 0)
+        return type->m_bucket;
+
+    if (m_bucketCount >= PARTICLE_MAX_TYPES) {
+        DEBUG_INFO("Too many particle types!");
+        return -1;
+    }
+
+    if (type->m_gpuEvaluated && type->m_turbulenceMul != 0) {
+        DEBUG_INFO("Turbulent particle type can't be GPU evaluated!");
+        type->m_gpuEvaluated = false;
+    }
+
+    m_bucketTypes[m_bucketCount] = type;
+    m_bucketCounts[m_bucketCount] = 0;
+
+    if (type->m_gpuEvaluated) {
+        int capacity = m_particles->capacity();
+
+        if (capacity > PARTICLE_BATCH_MAX_QUADS)
+            capacity = PARTICLE_BATCH_MAX_QUADS;
+
+        m_rings[m_bucketCount] = new ParticleRing(capacity);
+    }
+    else {
+        m_buckets[m_bucketCount] = new int[m_maxParticles];
+    }
+
+    type->m_bucket = m_bucketCount;
+    m_bucketCount++;
+    return type->m_bucket;
 }
 
 
 /*!
+  Appends the particle at \a particleIndex into its type's live list.
 */
-void ParticleEngine::render(ParticleType *renderType, GLuint program)
+void ParticleEngine::addToBucket(int particleIndex)
 {
-    if (!renderType)
+    int bucket = m_particles->bucket(particleIndex);
+    m_particles->m_bucketIndex[particleIndex] = m_bucketCounts[bucket];
+    m_buckets[bucket][m_bucketCounts[bucket]++] = particleIndex;
+}
+
+
+/*!
+  Removes the particle at \a particleIndex from its type's live list by
+  moving the last entry of the list into its place.
+*/
+void ParticleEngine::removeFromBucket(int particleIndex)
+{
+    ParticleStore *ps = m_particles;
+
+    if (ps->m_bucketIndex[particleIndex] < 0)
         return;
 
-    glEnable(GL_BLEND);
+    int bucket = ps->bucket(particleIndex);
+    int *list = m_buckets[bucket];
+    int last = list[--m_bucketCounts[bucket]];
+    list[ps->m_bucketIndex[particleIndex]] = last;
+    ps->m_bucketIndex[last] = ps->m_bucketIndex[particleIndex];
+    ps->m_bucketIndex[particleIndex] = -1;
+}
+
+
+/*!
+  Sets the blending of \a renderType and binds \a program with the camera
+  and projection matrices.
+*/
+void ParticleEngine::bindBatchProgram(ParticleType *renderType,
+                                      const GameProgram &program)
+{
+    GameGLState *glState = m_gameInstance->getGLState();
+    glState->enable(GL_BLEND);
 
     if (renderType->m_additiveParticle) {
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+        glState->blendFunc(GL_SRC_ALPHA, GL_ONE);
     }
     else {
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glState->blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     }
 
-    glUniformMatrix4fv(glGetUniformLocation(program, "projMatrix"), 1,
+    glState->useProgram(program);
+
+    // The camera transform of an identity matrix is the view matrix.
+    float view[16];
+    memset(view, 0, sizeof(float) * 16);
+    view[0] = 1.0f;
+    view[5] = 1.0f;
+    view[10] = 1.0f;
+    view[15] = 1.0f;
+    m_gameInstance->cameraTransform(view);
+
+    glUniformMatrix4fv(program.location(GameProgram::ProjMatrix), 1,
                        GL_FALSE, m_gameInstance->getProjectionMatrix());
-    glUniform1i(glGetUniformLocation(program, "sampler2d"), 0);
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
+    glUniformMatrix4fv(program.location(GameProgram::ViewMatrix), 1,
+                       GL_FALSE, view);
+}
 
-    glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0,3, GL_FLOAT, GL_FALSE, 3 * sizeof(GL_FLOAT), 0);
-
-    float iden[16];
-    float m[16];
-    memset(iden, 0, sizeof(float) * 16);
-    iden[0] = 1.0f;
-    iden[5] = 1.0f;
-    iden[10] = 1.0f;
-    iden[15] = 1.0f;
-    GLfloat col[4];
-    float ftemp;
-    int colorLocation = glGetUniformLocation(program, "pcol");
-    int location = glGetUniformLocation(program, "transMatrix");
-
-    float *cam = m_gameInstance->getCameraMatrix();
-    Q_UNUSED(cam);
-
-    float sizeMul;
-    Particle *p = m_particles;
-    Particle *p_target = m_particles + m_maxParticles;
-
-    while (p != p_target) {
-        if (p->m_type == renderType && p->m_lifeTime > 0) {
-            memcpy(m, iden, sizeof(float) * 16);
-            sizeMul = (float)p->m_size / 409600.0f;
-            m[0] = m_cosTable[(p->m_angle >> 8) & 511] * sizeMul;
-            m[1] = m_cosTable[((p->m_angle >> 8) + 128) & 511] * sizeMul;
-            m[4] = m[1];
-            m[5] = -m[0];
-            m[3] = (float)p->m_pos[0] / 4096.0f;
-            m[7] = (float)p->m_pos[1] / 4096.0f;
-            m[11] = (float)p->m_pos[2] / 4096.0f + GAME_LEVEL_ZBASE;
-
-            // NOTE: Particle might work without "full" camera transform.
-            // Just by taking care of the position.
-            m_gameInstance->cameraTransform(m);
-
-            // Carry the scaling information for smoke program if active
-            if (program == m_smokeProgram)
-                col[0] = 1.0f/sizeMul;
-            else
-                col[0] = (float)((p->m_color) & 255) / 255.0f;
-
-            col[1] = (float)((p->m_color >> 8) & 255) / 255.0f;
-            col[2] = (float)((p->m_color >> 16) & 255) / 255.0f;
-            col[3] = p->m_type->m_generalVisibility * (float)p->m_lifeTime
-                    / (65536.0f / 4.0f) * p->m_type->m_fadeOutTimeSecs;
-
-            if (col[3] > p->m_type->m_generalVisibility)
-                col[3] = p->m_type->m_generalVisibility;
-
-            ftemp = ((float)p->m_aliveCounter / (65536.0f / 4.0f))
-                    * p->m_type->m_fadeInTimeSecs;
-
-            if (ftemp < col[3])
-                col[3] = ftemp;
-
-            glUniform4fv(colorLocation, 1, col);
-            glUniformMatrix4fv(location, 1, GL_FALSE, m);
-
-            // Draw particle
-            glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+
+/*!
+  Renders the live particles of \a renderType with one draw call. The
+  particles outside the view frustum are skipped, the rest are expanded
+  into quads on the CPU and streamed into the vertex buffer. \a program
+  selects between the basic and the smoke shading.
+*/
+void ParticleEngine::render(ParticleType *renderType, GLuint program)
+{
+    if (!renderType || renderType->m_bucket < 0)
+        return;
+
+    if (m_rings[renderType->m_bucket]) {
+        renderRing(renderType, program);
+        return;
+    }
+
+    if (m_bucketCounts[renderType->m_bucket] == 0)
+        return;
+
+    const ParticleStore *ps = m_particles;
+    const int *index = m_buckets[renderType->m_bucket];
+    const int liveCount = m_bucketCounts[renderType->m_bucket];
+    const bool smoke = (program == m_smokeProgram.program());
+
+    // Expand the visible particles into quads.
+    ParticleVertex *v = m_batchVertices;
+    float sizeMul, rc, rs, x, y, z, alpha, ftemp;
+    unsigned int color;
+    GLubyte r, g, b, a;
+    int p;
+    int count = 0;
+
+    for (int f = 0; f < liveCount; f++) {
+        p = index[f];
+        sizeMul = (float)ps->size(p) / 409600.0f;
+        x = (float)ps->pos(0, p) / 4096.0f;
+        y = (float)ps->pos(1, p) / 4096.0f;
+        z = (float)ps->pos(2, p) / 4096.0f + GAME_LEVEL_ZBASE;
+
+        // The quad's corners are at most sqrt(2) * size from the center.
+        if (!m_gameInstance->isSphereVisible(x, y, z, sizeMul * 1.415f))
+            continue;
+
+        count++;
+        rc = m_cosTable[(ps->angle(p) >> 8) & 511] * sizeMul;
+        rs = m_cosTable[((ps->angle(p) >> 8) + 128) & 511] * sizeMul;
+
+        alpha = renderType->m_generalVisibility * (float)ps->lifeTime(p)
+                / (65536.0f / 4.0f) * renderType->m_fadeOutTimeSecs;
+
+        if (alpha > renderType->m_generalVisibility)
+            alpha = renderType->m_generalVisibility;
+
+        ftemp = ((float)ps->aliveCounter(p) / (65536.0f / 4.0f))
+                * renderType->m_fadeInTimeSecs;
+
+        if (ftemp < alpha)
+            alpha = ftemp;
+
+        if (alpha < 0.0f)
+            alpha = 0.0f;
+        else if (alpha > 1.0f)
+            alpha = 1.0f;
+
+        color = ps->color(p);
+        r = (GLubyte)(color & 255);
+        g = (GLubyte)((color >> 8) & 255);
+        b = (GLubyte)((color >> 16) & 255);
+        a = (GLubyte)(alpha * 255.0f);
+
+        for (int c = 0; c < 4; c++) {
+            v->m_pos[0] = x;
+            v->m_pos[1] = y;
+            v->m_pos[2] = z;
+            v->m_corner[0] = (c == 1 || c == 2) ? 1.0f : -1.0f;
+            v->m_corner[1] = (c >= 2) ? 1.0f : -1.0f;
+            v->m_corner[2] = rc;
+            v->m_corner[3] = rs;
+            v->m_color[0] = r;
+            v->m_color[1] = g;
+            v->m_color[2] = b;
+            v->m_color[3] = a;
+            v++;
         }
+    }
+
+    m_gameInstance->addRenderCounts(count, liveCount - count);
 
-        p++;
+    if (count == 0)
+        return;
+
+    // Stream the quads into the vertex buffer. When the buffer is full its
+    // storage is orphaned so that the draws still using it do not stall.
+    int bytes = count * 4 * sizeof(ParticleVertex);
+    GameGLState *glState = m_gameInstance->getGLState();
+    glState->bindBuffer(GL_ARRAY_BUFFER, m_vbo);
+
+    if (m_streamOffset + bytes > m_streamSize) {
+        glBufferData(GL_ARRAY_BUFFER, m_streamSize, 0, GL_STREAM_DRAW);
+        m_streamOffset = 0;
     }
 
-    glDisableVertexAttribArray(0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBufferSubData(GL_ARRAY_BUFFER, m_streamOffset, bytes, m_batchVertices);
+
+    bindBatchProgram(renderType,
+                     smoke ? m_batchSmokeProgram : m_batchProgram);
+
+    glState->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+    glState->setVertexAttribArrays(0x7);
+
+    for (int first = 0; first < count; first += PARTICLE_BATCH_MAX_QUADS) {
+        int quads = count - first;
+
+        if (quads > PARTICLE_BATCH_MAX_QUADS)
+            quads = PARTICLE_BATCH_MAX_QUADS;
+
+        char *base = (char*)0 + m_streamOffset
+                + first * 4 * sizeof(ParticleVertex);
+
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE,
+                              sizeof(ParticleVertex), base);
+        glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE,
+                              sizeof(ParticleVertex),
+                              base + 3 * sizeof(GLfloat));
+        glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE,
+                              sizeof(ParticleVertex),
+                              base + 7 * sizeof(GLfloat));
+
+        glDrawElements(GL_TRIANGLES, quads * 6, GL_UNSIGNED_SHORT, 0);
+    }
+
+    m_streamOffset += bytes;
+
+    glState->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glState->bindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+/*!
+  Renders the GPU evaluated particles of \a renderType. Only the particles
+  emitted since the previous frame are uploaded.
+*/
+void ParticleEngine::renderRing(ParticleType *renderType, GLuint program)
+{
+    ParticleRing *ring = m_rings[renderType->m_bucket];
+
+    if (ring->m_retired == ring->m_emitted)
+        return;
+
+    GameGLState *glState = m_gameInstance->getGLState();
+    glState->bindBuffer(GL_ARRAY_BUFFER, ring->m_vbo);
+
+    if (ring->m_emitted - ring->m_uploaded >= (unsigned int)ring->m_capacity)
+        ring->m_uploaded = ring->m_emitted - ring->m_capacity;
+
+    uploadRing(ring, ring->m_uploaded, ring->m_emitted);
+    ring->m_uploaded = ring->m_emitted;
+
+    const GameProgram &gpuProgram = (program == m_smokeProgram.program())
+            ? m_gpuSmokeProgram : m_gpuProgram;
+    bindBatchProgram(renderType, gpuProgram);
+
+    // Fade times are scaled like in render().
+    float fadeIn = renderType->m_fadeInTimeSecs * 0.25f;
+
+    if (!(fadeIn < 1000000.0f))
+        fadeIn = 1000000.0f;
+
+    glUniform1f(gpuProgram.location(GameProgram::Time), m_time);
+    glUniform4f(gpuProgram.location(GameProgram::Motion),
+                (float)renderType->m_fraction / 4096.0f,
+                (float)renderType->m_gravity / 4096.0f,
+                (float)renderType->m_sizeIncInc / 100.0f,
+                (float)renderType->m_angleIncInc * 3.14159265f / 16.0f);
+    glUniform3f(gpuProgram.location(GameProgram::Fade),
+                fadeIn,
+                renderType->m_fadeOutTimeSecs * 0.25f,
+                renderType->m_generalVisibility);
+
+    glState->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+    glState->setVertexAttribArrays(0x1f);
+
+    drawRing(ring, ring->m_retired, ring->m_emitted);
+
+    glState->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glState->bindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+/*!
+  Uploads the particles [\a first, \a last) of \a ring, at most one full
+  ring, into its bound vertex buffer.
+*/
+void ParticleEngine::uploadRing(ParticleRing *ring,
+                                unsigned int first,
+                                unsigned int last)
+{
+    while (first != last) {
+        int slot = first % ring->m_capacity;
+        int count = last - first;
+
+        if (slot + count > ring->m_capacity)
+            count = ring->m_capacity - slot;
+
+        glBufferSubData(GL_ARRAY_BUFFER,
+                        slot * 4 * sizeof(ParticleGpuVertex),
+                        count * 4 * sizeof(ParticleGpuVertex),
+                        ring->m_vertices + slot * 4);
+        first += count;
+    }
+}
+
+
+/*!
+  Draws the particles [\a first, \a last) of \a ring, splitting the draw
+  where the ring wraps around.
+*/
+void ParticleEngine::drawRing(ParticleRing *ring,
+                              unsigned int first,
+                              unsigned int last)
+{
+    while (first != last) {
+        int slot = first % ring->m_capacity;
+        int count = last - first;
+
+        if (slot + count > ring->m_capacity)
+            count = ring->m_capacity - slot;
+
+        char *base = (char*)0 + slot * 4 * sizeof(ParticleGpuVertex);
+        GLsizei stride = sizeof(ParticleGpuVertex);
+
+        glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, stride, base);
+        glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, stride,
+                              base + 4 * sizeof(GLfloat));
+        glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, stride,
+                              base + 8 * sizeof(GLfloat));
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride,
+                              base + 12 * sizeof(GLfloat));
+        glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride,
+                              base + 14 * sizeof(GLfloat));
+
+        glDrawElements(GL_TRIANGLES, count * 6, GL_UNSIGNED_SHORT, 0);
+        first += count;
+    }
 }
 
 
@@ -385,16 +1075,479 @@ void ParticleEngine::run(float frameTime)
     int fixedFrameTime = (int)(frameTime * 4096.0f);
 
     m_turbulencePhase += fixedFrameTime * 6;
-    Particle *p = m_particles;
-    Particle *p_target = p + m_maxParticles;
 
-    while (p != p_target) {
-        if (p->m_lifeTime > 0)
-            p->run(this, fixedFrameTime);
+    // The particles are independent of each other; split them into
+    // chunks for the job pool threads. Chunks are whole SIMD blocks.
+    GameJobPool *jobPool = m_gameInstance->getJobPool();
+    int jobs = jobPool ? jobPool->threadCount() : 1;
+
+    if (jobs * PARTICLE_JOB_MIN_SIZE > m_liveCount)
+        jobs = m_liveCount / PARTICLE_JOB_MIN_SIZE;
+
+    if (jobs > 1) {
+        int chunkSize = (m_liveCount + jobs - 1) / jobs;
+        chunkSize = (chunkSize + PARTICLE_STORE_ALIGN - 1)
+                & ~(PARTICLE_STORE_ALIGN - 1);
+        jobs = (m_liveCount + chunkSize - 1) / chunkSize;
+
+        ParticleRunJob job(this, m_liveCount, chunkSize, fixedFrameTime);
+        jobPool->run(&job, jobs);
+    }
+    else {
+        runRange(0, m_liveCount, fixedFrameTime);
+    }
+
+    // GPU evaluated particles only need their time and their oldest dead
+    // particles retired.
+    m_time += frameTime;
+
+    for (int b = 0; b < m_bucketCount; b++) {
+        ParticleRing *ring = m_rings[b];
+
+        if (!ring)
+            continue;
+
+        while (ring->m_retired != ring->m_emitted
+               && ring->m_deathTime[ring->m_retired % ring->m_capacity]
+               <= m_time)
+            ring->m_retired++;
+    }
+
+    // Release the particles that died during this frame.
+    const ParticleStore *ps = m_particles;
+    int f = 0;
+
+    while (f < m_liveCount) {
+        if (ps->m_lifeTime[f] > 0)
+            f++;
+        else
+            killParticle(f);
+    }
+}
+
+
+/*!
+  Runs the particles in the slot range [\a first, \a last) for
+  \a fixedFrameTime (12 bit fixed point seconds). Uses the SIMD kernel when
+  available; the results are identical to runRangeScalar().
+*/
+void ParticleEngine::runRange(int first, int last, int fixedFrameTime)
+{
+#if defined(PARTICLE_KERNEL_SSE2) || defined(PARTICLE_KERNEL_NEON)
+    // Scalar head and tail for the parts not filling a whole block.
+    int blockFirst = (first + PARTICLE_STORE_ALIGN - 1)
+            & ~(PARTICLE_STORE_ALIGN - 1);
+    int blockLast = last & ~(PARTICLE_STORE_ALIGN - 1);
+
+    if (blockFirst >= blockLast) {
+        runRangeScalar(first, last, fixedFrameTime);
+        return;
+    }
+
+    runRangeScalar(first, blockFirst, fixedFrameTime);
+
+    ParticleStore *ps = m_particles;
+    int tx[4];
+    int ty[4];
+    int t0[4];
+    int t1[4];
+#endif
+
+#if defined(PARTICLE_KERNEL_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1 << 12);
+    const __m128i mask127 = _mm_set1_epi32(127);
+    const __m128i phase = _mm_set1_epi32(m_turbulencePhase);
+    const __m128i ft = _mm_set1_epi32(fixedFrameTime);
+
+    for (int i = blockFirst; i < blockLast; i += 4) {
+        __m128i life = _mm_load_si128((__m128i*)(ps->m_lifeTime + i));
+        __m128i alive = _mm_cmpgt_epi32(life, zero);
+
+        // Skip fully dead blocks
+        if (_mm_movemask_epi8(alive) == 0)
+            continue;
+
+        __m128i pos0 = _mm_load_si128((__m128i*)(ps->m_pos[0] + i));
+        __m128i pos1 = _mm_load_si128((__m128i*)(ps->m_pos[1] + i));
+        __m128i pos2 = _mm_load_si128((__m128i*)(ps->m_pos[2] + i));
+        __m128i dir0 = _mm_load_si128((__m128i*)(ps->m_dir[0] + i));
+        __m128i dir1 = _mm_load_si128((__m128i*)(ps->m_dir[1] + i));
+        __m128i dir2 = _mm_load_si128((__m128i*)(ps->m_dir[2] + i));
+
+        // Move
+        __m128i npos0 = _mm_add_epi32(pos0, _mm_srai_epi32(
+            sse2Mul(_mm_srai_epi32(dir0, 2), ft), 10));
+        __m128i npos1 = _mm_add_epi32(pos1, _mm_srai_epi32(
+            sse2Mul(_mm_srai_epi32(dir1, 2), ft), 10));
+        __m128i npos2 = _mm_add_epi32(pos2, _mm_srai_epi32(
+            sse2Mul(_mm_srai_epi32(dir2, 2), ft), 10));
+
+        // Fraction
+        __m128i te = _mm_srai_epi32(sse2Mul(
+            _mm_load_si128((__m128i*)(ps->m_fraction + i)), ft), 12);
+        te = sse2Select(_mm_cmpgt_epi32(te, one), one, te);
+
+        __m128i ndir0 = _mm_sub_epi32(dir0, _mm_srai_epi32(
+            sse2Mul(_mm_srai_epi32(dir0, 2), te), 10));
+        __m128i ndir1 = _mm_sub_epi32(dir1, _mm_srai_epi32(
+            sse2Mul(_mm_srai_epi32(dir1, 2), te), 10));
+        __m128i ndir2 = _mm_sub_epi32(dir2, _mm_srai_epi32(
+            sse2Mul(_mm_srai_epi32(dir2, 2), te), 10));
+
+        // Gravity
+        ndir1 = _mm_sub_epi32(ndir1, _mm_srai_epi32(sse2Mul(_mm_srai_epi32(
+            _mm_load_si128((__m128i*)(ps->m_gravity + i)), 2), ft), 10));
+
+        // Turbulence, the map lookups are done lane by lane.
+        __m128i turmul = _mm_srai_epi32(sse2Mul(
+            _mm_load_si128((__m128i*)(ps->m_turbulenceMul + i)), ft), 12);
+        __m128i turmask = _mm_cmpgt_epi32(turmul, zero);
+
+        if (_mm_movemask_epi8(_mm_and_si128(turmask, alive)) != 0) {
+            _mm_storeu_si128((__m128i*)ty, _mm_and_si128(_mm_srai_epi32(
+                _mm_add_epi32(phase, npos1), 10), mask127));
+            _mm_storeu_si128((__m128i*)tx, _mm_and_si128(_mm_srai_epi32(
+                _mm_add_epi32(phase, npos0), 10), mask127));
+
+            for (int l = 0; l < 4; l++) {
+                t0[l] = m_turbulenceMap[ty[l]][tx[l]][0];
+                t1[l] = m_turbulenceMap[ty[l]][tx[l]][1];
+            }
+
+            ndir0 = _mm_add_epi32(ndir0, _mm_and_si128(turmask, _mm_srai_epi32(
+                sse2Mul(_mm_loadu_si128((__m128i*)t0), turmul), 12)));
+            ndir1 = _mm_add_epi32(ndir1, _mm_and_si128(turmask, _mm_srai_epi32(
+                sse2Mul(_mm_loadu_si128((__m128i*)t1), turmul), 12)));
+        }
+
+        _mm_store_si128((__m128i*)(ps->m_pos[0] + i),
+                        sse2Select(alive, npos0, pos0));
+        _mm_store_si128((__m128i*)(ps->m_pos[1] + i),
+                        sse2Select(alive, npos1, pos1));
+        _mm_store_si128((__m128i*)(ps->m_pos[2] + i),
+                        sse2Select(alive, npos2, pos2));
+        _mm_store_si128((__m128i*)(ps->m_dir[0] + i),
+                        sse2Select(alive, ndir0, dir0));
+        _mm_store_si128((__m128i*)(ps->m_dir[1] + i),
+                        sse2Select(alive, ndir1, dir1));
+        _mm_store_si128((__m128i*)(ps->m_dir[2] + i),
+                        sse2Select(alive, ndir2, dir2));
+
+        // Size and angle, then their second phase increments
+        __m128i size = _mm_load_si128((__m128i*)(ps->m_size + i));
+        __m128i sizeInc = _mm_load_si128((__m128i*)(ps->m_sizeInc + i));
+        __m128i angle = _mm_load_si128((__m128i*)(ps->m_angle + i));
+        __m128i angleInc = _mm_load_si128((__m128i*)(ps->m_angleInc + i));
+
+        __m128i nsize = _mm_add_epi32(size, _mm_srai_epi32(
+            sse2Mul(_mm_srai_epi32(sizeInc, 4), ft), 8));
+        __m128i nangle = _mm_add_epi32(angle, _mm_srai_epi32(
+            sse2Mul(_mm_srai_epi32(angleInc, 4), ft), 8));
+        __m128i nsizeInc = _mm_add_epi32(sizeInc, sse2Mul(
+            _mm_load_si128((__m128i*)(ps->m_sizeIncInc + i)), ft));
+        __m128i nangleInc = _mm_add_epi32(angleInc, sse2Mul(
+            _mm_load_si128((__m128i*)(ps->m_angleIncInc + i)), ft));
+
+        _mm_store_si128((__m128i*)(ps->m_size + i),
+                        sse2Select(alive, nsize, size));
+        _mm_store_si128((__m128i*)(ps->m_angle + i),
+                        sse2Select(alive, nangle, angle));
+        _mm_store_si128((__m128i*)(ps->m_sizeInc + i),
+                        sse2Select(alive, nsizeInc, sizeInc));
+        _mm_store_si128((__m128i*)(ps->m_angleInc + i),
+                        sse2Select(alive, nangleInc, angleInc));
+
+        // Lifetime; particle is dead if size has been dropped below one.
+        __m128i aliveCounter =
+                _mm_load_si128((__m128i*)(ps->m_aliveCounter + i));
+        __m128i nlife = _mm_andnot_si128(_mm_cmplt_epi32(nsize, one),
+                                         _mm_sub_epi32(life, ft));
+
+        _mm_store_si128((__m128i*)(ps->m_lifeTime + i),
+                        sse2Select(alive, nlife, life));
+        _mm_store_si128((__m128i*)(ps->m_aliveCounter + i),
+                        sse2Select(alive, _mm_add_epi32(aliveCounter, ft),
+                                   aliveCounter));
+    }
+#elif defined(PARTICLE_KERNEL_NEON)
+    const int32x4_t zero = vdupq_n_s32(0);
+    const int32x4_t one = vdupq_n_s32(1 << 12);
+    const int32x4_t mask127 = vdupq_n_s32(127);
+    const int32x4_t phase = vdupq_n_s32(m_turbulencePhase);
+    const int32x4_t ft = vdupq_n_s32(fixedFrameTime);
+
+    for (int i = blockFirst; i < blockLast; i += 4) {
+        int32x4_t life = vld1q_s32(ps->m_lifeTime + i);
+        uint32x4_t alive = vcgtq_s32(life, zero);
+        uint32x2_t any = vorr_u32(vget_low_u32(alive), vget_high_u32(alive));
+
+        // Skip fully dead blocks
+        if ((vget_lane_u32(any, 0) | vget_lane_u32(any, 1)) == 0)
+            continue;
+
+        int32x4_t pos0 = vld1q_s32(ps->m_pos[0] + i);
+        int32x4_t pos1 = vld1q_s32(ps->m_pos[1] + i);
+        int32x4_t pos2 = vld1q_s32(ps->m_pos[2] + i);
+        int32x4_t dir0 = vld1q_s32(ps->m_dir[0] + i);
+        int32x4_t dir1 = vld1q_s32(ps->m_dir[1] + i);
+        int32x4_t dir2 = vld1q_s32(ps->m_dir[2] + i);
+
+        // Move
+        int32x4_t npos0 = vaddq_s32(pos0, vshrq_n_s32(
+            vmulq_s32(vshrq_n_s32(dir0, 2), ft), 10));
+        int32x4_t npos1 = vaddq_s32(pos1, vshrq_n_s32(
+            vmulq_s32(vshrq_n_s32(dir1, 2), ft), 10));
+        int32x4_t npos2 = vaddq_s32(pos2, vshrq_n_s32(
+            vmulq_s32(vshrq_n_s32(dir2, 2), ft), 10));
+
+        // Fraction
+        int32x4_t te = vminq_s32(vshrq_n_s32(vmulq_s32(
+            vld1q_s32(ps->m_fraction + i), ft), 12), one);
+
+        int32x4_t ndir0 = vsubq_s32(dir0, vshrq_n_s32(
+            vmulq_s32(vshrq_n_s32(dir0, 2), te), 10));
+        int32x4_t ndir1 = vsubq_s32(dir1, vshrq_n_s32(
+            vmulq_s32(vshrq_n_s32(dir1, 2), te), 10));
+        int32x4_t ndir2 = vsubq_s32(dir2, vshrq_n_s32(
+            vmulq_s32(vshrq_n_s32(dir2, 2), te), 10));
+
+        // Gravity
+        ndir1 = vsubq_s32(ndir1, vshrq_n_s32(vmulq_s32(vshrq_n_s32(
+            vld1q_s32(ps->m_gravity + i), 2), ft), 10));
+
+        // Turbulence, the map lookups are done lane by lane.
+        int32x4_t turmul = vshrq_n_s32(vmulq_s32(
+            vld1q_s32(ps->m_turbulenceMul + i), ft), 12);
+        uint32x4_t turmask = vcgtq_s32(turmul, zero);
+        uint32x4_t turalive = vandq_u32(turmask, alive);
+        any = vorr_u32(vget_low_u32(turalive), vget_high_u32(turalive));
+
+        if ((vget_lane_u32(any, 0) | vget_lane_u32(any, 1)) != 0) {
+            vst1q_s32(ty, vandq_s32(vshrq_n_s32(
+                vaddq_s32(phase, npos1), 10), mask127));
+            vst1q_s32(tx, vandq_s32(vshrq_n_s32(
+                vaddq_s32(phase, npos0), 10), mask127));
+
+            for (int l = 0; l < 4; l++) {
+                t0[l] = m_turbulenceMap[ty[l]][tx[l]][0];
+                t1[l] = m_turbulenceMap[ty[l]][tx[l]][1];
+            }
+
+            ndir0 = vaddq_s32(ndir0, vbslq_s32(turmask, vshrq_n_s32(
+                vmulq_s32(vld1q_s32(t0), turmul), 12), zero));
+            ndir1 = vaddq_s32(ndir1, vbslq_s32(turmask, vshrq_n_s32(
+                vmulq_s32(vld1q_s32(t1), turmul), 12), zero));
+        }
+
+        vst1q_s32(ps->m_pos[0] + i, vbslq_s32(alive, npos0, pos0));
+        vst1q_s32(ps->m_pos[1] + i, vbslq_s32(alive, npos1, pos1));
+        vst1q_s32(ps->m_pos[2] + i, vbslq_s32(alive, npos2, pos2));
+        vst1q_s32(ps->m_dir[0] + i, vbslq_s32(alive, ndir0, dir0));
+        vst1q_s32(ps->m_dir[1] + i, vbslq_s32(alive, ndir1, dir1));
+        vst1q_s32(ps->m_dir[2] + i, vbslq_s32(alive, ndir2, dir2));
+
+        // Size and angle, then their second phase increments
+        int32x4_t size = vld1q_s32(ps->m_size + i);
+        int32x4_t sizeInc = vld1q_s32(ps->m_sizeInc + i);
+        int32x4_t angle = vld1q_s32(ps->m_angle + i);
+        int32x4_t angleInc = vld1q_s32(ps->m_angleInc + i);
+
+        int32x4_t nsize = vaddq_s32(size, vshrq_n_s32(
+            vmulq_s32(vshrq_n_s32(sizeInc, 4), ft), 8));
+        int32x4_t nangle = vaddq_s32(angle, vshrq_n_s32(
+            vmulq_s32(vshrq_n_s32(angleInc, 4), ft), 8));
+        int32x4_t nsizeInc = vaddq_s32(sizeInc, vmulq_s32(
+            vld1q_s32(ps->m_sizeIncInc + i), ft));
+        int32x4_t nangleInc = vaddq_s32(angleInc, vmulq_s32(
+            vld1q_s32(ps->m_angleIncInc + i), ft));
+
+        vst1q_s32(ps->m_size + i, vbslq_s32(alive, nsize, size));
+        vst1q_s32(ps->m_angle + i, vbslq_s32(alive, nangle, angle));
+        vst1q_s32(ps->m_sizeInc + i, vbslq_s32(alive, nsizeInc, sizeInc));
+        vst1q_s32(ps->m_angleInc + i, vbslq_s32(alive, nangleInc, angleInc));
+
+        // Lifetime; particle is dead if size has been dropped below one.
+        int32x4_t aliveCounter = vld1q_s32(ps->m_aliveCounter + i);
+        int32x4_t nlife = vbslq_s32(vcltq_s32(nsize, one), zero,
+                                    vsubq_s32(life, ft));
+
+        vst1q_s32(ps->m_lifeTime + i, vbslq_s32(alive, nlife, life));
+        vst1q_s32(ps->m_aliveCounter + i,
+                  vbslq_s32(alive, vaddq_s32(aliveCounter, ft), aliveCounter));
+    }
+#endif
+
+#if defined(PARTICLE_KERNEL_SSE2) || defined(PARTICLE_KERNEL_NEON)
+    runRangeScalar(blockLast, last, fixedFrameTime);
+#elif defined(QOTH_COMPACT_PARTICLES)
+    runRangeCompact(first, last, fixedFrameTime);
+#else
+    runRangeScalar(first, last, fixedFrameTime);
+#endif
+}
+
+
+#ifdef QOTH_COMPACT_PARTICLES
+/*!
+  Particle run kernel for the 16 bit particle state. Runs the living
+  particles in the slot range [\a first, \a last) with the same rules as
+  the 32 bit kernels, rounding the results to the storage precision.
+*/
+void ParticleEngine::runRangeCompact(int first, int last, int fixedFrameTime)
+{
+    ParticleStore *ps = m_particles;
+    short *pos[3] = { ps->m_pos[0], ps->m_pos[1], ps->m_pos[2] };
+    short *dir[3] = { ps->m_dir[0], ps->m_dir[1], ps->m_dir[2] };
+
+    // The type attributes scaled by the frame time once per live list.
+    int fraction[PARTICLE_MAX_TYPES];
+    int gravity[PARTICLE_MAX_TYPES];
+    int turbulence[PARTICLE_MAX_TYPES];
+    int sizeIncInc[PARTICLE_MAX_TYPES];
+    int angleIncInc[PARTICLE_MAX_TYPES];
+    int lifeDec[PARTICLE_MAX_TYPES];
+    ParticleType *type;
+    int b, temp;
+    int size, sizeInc, angleInc;
+
+    for (b = 0; b < m_bucketCount; b++) {
+        type = m_bucketTypes[b];
+        fraction[b] = (type->m_fraction * fixedFrameTime) >> 12;
+
+        if (fraction[b] > 4096)
+            fraction[b] = 4096;
+
+        gravity[b] = ((type->m_gravity >> 2) * fixedFrameTime
+                      + (1 << 14)) >> 15;
+        turbulence[b] = (type->m_turbulenceMul * fixedFrameTime) >> 12;
+        sizeIncInc[b] = type->m_sizeIncInc * fixedFrameTime;
+        angleIncInc[b] = type->m_angleIncInc * fixedFrameTime;
+        lifeDec[b] = (int)(((qint64)fixedFrameTime * PARTICLE_COMPACT_LIFE_MAX
+                            + ps->m_maxLifeTime[b] / 2)
+                           / ps->m_maxLifeTime[b]);
+
+        if (lifeDec[b] < 1)
+            lifeDec[b] = 1;
+    }
+
+    for (int i = first; i < last; i++) {
+        if (ps->m_lifeTime[i] == 0)
+            continue;
+
+        b = ps->m_typeIndex[i];
+
+        // Move
+        for (int f = 0; f < 3; f++) {
+            pos[f][i] = ParticleStore::clampShort(
+                        pos[f][i] + ((dir[f][i] * fixedFrameTime + 256) >> 9));
+        }
+
+        // Fraction
+        for (int f = 0; f < 3; f++)
+            dir[f][i] -= (dir[f][i] * fraction[b] + 2048) >> 12;
+
+        // Gravity
+        dir[1][i] = ParticleStore::clampShort(dir[1][i] - gravity[b]);
+
+        // Turbulence
+        if (turbulence[b] > 0) {
+            const short *t = m_turbulenceMap
+                    [(((m_turbulencePhase + ps->pos(1, i)) >> 10) & 127)]
+                    [(((m_turbulencePhase + ps->pos(0, i)) >> 10) & 127)];
+            dir[0][i] = ParticleStore::clampShort(
+                        dir[0][i] + ((t[0] * turbulence[b] + (1 << 16)) >> 17));
+            dir[1][i] = ParticleStore::clampShort(
+                        dir[1][i] + ((t[1] * turbulence[b] + (1 << 16)) >> 17));
+        }
+
+        // Size and angle increments
+        size = ps->size(i);
+        sizeInc = ps->sizeInc(i);
+        angleInc = ps->angleInc(i);
+        size += (((sizeInc >> 4) * fixedFrameTime) >> 8);
+        ps->setSize(i, size);
+        ps->setAngle(i, ps->angle(i)
+                     + (((angleInc >> 4) * fixedFrameTime) >> 8));
+        ps->setSizeInc(i, sizeInc + sizeIncInc[b]);
+        ps->setAngleInc(i, angleInc + angleIncInc[b]);
+
+        temp = ps->m_lifeTime[i] - lifeDec[b];
+        ps->m_lifeTime[i] = (unsigned short)(temp > 0 ? temp : 0);
+
+        temp = ps->m_aliveCounter[i] + fixedFrameTime;
+        ps->m_aliveCounter[i] = (unsigned short)(temp < 65535 ? temp : 65535);
+
+        // Particle is dead if size has been dropped below one.
+        if (size < 1 << 12)
+            ps->m_lifeTime[i] = 0;
+    }
+}
+#else
+
+
+/*!
+  Scalar version of the particle run kernel. Runs the living particles in
+  the slot range [\a first, \a last).
+*/
+void ParticleEngine::runRangeScalar(int first, int last, int fixedFrameTime)
+{
+    ParticleStore *ps = m_particles;
+    int *pos[3] = { ps->m_pos[0], ps->m_pos[1], ps->m_pos[2] };
+    int *dir[3] = { ps->m_dir[0], ps->m_dir[1], ps->m_dir[2] };
+
+    for (int i = first; i < last; i++) {
+        if (ps->m_lifeTime[i] <= 0)
+            continue;
+
+        // Move
+        pos[0][i] += (((dir[0][i] >> 2) * fixedFrameTime) >> 10);
+        pos[1][i] += (((dir[1][i] >> 2) * fixedFrameTime) >> 10);
+        pos[2][i] += (((dir[2][i] >> 2) * fixedFrameTime) >> 10);
+
+        // Fraction
+        int te = ((ps->m_fraction[i] * fixedFrameTime) >> 12);
+
+        if (te > 4096)
+            te = 4096;
+
+        dir[0][i] -= (((dir[0][i] >> 2) * te) >> 10);
+        dir[1][i] -= (((dir[1][i] >> 2) * te) >> 10);
+        dir[2][i] -= (((dir[2][i] >> 2) * te) >> 10);
+
+        // Gravity
+        dir[1][i] -= (((ps->m_gravity[i] >> 2) * fixedFrameTime) >> 10);
+
+        // Turbulence
+        int turmul = ((ps->m_turbulenceMul[i] * fixedFrameTime) >> 12);
+
+        if (turmul > 0) {
+            const short *t = m_turbulenceMap
+                    [(((m_turbulencePhase + pos[1][i]) >> 10) & 127)]
+                    [(((m_turbulencePhase + pos[0][i]) >> 10) & 127)];
+            dir[0][i] += (t[0] * turmul) >> 12;
+            dir[1][i] += (t[1] * turmul) >> 12;
+        }
+
+        // Size increment
+        ps->m_size[i] += (((ps->m_sizeInc[i] >> 4) * fixedFrameTime) >> 8);
+
+        // Angle increment
+        ps->m_angle[i] += (((ps->m_angleInc[i] >> 4) * fixedFrameTime) >> 8);
+
+        // Second phase increments for size and angle increments.
+        ps->m_sizeInc[i] += ps->m_sizeIncInc[i] * fixedFrameTime;
+        ps->m_angleInc[i] += ps->m_angleIncInc[i] * fixedFrameTime;
 
-        p++;
+        ps->m_lifeTime[i] -= fixedFrameTime;
+        ps->m_aliveCounter[i] += fixedFrameTime;
+
+        // Particle is dead if size has been dropped below one.
+        if (ps->m_size[i] < 1 << 12)
+            ps->m_lifeTime[i] = 0;
     }
 }
+#endif
 
 
 /*!
@@ -424,114 +1577,327 @@ void ParticleEngine::emitParticles(int count,
     fixedDirection[1] = (int)(dir.y() * 4096.0f);
     fixedDirection[2] = (int)(dir.z() * 4096.0f);
 
-    int fixedRandom[3];
-    int temp;
-    float c[3];
+    emitFixed(count, type, fixedPosition, 0, fixedPosRandom,
+              fixedDirection, fixedDirRandom);
+}
+
+
+/*!
+  Emits \a count particles of type \a type along the line from \a pos1
+  towards \a pos2; the particles are evenly spaced starting from \a pos1.
+  The other parameters are as in emitParticles().
+*/
+void ParticleEngine::emitParticleLine(int count,
+                                      ParticleType *type,
+                                      QVector3D &pos1,
+                                      QVector3D &pos2,
+                                      float posRandom,
+                                      QVector3D &dir,
+                                      float dirRandom)
+{
+    if (count < 1)
+        return;
+
+    int fixedPositions[PARTICLE_SPAWN_CHUNK * 3];
+    int fixedPosition[3];
+    int fixedStep[3];
+    int fixedDirection[3];
+
+    int fixedPosRandom = (int)(posRandom * 256.0f);
+    int fixedDirRandom = (int)(dirRandom * 256.0f);
+
+    fixedPosition[0] = (int)(pos1.x() * 4096.0f);
+    fixedPosition[1] = (int)(pos1.y() * 4096.0f);
+    fixedPosition[2] = (int)(pos1.z() * 4096.0f);
+
+    fixedStep[0] = (int)((pos2.x() - pos1.x()) * 4096.0f / (float)count);
+    fixedStep[1] = (int)((pos2.y() - pos1.y()) * 4096.0f / (float)count);
+    fixedStep[2] = (int)((pos2.z() - pos1.z()) * 4096.0f / (float)count);
 
-    Particle *p;
+    fixedDirection[0] = (int)(dir.x() * 4096.0f);
+    fixedDirection[1] = (int)(dir.y() * 4096.0f);
+    fixedDirection[2] = (int)(dir.z() * 4096.0f);
+
+    int chunk;
 
     while (count > 0) {
-        p = m_particles + m_currentParticle;
-        p->m_type = type;
+        chunk = (count < PARTICLE_SPAWN_CHUNK) ? count : PARTICLE_SPAWN_CHUNK;
+
+        for (int f = 0; f < chunk; f++) {
+            fixedPositions[f * 3 + 0] = fixedPosition[0];
+            fixedPositions[f * 3 + 1] = fixedPosition[1];
+            fixedPositions[f * 3 + 2] = fixedPosition[2];
+            fixedPosition[0] += fixedStep[0];
+            fixedPosition[1] += fixedStep[1];
+            fixedPosition[2] += fixedStep[2];
+        }
+
+        if (!emitFixed(chunk, type, fixedPositions, 3, fixedPosRandom,
+                       fixedDirection, fixedDirRandom)) {
+            m_droppedCount += count - chunk;
+            return;
+        }
+
+        count -= chunk;
+    }
+}
 
-        p->m_aliveCounter = 0;
 
-        // Create a random vector
-        fixedRandom[0] = (rand() & 255) - 128;
-        fixedRandom[1] = (rand() & 255) - 128;
-        fixedRandom[2] = (rand() & 255) - 128;
+/*!
+  Emits one particle of type \a type at each of the \a count positions in
+  \a positions. The other parameters are as in emitParticles().
+*/
+void ParticleEngine::emitParticlesBatch(int count,
+                                        ParticleType *type,
+                                        const QVector3D *positions,
+                                        float posRandom,
+                                        QVector3D &dir,
+                                        float dirRandom)
+{
+    int fixedPositions[PARTICLE_SPAWN_CHUNK * 3];
+    int fixedDirection[3];
 
-        temp = (int)sqrtf(fixedRandom[0] * fixedRandom[0]
-                          + fixedRandom[1] * fixedRandom[1]
-                          + fixedRandom[2] * fixedRandom[2]);
+    int fixedPosRandom = (int)(posRandom * 256.0f);
+    int fixedDirRandom = (int)(dirRandom * 256.0f);
 
-        if (temp > 0) {
-            fixedRandom[0] = (fixedRandom[0] << 16) / temp;
-            fixedRandom[1] = (fixedRandom[1] << 16) / temp;
-            fixedRandom[2] = (fixedRandom[2] << 16) / temp;
+    fixedDirection[0] = (int)(dir.x() * 4096.0f);
+    fixedDirection[1] = (int)(dir.y() * 4096.0f);
+    fixedDirection[2] = (int)(dir.z() * 4096.0f);
+
+    int chunk;
+
+    while (count > 0) {
+        chunk = (count < PARTICLE_SPAWN_CHUNK) ? count : PARTICLE_SPAWN_CHUNK;
+
+        for (int f = 0; f < chunk; f++) {
+            fixedPositions[f * 3 + 0] = (int)(positions[f].x() * 4096.0f);
+            fixedPositions[f * 3 + 1] = (int)(positions[f].y() * 4096.0f);
+            fixedPositions[f * 3 + 2] = (int)(positions[f].z() * 4096.0f);
         }
 
-        // Position
-        p->m_pos[0] = ((fixedRandom[0] * fixedPosRandom) >> 12) + fixedPosition[0];
-        p->m_pos[1] = ((fixedRandom[1] * fixedPosRandom) >> 12) + fixedPosition[1];
-        p->m_pos[2] = ((fixedRandom[2] * fixedPosRandom) >> 12) + fixedPosition[2];
+        if (!emitFixed(chunk, type, fixedPositions, 3, fixedPosRandom,
+                       fixedDirection, fixedDirRandom)) {
+            m_droppedCount += count - chunk;
+            return;
+        }
 
-        // Direction
-        p->m_dir[0] = ((fixedRandom[0] * fixedDirRandom) >> 12) + fixedDirection[0];
-        p->m_dir[1] = ((fixedRandom[1] * fixedDirRandom) >> 12) + fixedDirection[1];
-        p->m_dir[2] = ((fixedRandom[2] * fixedDirRandom) >> 12) + fixedDirection[2];
+        positions += chunk;
+        count -= chunk;
+    }
+}
 
-        p->m_angle = type->m_angle
-                + (((rand() & 255) * type->m_angleRandom) >> 8);
-        p->m_angleInc = type->m_angleInc
-                + (((rand() & 255) * type->m_angleIncRandom) >> 8);
 
-        p->m_size = type->m_size
-                + (((rand() & 255) * type->m_sizeRandom) >> 8);
-        p->m_sizeInc = type->m_sizeInc
-                + (((rand() & 255) * type->m_sizeIncRandom) >> 8);
+/*!
+  Emits \a count particles of \a type from fixed point parameters. The
+  position of particle n is read from \a fixedPositions at
+  n * \a positionStride, so a zero stride emits all of them from the same
+  position. Returns false if some of the particles were dropped.
+*/
+bool ParticleEngine::emitFixed(int count,
+                               ParticleType *type,
+                               const int *fixedPositions,
+                               int positionStride,
+                               int fixedPosRandom,
+                               const int *fixedDirection,
+                               int fixedDirRandom)
+{
+    if (registerType(type) < 0) {
+        m_droppedCount += count;
+        return false;
+    }
+
+    unsigned char random[PARTICLE_SPAWN_CHUNK * PARTICLE_RANDOM_BYTES];
+    GameRandom *gameRandom = m_gameInstance->getRandom();
+    int p, chunk;
 
-        p->m_lifeTime = type->m_lifeTime
-                + (((rand() & 255) * type->m_lifeTimeRandom) >> 8);
+    while (count > 0) {
+        // Random bytes for a group of particles with a single call.
+        chunk = (count < PARTICLE_SPAWN_CHUNK) ? count : PARTICLE_SPAWN_CHUNK;
+        gameRandom->fillBytes(random, chunk * PARTICLE_RANDOM_BYTES);
+
+        if (type->m_gpuEvaluated) {
+            if (!emitGpuParticles(chunk, type, fixedPositions, positionStride,
+                                  fixedPosRandom, fixedDirection,
+                                  fixedDirRandom, random)) {
+                m_droppedCount += count - chunk;
+                return false;
+            }
+
+            fixedPositions += chunk * positionStride;
+            count -= chunk;
+            continue;
+        }
 
-        c[0] = type->m_col[0] + ((float)(rand() & 255) / 255.0f) * type->m_colRandom[0];
-        c[1] = type->m_col[1] + ((float)(rand() & 255) / 255.0f) * type->m_colRandom[1];
-        c[2] = type->m_col[2] + ((float)(rand() & 255) / 255.0f) * type->m_colRandom[2];
+        for (int f = 0; f < chunk; f++) {
+            p = allocateParticle();
 
-        if (c[0]>1.0f) c[0] = 1.0f; if (c[0]<0.0f) c[0] = 0.0f;
-        if (c[1]>1.0f) c[1] = 1.0f; if (c[1]<0.0f) c[1] = 0.0f;
-        if (c[2]>1.0f) c[2] = 1.0f; if (c[2]<0.0f) c[2] = 0.0f;
+            if (p < 0) {
+                m_droppedCount += count - f;
+                return false;
+            }
 
-        p->m_color = (unsigned int)(c[0] * 255.0f)
-                | ((unsigned int)(c[1] * 255.0f) << 8)
-                | ((unsigned int)(c[2] * 255.0f) << 16);
+            spawnParticle(m_particles, p, type,
+                          fixedPositions + f * positionStride, fixedPosRandom,
+                          fixedDirection, fixedDirRandom,
+                          random + f * PARTICLE_RANDOM_BYTES);
 
-        count--;
-        m_currentParticle++;
+            if (m_particles->m_lifeTime[p] > 0)
+                addToBucket(p);
+        }
 
-        if (m_currentParticle >= m_maxParticles)
-            m_currentParticle = 0;
+        fixedPositions += chunk * positionStride;
+        count -= chunk;
     }
+
+    return true;
 }
 
 
 /*!
+  Initializes the particle at slot \a p of \a ps as a new particle of
+  \a type with a randomized position and direction. The variation is taken
+  from the PARTICLE_RANDOM_BYTES bytes at \a random.
 */
-void ParticleEngine::emitParticleLine(int count,
-                                      ParticleType *type,
-                                      QVector3D &pos1,
-                                      QVector3D &pos2,
-                                      float posRandom,
-                                      QVector3D &dir,
-                                      float dirRandom)
+void ParticleEngine::spawnParticle(ParticleStore *ps, int p,
+                                   ParticleType *type,
+                                   const int *fixedPosition,
+                                   int fixedPosRandom,
+                                   const int *fixedDirection,
+                                   int fixedDirRandom,
+                                   const unsigned char *random)
 {
-    Q_UNUSED(count);
-    Q_UNUSED(type);
-    Q_UNUSED(pos1);
-    Q_UNUSED(pos2);
-    Q_UNUSED(posRandom);
-    Q_UNUSED(dir);
-    Q_UNUSED(dirRandom);
+    int fixedRandom[3];
+    int temp;
+    float c[3];
 
-    /*
-    if (count<1)
-        return;
+    ps->setType(p, type);
+    ps->setAliveCounter(p, 0);
 
-    QVector3D ofs = pos2 - pos1;
-    ofs /= (float)count;
-    int c = 0;
+    // Create a random vector
+    fixedRandom[0] = random[0] - 128;
+    fixedRandom[1] = random[1] - 128;
+    fixedRandom[2] = random[2] - 128;
 
-    while (c < count) {
-        QVector3D p = expos + ofs * (float)c;
-        peng->emitParticles(
-                    1, m_gameInstance->m_smallSmokeParticle, p,
-                    posRandom, dir, dirrandom);
-        c++;
+    temp = (int)sqrtf(fixedRandom[0] * fixedRandom[0]
+                      + fixedRandom[1] * fixedRandom[1]
+                      + fixedRandom[2] * fixedRandom[2]);
+
+    if (temp > 0) {
+        fixedRandom[0] = (fixedRandom[0] << 16) / temp;
+        fixedRandom[1] = (fixedRandom[1] << 16) / temp;
+        fixedRandom[2] = (fixedRandom[2] << 16) / temp;
+    }
+
+    // Position
+    for (int f = 0; f < 3; f++) {
+        ps->setPos(f, p, ((fixedRandom[f] * fixedPosRandom) >> 12)
+                   + fixedPosition[f]);
     }
-    */
+
+    // Direction
+    for (int f = 0; f < 3; f++) {
+        ps->setDir(f, p, ((fixedRandom[f] * fixedDirRandom) >> 12)
+                   + fixedDirection[f]);
+    }
+
+    ps->setAngle(p, type->m_angle
+                 + ((random[3] * type->m_angleRandom) >> 8));
+    ps->setAngleInc(p, type->m_angleInc
+                    + ((random[4] * type->m_angleIncRandom) >> 8));
+
+    ps->setSize(p, type->m_size
+                + ((random[5] * type->m_sizeRandom) >> 8));
+    ps->setSizeInc(p, type->m_sizeInc
+                   + ((random[6] * type->m_sizeIncRandom) >> 8));
+
+    ps->setLifeTime(p, type->m_lifeTime
+                    + ((random[7] * type->m_lifeTimeRandom) >> 8));
+
+    c[0] = type->m_col[0] + ((float)random[8] / 255.0f) * type->m_colRandom[0];
+    c[1] = type->m_col[1] + ((float)random[9] / 255.0f) * type->m_colRandom[1];
+    c[2] = type->m_col[2] + ((float)random[10] / 255.0f) * type->m_colRandom[2];
+
+    if (c[0]>1.0f) c[0] = 1.0f; if (c[0]<0.0f) c[0] = 0.0f;
+    if (c[1]>1.0f) c[1] = 1.0f; if (c[1]<0.0f) c[1] = 0.0f;
+    if (c[2]>1.0f) c[2] = 1.0f; if (c[2]<0.0f) c[2] = 0.0f;
+
+    ps->setColor(p, (unsigned int)(c[0] * 255.0f)
+                 | ((unsigned int)(c[1] * 255.0f) << 8)
+                 | ((unsigned int)(c[2] * 255.0f) << 16));
 }
 
 
+/*!
+  Emits \a count GPU evaluated particles of \a type into its ring. When the
+  ring is full the oldest particles are replaced, or with OverflowDropNew
+  the new particles are dropped and false is returned. The positions are
+  read as in emitFixed().
+*/
+bool ParticleEngine::emitGpuParticles(int count, ParticleType *type,
+                                      const int *fixedPositions,
+                                      int positionStride,
+                                      int fixedPosRandom,
+                                      const int *fixedDirection,
+                                      int fixedDirRandom,
+                                      const unsigned char *random)
+{
+    ParticleRing *ring = m_rings[type->m_bucket];
+    ParticleStore *ps = m_spawnStore;
+    ParticleGpuVertex *v;
+    int slot;
+
+    while (count > 0) {
+        if (ring->m_emitted - ring->m_retired
+                >= (unsigned int)ring->m_capacity) {
+            if (m_overflowPolicy == OverflowDropNew) {
+                m_droppedCount += count;
+                return false;
+            }
+
+            ring->m_retired++;
+            m_stolenCount++;
+        }
+
+        spawnParticle(ps, 0, type, fixedPositions, fixedPosRandom,
+                      fixedDirection, fixedDirRandom, random);
+        fixedPositions += positionStride;
+        random += PARTICLE_RANDOM_BYTES;
+
+        slot = ring->m_emitted % ring->m_capacity;
+        float lifeTime = (float)ps->lifeTime(0) / 4096.0f;
+        ring->m_deathTime[slot] = m_time + lifeTime;
+
+        v = ring->m_vertices + slot * 4;
+
+        for (int c = 0; c < 4; c++) {
+            v->m_pos[0] = (float)ps->pos(0, 0) / 4096.0f;
+            v->m_pos[1] = (float)ps->pos(1, 0) / 4096.0f;
+            v->m_pos[2] = (float)ps->pos(2, 0) / 4096.0f + GAME_LEVEL_ZBASE;
+            v->m_pos[3] = m_time;
+            v->m_dir[0] = (float)ps->dir(0, 0) / 4096.0f;
+            v->m_dir[1] = (float)ps->dir(1, 0) / 4096.0f;
+            v->m_dir[2] = (float)ps->dir(2, 0) / 4096.0f;
+            v->m_dir[3] = lifeTime;
+            v->m_growth[0] = (float)ps->size(0) / 409600.0f;
+            v->m_growth[1] = (float)ps->sizeInc(0) / 409600.0f;
+            v->m_growth[2] = (float)ps->angle(0) * 3.14159265f / 65536.0f;
+            v->m_growth[3] = (float)ps->angleInc(0) * 3.14159265f / 65536.0f;
+            v->m_corner[0] = (c == 1 || c == 2) ? 1.0f : -1.0f;
+            v->m_corner[1] = (c >= 2) ? 1.0f : -1.0f;
+            v->m_color[0] = (GLubyte)(ps->color(0) & 255);
+            v->m_color[1] = (GLubyte)((ps->color(0) >> 8) & 255);
+            v->m_color[2] = (GLubyte)((ps->color(0) >> 16) & 255);
+            v->m_color[3] = 255;
+            v++;
+        }
+
+        ring->m_emitted++;
+        count--;
+    }
+
+    return true;
+}
+
 
 /*!
   \class ParticleType
@@ -563,7 +1929,9 @@ ParticleType::ParticleType(unsigned int program, unsigned int textureId)
       m_fadeOutTimeSecs(1.0f / 2000.0f),
       m_fadeInTimeSecs(0),
       m_generalVisibility(0),
-      m_additiveParticle(true)
+      m_additiveParticle(true),
+      m_gpuEvaluated(false),
+      m_bucket(-1)
 {
     setVisibility(0.0f, 0.5f, 1.0f);
     m_col[0] = 1.0f;
@@ -8,43 +8,315 @@
 #include <GLES2/gl2.h>
 #include <QVector3D>
 
+#include "GameProgram.h"
+
+// Maximum number of different particle types one engine can render
+#define PARTICLE_MAX_TYPES 8
+
+// Maximum number of quads in a single draw call, limited by the 16 bit
+// indices.
+#define PARTICLE_BATCH_MAX_QUADS 16384
+
+// Random bytes used by one emitted particle and the number of particles
+// the random bytes are generated for at once
+#define PARTICLE_RANDOM_BYTES 11
+#define PARTICLE_SPAWN_CHUNK 32
+
+// Smallest number of particles worth running in a thread of its own
+#define PARTICLE_JOB_MIN_SIZE 128
+
+// Number of live particles examined when choosing one to be replaced
+#define PARTICLE_VICTIM_WINDOW 16
+
 class GameInstance;
 class ParticleEngine;
 class ParticleType;
 
 
-class Particle
+// Structure-of-arrays storage for the particles. All the arrays are 16 byte
+// aligned and padded to a multiple of PARTICLE_STORE_ALIGN entries so that
+// the run kernel can always process full SIMD blocks.
+#define PARTICLE_STORE_ALIGN 4
+
+// Define QOTH_COMPACT_PARTICLES to store the particle state in 16 bits for
+// memory bound targets. The positions are then stored relative to the
+// middle of the level with 1/1024 unit precision, which covers 32 units to
+// both directions, and the directions with 1/128 unit/s precision. The
+// lifetime is stored relative to the longest lifetime of the type. The
+// angle is stored in 1/65536 turns, and the angle increment, size and size
+// increment with a shift of each type chosen from the largest values its
+// particles can reach. The color takes three bytes.
+//
+// A particle then takes 30 bytes, about half of the 60 bytes of a pointer
+// and 13 ints. The lifetime and the alive counter keep 16 bits since at
+// 8 bits a frame is below one step and the particles would not age, and
+// the live list index needs 16 bits for more than 256 particles. The
+// index limits an engine to SHRT_MAX particles.
+#define PARTICLE_COMPACT_POS_SHIFT 2
+#define PARTICLE_COMPACT_DIR_SHIFT 5
+#define PARTICLE_COMPACT_LIFE_MAX 65535
+
+class ParticleStore
 {
 public:
-    Particle();
-    ~Particle();
+    ParticleStore(int capacity);
+    ~ParticleStore();
 
 public:
-    void run(ParticleEngine *engine, int fixedFrameTime);
+    inline int capacity() const { return m_capacity; }
+    void copy(int from, int to);
+    void setType(int p, ParticleType *type);
+    int bucket(int p) const;
+
+    // State in the 12 bit fixed point units regardless of the storage
+#ifdef QOTH_COMPACT_PARTICLES
+    inline int pos(int axis, int p) const {
+        return (m_pos[axis][p] << PARTICLE_COMPACT_POS_SHIFT)
+                + (axis == 0 ? m_originX : 0);
+    }
+    inline void setPos(int axis, int p, int fixedPos) {
+        m_pos[axis][p] = clampShort(((axis == 0 ? fixedPos - m_originX
+                                                : fixedPos)
+                                     + (1 << (PARTICLE_COMPACT_POS_SHIFT - 1)))
+                                    >> PARTICLE_COMPACT_POS_SHIFT);
+    }
+    inline int dir(int axis, int p) const {
+        return m_dir[axis][p] << PARTICLE_COMPACT_DIR_SHIFT;
+    }
+    inline void setDir(int axis, int p, int fixedDir) {
+        m_dir[axis][p] = clampShort((fixedDir
+                                     + (1 << (PARTICLE_COMPACT_DIR_SHIFT - 1)))
+                                    >> PARTICLE_COMPACT_DIR_SHIFT);
+    }
+    inline int lifeTime(int p) const {
+        return (int)((qint64)m_lifeTime[p] * m_maxLifeTime[m_typeIndex[p]]
+                     / PARTICLE_COMPACT_LIFE_MAX);
+    }
+    void setLifeTime(int p, int fixedLifeTime);
+    static int compactShift(qint64 value, int limit);
+    inline int aliveCounter(int p) const { return m_aliveCounter[p]; }
+    inline void setAliveCounter(int p, int fixedTime) {
+        m_aliveCounter[p] = (unsigned short)(fixedTime > 65535 ? 65535
+                                                               : fixedTime);
+    }
+    inline int angle(int p) const { return m_angle[p] << 1; }
+    inline void setAngle(int p, int fixedAngle) {
+        m_angle[p] = (unsigned short)((fixedAngle + 1) >> 1);
+    }
+    inline int angleInc(int p) const {
+        return m_angleInc[p] << m_angleIncShift[m_typeIndex[p]];
+    }
+    inline void setAngleInc(int p, int fixedAngleInc) {
+        int shift = m_angleIncShift[m_typeIndex[p]];
+        m_angleInc[p] = clampShort((fixedAngleInc + ((1 << shift) >> 1))
+                                   >> shift);
+    }
+    inline int size(int p) const {
+        return m_size[p] << m_sizeShift[m_typeIndex[p]];
+    }
+    inline void setSize(int p, int fixedSize) {
+        int shift = m_sizeShift[m_typeIndex[p]];
+        int value = (fixedSize + ((1 << shift) >> 1)) >> shift;
+        m_size[p] = (unsigned short)(value < 0 ? 0
+                                               : (value > 65535 ? 65535
+                                                                : value));
+    }
+    inline int sizeInc(int p) const {
+        return m_sizeInc[p] << m_sizeIncShift[m_typeIndex[p]];
+    }
+    inline void setSizeInc(int p, int fixedSizeInc) {
+        int shift = m_sizeIncShift[m_typeIndex[p]];
+        m_sizeInc[p] = clampShort((fixedSizeInc + ((1 << shift) >> 1))
+                                  >> shift);
+    }
+    inline unsigned int color(int p) const {
+        return m_color[0][p] | (m_color[1][p] << 8) | (m_color[2][p] << 16);
+    }
+    inline void setColor(int p, unsigned int color) {
+        m_color[0][p] = (unsigned char)(color & 255);
+        m_color[1][p] = (unsigned char)((color >> 8) & 255);
+        m_color[2][p] = (unsigned char)((color >> 16) & 255);
+    }
+
+    static inline short clampShort(int value) {
+        return (short)(value < -32768 ? -32768
+                                      : (value > 32767 ? 32767 : value));
+    }
+#else
+    inline int pos(int axis, int p) const { return m_pos[axis][p]; }
+    inline void setPos(int axis, int p, int fixedPos) {
+        m_pos[axis][p] = fixedPos;
+    }
+    inline int dir(int axis, int p) const { return m_dir[axis][p]; }
+    inline void setDir(int axis, int p, int fixedDir) {
+        m_dir[axis][p] = fixedDir;
+    }
+    inline int lifeTime(int p) const { return m_lifeTime[p]; }
+    inline void setLifeTime(int p, int fixedLifeTime) {
+        m_lifeTime[p] = fixedLifeTime;
+    }
+    inline int aliveCounter(int p) const { return m_aliveCounter[p]; }
+    inline void setAliveCounter(int p, int fixedTime) {
+        m_aliveCounter[p] = fixedTime;
+    }
+    inline int angle(int p) const { return m_angle[p]; }
+    inline void setAngle(int p, int fixedAngle) { m_angle[p] = fixedAngle; }
+    inline int angleInc(int p) const { return m_angleInc[p]; }
+    inline void setAngleInc(int p, int fixedAngleInc) {
+        m_angleInc[p] = fixedAngleInc;
+    }
+    inline int size(int p) const { return m_size[p]; }
+    inline void setSize(int p, int fixedSize) { m_size[p] = fixedSize; }
+    inline int sizeInc(int p) const { return m_sizeInc[p]; }
+    inline void setSizeInc(int p, int fixedSizeInc) {
+        m_sizeInc[p] = fixedSizeInc;
+    }
+    inline unsigned int color(int p) const { return m_color[p]; }
+    inline void setColor(int p, unsigned int color) { m_color[p] = color; }
+#endif
 
 public: // Data
-    ParticleType *m_type;
-    int m_pos[3];
-    int m_dir[3];
-    int m_lifeTime;
-    int m_aliveCounter;
-    int m_angle;
-    int m_angleInc;
-    int m_size;
-    int m_sizeInc;
-    unsigned int m_color;
+#ifdef QOTH_COMPACT_PARTICLES
+    short *m_pos[3];
+    short *m_dir[3];
+    unsigned short *m_lifeTime;
+    unsigned short *m_aliveCounter;
+    unsigned short *m_angle;
+    short *m_angleInc;
+    unsigned short *m_size;
+    short *m_sizeInc;
+    unsigned char *m_color[3]; // Red, green and blue
+#else
+    int *m_pos[3];
+    int *m_dir[3];
+    int *m_lifeTime;
+    int *m_aliveCounter;
+    int *m_angle;
+    int *m_angleInc;
+    int *m_size;
+    int *m_sizeInc;
+    unsigned int *m_color;
+#endif
+
+#ifdef QOTH_COMPACT_PARTICLES
+    // Live list of the particle's type; the run kernel reads the type
+    // attributes from the ParticleEngine.
+    unsigned char *m_typeIndex;
+
+    // Longest possible lifetime per live list
+    int m_maxLifeTime[PARTICLE_MAX_TYPES];
+
+    // Storage shifts of the angle increment, size and size increment per
+    // live list
+    int m_angleIncShift[PARTICLE_MAX_TYPES];
+    int m_sizeShift[PARTICLE_MAX_TYPES];
+    int m_sizeIncShift[PARTICLE_MAX_TYPES];
+
+    // Fixed point x of the middle of the level
+    int m_originX;
+
+    // Position of each particle in its type's live list
+    short *m_bucketIndex;
+#else
+    // Copies of the ParticleType attributes needed by the run kernel
+    int *m_fraction;
+    int *m_gravity;
+    int *m_turbulenceMul;
+    int *m_sizeIncInc;
+    int *m_angleIncInc;
+
+    ParticleType **m_type;
+
+    // Position of each particle in its type's live list
+    int *m_bucketIndex;
+#endif
+
+protected: // Data
+    char *m_data;
+    int m_capacity;
+};
+
+
+
+/*!
+  Vertex of a particle quad in the batched rendering. Every vertex of a
+  quad carries the particle center, its own corner and the rotation of the
+  particle scaled by its size.
+*/
+struct ParticleVertex
+{
+    GLfloat m_pos[3];
+    GLfloat m_corner[4]; // corner x, corner y, cos * size, sin * size
+    GLubyte m_color[4];
+};
+
+
+/*!
+  Vertex of a GPU evaluated particle. Written once when the particle is
+  emitted; the vertex shader computes the particle's state from the time
+  elapsed since its birth. All values are in world units, seconds and
+  radians.
+*/
+struct ParticleGpuVertex
+{
+    GLfloat m_pos[4];    // initial position, birth time
+    GLfloat m_dir[4];    // initial direction, lifetime
+    GLfloat m_growth[4]; // size, size increment, angle, angle increment
+    GLfloat m_corner[2];
+    GLubyte m_color[4];
 };
 
 
+/*!
+  Ring of GPU evaluated particles of one ParticleType. The particles are in
+  birth order; [m_retired, m_emitted) are the ones which may still be
+  alive and [m_uploaded, m_emitted) the ones not yet in the vertex buffer.
+*/
+class ParticleRing
+{
+public:
+    ParticleRing(int capacity);
+    ~ParticleRing();
+
+public: // Data
+    ParticleGpuVertex *m_vertices;
+    float *m_deathTime;
+    int m_capacity;
+    unsigned int m_emitted;
+    unsigned int m_uploaded;
+    unsigned int m_retired;
+    GLuint m_vbo;
+};
+
 
 class ParticleEngine
 {
 public:
+    // What to do when a particle is emitted while all of them are alive
+    enum OverflowPolicy {
+        OverflowDropNew,
+        OverflowReplaceOldest,
+        OverflowReplaceSmallest
+    };
+
     ParticleEngine(GameInstance *gameInstance, int maxParticles);
     virtual ~ParticleEngine();
 
 public:
+    void setOverflowPolicy(OverflowPolicy policy) { m_overflowPolicy = policy; }
+    OverflowPolicy overflowPolicy() const { return m_overflowPolicy; }
+    int liveCount() const { return m_liveCount; }
+    int droppedCount() const { return m_droppedCount; }
+    int stolenCount() const { return m_stolenCount; }
+    void resetCounters();
+
     void run(float frameTime);
+    void runRange(int first, int last, int fixedFrameTime);
+#ifdef QOTH_COMPACT_PARTICLES
+    void runRangeCompact(int first, int last, int fixedFrameTime);
+#else
+    void runRangeScalar(int first, int last, int fixedFrameTime);
+#endif
     void render(ParticleType *renderType, GLuint program);
     void emitParticles(int count,
                        ParticleType *type,
@@ -55,8 +327,37 @@ public:
                           QVector3D &pos1,
                           QVector3D &pos2, float posRandom,
                           QVector3D &dir, float dirRandom);
-    GLuint normalProgram() { return m_program; }
-    GLuint smokeProgram() { return m_smokeProgram; }
+    void emitParticlesBatch(int count,
+                            ParticleType *type,
+                            const QVector3D *positions, float posRandom,
+                            QVector3D &dir, float dirRandom);
+    const GameProgram &normalProgram() const { return m_program; }
+    const GameProgram &smokeProgram() const { return m_smokeProgram; }
+
+protected:
+    int allocateParticle();
+    bool emitFixed(int count, ParticleType *type,
+                   const int *fixedPositions, int positionStride,
+                   int fixedPosRandom,
+                   const int *fixedDirection, int fixedDirRandom);
+    void spawnParticle(ParticleStore *ps, int p, ParticleType *type,
+                       const int *fixedPosition, int fixedPosRandom,
+                       const int *fixedDirection, int fixedDirRandom,
+                       const unsigned char *random);
+    bool emitGpuParticles(int count, ParticleType *type,
+                          const int *fixedPositions, int positionStride,
+                          int fixedPosRandom,
+                          const int *fixedDirection, int fixedDirRandom,
+                          const unsigned char *random);
+    void renderRing(ParticleType *renderType, GLuint program);
+    void uploadRing(ParticleRing *ring, unsigned int first, unsigned int last);
+    void drawRing(ParticleRing *ring, unsigned int first, unsigned int last);
+    void bindBatchProgram(ParticleType *renderType,
+                          const GameProgram &program);
+    void killParticle(int particleIndex);
+    int registerType(ParticleType *type);
+    void addToBucket(int particleIndex);
+    void removeFromBucket(int particleIndex);
 
 public: // Data
     short m_turbulenceMap[128][128][2];
@@ -64,16 +365,42 @@ public: // Data
 
 protected:
     GameInstance *m_gameInstance;
-    Particle *m_particles;
-    GLint m_program;
-    GLint m_smokeProgram;
+    ParticleStore *m_particles;
+    GameProgram m_program;
+    GameProgram m_smokeProgram;
     float m_cosTable[512];
     int m_maxParticles;
-    int m_currentParticle;
-    GLint m_smokeFragmentShader;
-    GLint m_fragmentShader;
-    GLint m_vertexShader;
+
+    // The live particles are kept packed in [0, m_liveCount).
+    int m_liveCount;
+    OverflowPolicy m_overflowPolicy;
+    int m_victimCursor;
+    int m_droppedCount;
+    int m_stolenCount;
+
+    // Live particle indices per registered particle type
+    ParticleType *m_bucketTypes[PARTICLE_MAX_TYPES];
+    int *m_buckets[PARTICLE_MAX_TYPES];
+    int m_bucketCounts[PARTICLE_MAX_TYPES];
+    int m_bucketCount;
+
+    // GPU evaluated types have a ring instead of a live list.
+    ParticleRing *m_rings[PARTICLE_MAX_TYPES];
+    ParticleStore *m_spawnStore;
+
+    // Seconds since the engine was created
+    float m_time;
+
+    // Batched rendering
+    GameProgram m_batchProgram;
+    GameProgram m_batchSmokeProgram;
+    GameProgram m_gpuProgram;
+    GameProgram m_gpuSmokeProgram;
+    ParticleVertex *m_batchVertices;
     GLuint m_vbo;
+    GLuint m_indexBuffer;
+    int m_streamSize;
+    int m_streamOffset;
 };
 
 
@@ -138,8 +465,15 @@ public:
     float m_generalVisibility;
     bool m_additiveParticle;
 
+    // When set, the particles of this type are evaluated by the vertex
+    // shader from their initial state. Only for types without turbulence.
+    bool m_gpuEvaluated;
+
     float m_col[3];
     float m_colRandom[3];
+
+    // Live list index in the ParticleEngine, -1 until first emitted
+    int m_bucket;
 };
 
 
@@ -3,12 +3,325 @@
  */
 
 #include "TextureManager.h"
-#include "GameInstance.h"
+
+#include <QFile>
+#include <stdio.h>
+#include <string.h>
+
+// Select the SIMD flavour of the pixel swizzle. Define QOTH_NO_SIMD to
+// force the scalar version.
+#if !defined(QOTH_NO_SIMD) && defined(__SSSE3__)
+    #define TEXTURE_SWIZZLE_SSSE3
+    #include <tmmintrin.h>
+#elif !defined(QOTH_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) \
+    || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+    #define TEXTURE_SWIZZLE_SSE2
+    #include <emmintrin.h>
+#elif !defined(QOTH_NO_SIMD) && (defined(__ARM_NEON__) || defined(__ARM_NEON))
+    #define TEXTURE_SWIZZLE_NEON
+    #include <arm_neon.h>
+#endif
+
+#include "CompressedImage.h"
+#include "GameAssetLoader.h"
+#include "trace.h"
+
+#ifndef GL_BGRA_EXT
+#define GL_BGRA_EXT 0x80E1
+#endif
+
+// Pixel format the images are uploaded in and the compressed formats
+// supported, see TextureManager::initFormats()
+static GLenum glImageFormat = GL_RGBA;
+static bool etc1Supported = false;
+static bool pvrtcSupported = false;
+
+
+/*!
+  Returns the name of a compressed version of the image \a name in a
+  format supported by the GL, or an empty string if there is none. The
+  compressed images are made offline with tools/compress_textures.sh.
+*/
+static QString compressedName(const QString &name)
+{
+    int dot = name.lastIndexOf('.');
+    QString base = dot >= 0 ? name.left(dot) : name;
+
+    // PVRTC keeps the alpha channel, ETC1 is only made of opaque images
+    if (pvrtcSupported && QFile::exists(base + ".pvrtc.ktx"))
+        return base + ".pvrtc.ktx";
+
+    if (etc1Supported) {
+        if (QFile::exists(base + ".etc1.ktx"))
+            return base + ".etc1.ktx";
+
+        if (QFile::exists(base + ".pkm"))
+            return base + ".pkm";
+    }
+
+    return QString();
+}
+
+
+/*!
+  \class TextureAsset
+  \brief A texture decoded by the asset loader and uploaded into the GL
+  texture already reserved for it. A compressed version of the image is
+  used instead of the image when there is one.
+*/
+class TextureAsset : public GameAsset
+{
+public:
+    TextureAsset(TextureManager *manager, int handle, const QString &name)
+        : m_manager(manager),
+          m_handle(handle),
+          m_name(name)
+    {
+    }
+
+    void load()
+    {
+        QString compressed = compressedName(m_name);
+
+        if (!compressed.isEmpty() && m_compressed.load(compressed))
+            return;
+
+        m_image = QImage(m_name);
+        TextureManager::toGLImage(m_image);
+    }
+
+    void finish()
+    {
+        if (!m_compressed.isNull())
+            m_manager->setCompressedImage(m_handle, m_compressed);
+        else
+            m_manager->setImage(m_handle, m_image);
+    }
+
+protected: // Data
+    TextureManager *m_manager; // Not owned
+    int m_handle;
+    QString m_name;
+    QImage m_image;
+    CompressedImage m_compressed;
+};
+
+
+/*!
+  \class TextureAtlasAsset
+  \brief Images decoded and packed into atlas pages by the asset loader.
+  The pages are uploaded and the regions of the images set when finished.
+*/
+class TextureAtlasAsset : public GameAsset
+{
+public:
+    TextureAtlasAsset(TextureManager *manager, const QVector<QString> &names,
+                      const QVector<int> &handles);
+
+    void load();
+    void finish();
+
+protected: // Data
+    TextureManager *m_manager; // Not owned
+    QVector<QString> m_names;
+    QVector<int> m_handles;
+
+    // Results of load(). The images not packed keep their own image.
+    QVector<QImage> m_images;
+    QVector<int> m_page;
+    QVector<int> m_placeX;
+    QVector<int> m_placeY;
+    QImage m_pages[TEXTURE_ATLAS_MAX_PAGES];
+    int m_pageCount;
+};
+
+
+/*!
+  Constructor. The images \a names are packed for the \a handles.
+*/
+TextureAtlasAsset::TextureAtlasAsset(TextureManager *manager,
+                                     const QVector<QString> &names,
+                                     const QVector<int> &handles)
+    : m_manager(manager),
+      m_names(names),
+      m_handles(handles),
+      m_pageCount(0)
+{
+}
+
+
+/*!
+  Decodes the images and packs them into the pages, TEXTURE_ATLAS_SIZE
+  pixels wide. The images are placed on shelves from the tallest to the
+  lowest. Images too large for a page and images not fitting in
+  TEXTURE_ATLAS_MAX_PAGES pages are left as textures of their own.
+*/
+void TextureAtlasAsset::load()
+{
+    int count = m_names.size();
+    QVector<int> order(count);
+    int sorted = 0;
+    const int maxSize = TEXTURE_ATLAS_SIZE - TEXTURE_ATLAS_PADDING * 2;
+
+    m_images.resize(count);
+    m_page.resize(count);
+    m_placeX.resize(count);
+    m_placeY.resize(count);
+
+    for (int f = 0; f < count; f++) {
+        m_images[f] = QImage(m_names[f]).convertToFormat(
+                    QImage::Format_ARGB32);
+        m_page[f] = -1;
+
+        if (m_images[f].isNull() || m_images[f].width() > maxSize
+                || m_images[f].height() > maxSize) {
+            DEBUG_INFO("Image not packed into the texture atlas");
+            continue;
+        }
+
+        // Insertion sort by descending height
+        int g = sorted - 1;
+
+        while (g >= 0 && m_images[order[g]].height() < m_images[f].height()) {
+            order[g + 1] = order[g];
+            g--;
+        }
+
+        order[g + 1] = f;
+        sorted++;
+    }
+
+    // Shelf packing. A new page is started when the shelves don't fit.
+    int pageHeight[TEXTURE_ATLAS_MAX_PAGES];
+    int x = TEXTURE_ATLAS_SIZE;
+    int y = 0;
+    int shelfHeight = 0;
+
+    for (int f = 0; f < sorted; f++) {
+        int i = order[f];
+        int w = m_images[i].width() + TEXTURE_ATLAS_PADDING * 2;
+        int h = m_images[i].height() + TEXTURE_ATLAS_PADDING * 2;
+
+        if (x + w > TEXTURE_ATLAS_SIZE) {
+            x = 0;
+            y += shelfHeight;
+            shelfHeight = h;
+        }
+
+        if (m_pageCount == 0 || y + h > TEXTURE_ATLAS_SIZE) {
+            if (m_pageCount == TEXTURE_ATLAS_MAX_PAGES)
+                break;
+
+            pageHeight[m_pageCount] = 0;
+            m_pageCount++;
+            x = 0;
+            y = 0;
+            shelfHeight = h;
+        }
+
+        m_placeX[i] = x + TEXTURE_ATLAS_PADDING;
+        m_placeY[i] = y + TEXTURE_ATLAS_PADDING;
+        m_page[i] = m_pageCount - 1;
+
+        if (y + h > pageHeight[m_pageCount - 1])
+            pageHeight[m_pageCount - 1] = y + h;
+
+        x += w;
+    }
+
+    for (int p = 0; p < m_pageCount; p++) {
+        // Power of two height enclosing the used shelves
+        int height = 1;
+
+        while (height < pageHeight[p])
+            height <<= 1;
+
+        QImage atlas(TEXTURE_ATLAS_SIZE, height, QImage::Format_ARGB32);
+        atlas.fill(0);
+
+        for (int i = 0; i < count; i++) {
+            if (m_page[i] != p)
+                continue;
+
+            for (int row = 0; row < m_images[i].height(); row++) {
+                memcpy((GLuint*)atlas.scanLine(m_placeY[i] + row)
+                       + m_placeX[i],
+                       m_images[i].constScanLine(row),
+                       m_images[i].width() * sizeof(GLuint));
+            }
+        }
+
+        TextureManager::toGLImage(atlas);
+        m_pages[p] = atlas;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (m_page[i] < 0 && !m_images[i].isNull())
+            TextureManager::toGLImage(m_images[i]);
+    }
+}
+
+
+/*!
+  Uploads the pages and sets the regions of the packed images. The images
+  not packed are uploaded as textures of their own.
+*/
+void TextureAtlasAsset::finish()
+{
+    GLuint pageTexture[TEXTURE_ATLAS_MAX_PAGES];
+
+    for (int p = 0; p < m_pageCount; p++) {
+        // The page itself owns the texture shared by its regions.
+        char pageName[16];
+        sprintf(pageName, "atlas:%d", m_manager->m_atlasPageCount++);
+        int pageHandle = m_manager->addEntry(QString(pageName));
+        glGenTextures(1, &pageTexture[p]);
+        m_manager->m_entries[pageHandle].region.textureID = pageTexture[p];
+        m_manager->m_entries[pageHandle].ownsTexture = true;
+        m_manager->setImage(pageHandle, m_pages[p]);
+    }
+
+    for (int i = 0; i < m_names.size(); i++) {
+        TextureManager::STextureEntry &entry =
+                m_manager->m_entries[m_handles[i]];
+
+        if (m_page[i] >= 0) {
+            const QImage &atlas = m_pages[m_page[i]];
+            int w = m_images[i].width();
+            int h = m_images[i].height();
+            entry.region.textureID = pageTexture[m_page[i]];
+            entry.region.uv[0] = (GLfloat)m_placeX[i] / atlas.width();
+            entry.region.uv[1] = (GLfloat)m_placeY[i] / atlas.height();
+            entry.region.uv[2] = (GLfloat)(m_placeX[i] + w) / atlas.width();
+            entry.region.uv[3] = (GLfloat)(m_placeY[i] + h) / atlas.height();
+            entry.loaded = true;
+        }
+        else {
+            glGenTextures(1, &entry.region.textureID);
+            entry.ownsTexture = true;
+            m_manager->setImage(m_handles[i], m_images[i]);
+        }
+    }
+}
 
 
 /*!
   \class TextureManager
-  \brief -
+  \brief Loads the textures once and shares them by name.
+
+  Every image gets a stable integer handle when it is first requested.
+  The handles are resolved once, e.g. with preload(), and texture() and
+  region() then look the textures up without touching the names. Small
+  sprite images can be packed into atlas pages with createAtlas(), after
+  which their region is the page texture and the image's rectangle in it.
+
+  With an asset loader set, the images are decoded in the loader threads.
+  The texture ID of a plain image is valid at once and shows a transparent
+  pixel until the image has been uploaded; isLoaded() tells when that has
+  happened. The regions of atlas images are set when the atlas is loaded.
+
+  An image of its own is replaced with a compressed version of it, e.g.
+  ground.pvrtc.ktx for ground.png, when the GL supports the format.
 */
 
 
@@ -16,7 +329,8 @@
   Constructor.
 */
 TextureManager::TextureManager()
-    : m_list(0)
+    : m_loader(0),
+      m_atlasPageCount(0)
 {
 }
 
@@ -31,56 +345,331 @@ TextureManager::~TextureManager()
 
 
 /*!
-  Frees all allocated resources.
+  Frees all allocated resources. The handles given out so far become
+  invalid.
 */
 void TextureManager::releaseAll()
 {
-    TextureManager::STextureCapsule *l = m_list;
+    for (int f = 0; f < m_entries.size(); f++) {
+        if (m_entries[f].ownsTexture)
+            glDeleteTextures(1, &m_entries[f].region.textureID);
+    }
 
-    while (l) {
-        TextureManager::STextureCapsule *n = l->next;
+    m_entries.clear();
+    m_handles.clear();
+}
 
-        if (l->name)
-            delete [] l->name;
 
-        glDeleteTextures(1, &l->textureID);
-        delete l;
-        l = n;
+/*!
+  Sets the \a loader decoding the images requested from now on. Without a
+  loader the images are loaded at once when requested.
+*/
+void TextureManager::setLoader(GameAssetLoader *loader)
+{
+    m_loader = loader;
+}
+
+
+/*!
+  Returns the handle of the image \a name, loading it as a texture of its
+  own unless it has been requested or packed into an atlas already. The
+  texture gets mipmaps if \a mipmaps is true when it is first requested.
+  Returns -1 for an empty name.
+*/
+int TextureManager::handle(const char *name, bool mipmaps)
+{
+    if (!name || name[0] == 0)
+        return -1;
+
+    QString key(name);
+    int h = m_handles.value(key, -1);
+
+    if (h >= 0)
+        return h;
+
+    h = addEntry(key);
+    m_entries[h].ownsTexture = true;
+    m_entries[h].mipmaps = mipmaps;
+
+    if (m_loader) {
+        // Reserve the texture, transparent until the image is uploaded
+        static const GLuint transparent = 0;
+        GLuint texture;
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA,
+                     GL_UNSIGNED_BYTE, &transparent);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        m_entries[h].region.textureID = texture;
+        m_loader->add(new TextureAsset(this, h, key));
+    }
+    else {
+        glGenTextures(1, &m_entries[h].region.textureID);
+        TextureAsset asset(this, h, key);
+        asset.load();
+        asset.finish();
     }
 
-    m_list = 0;
+    return h;
+}
+
+
+/*!
+  Resolves the manifest of \a count images in \a names into \a handles,
+  requesting the images not yet requested.
+*/
+void TextureManager::preload(const char * const *names, int count,
+                             int *handles)
+{
+    for (int f = 0; f < count; f++)
+        handles[f] = handle(names[f]);
 }
 
 
+/*!
+  Returns a texture with \a name or 0 in case of an error. For an image
+  packed in an atlas this is the texture of the whole atlas page. Prefer
+  resolving a handle once in the code run every frame.
+*/
+GLuint TextureManager::getTexture(const char *name, bool mipmaps)
+{
+    int h = handle(name, mipmaps);
+    return h >= 0 ? texture(h) : 0;
+}
+
 
 /*!
-  Returns a texture with \a name or 0 in case of an error.
+  Returns the texture and the texture coordinates of the image \a name.
+  The texture ID of the returned region is 0 in case of an error.
 */
-GLuint TextureManager::getTexture(const char *name)
+TextureManager::STextureRegion TextureManager::getRegion(const char *name)
 {
-    if (!name || name[0] == 0)
-        return 0;
+    int h = handle(name);
 
-    TextureManager::STextureCapsule *l = m_list;
+    if (h >= 0)
+        return region(h);
 
-    while (l) {
-        if (!strcmp(l->name, name))
-            return l->textureID;
+    STextureRegion noRegion = { 0, { 0.0f, 0.0f, 1.0f, 1.0f } };
+    return noRegion;
+}
 
-        l = l->next;
+
+/*!
+  Packs the \a count images in \a names into atlas pages, see
+  TextureAtlasAsset. The handles of the images are valid at once but their
+  regions only when the atlas is loaded. Images already requested are left
+  as they are.
+*/
+void TextureManager::createAtlas(const char * const *names, int count)
+{
+    QVector<QString> atlasNames;
+    QVector<int> atlasHandles;
+
+    for (int f = 0; f < count; f++) {
+        QString key(names[f]);
+
+        if (m_handles.contains(key))
+            continue;
+
+        atlasNames.append(key);
+        atlasHandles.append(addEntry(key));
     }
 
-    TextureManager::STextureCapsule *ncap =
-            new TextureManager::STextureCapsule;
+    if (atlasNames.isEmpty())
+        return;
 
-    ncap->next = m_list;
-    m_list = ncap;
-    int nlen = strlen(name);
-    ncap->name = new char[nlen +1];
-    memcpy(ncap->name, name, nlen);
-    ncap->name[nlen] = 0;
-    ncap->textureID = GameInstance::loadGLTexture(QString(name));
+    TextureAtlasAsset *atlas =
+            new TextureAtlasAsset(this, atlasNames, atlasHandles);
 
-    return ncap->textureID;
+    if (m_loader) {
+        m_loader->add(atlas);
+    }
+    else {
+        atlas->load();
+        atlas->finish();
+        delete atlas;
+    }
 }
 
+
+/*!
+  Adds an entry for \a name covering the whole of a texture not yet set
+  and returns its handle.
+*/
+int TextureManager::addEntry(const QString &name)
+{
+    STextureEntry entry;
+    entry.region.textureID = 0;
+    entry.region.uv[0] = 0.0f;
+    entry.region.uv[1] = 0.0f;
+    entry.region.uv[2] = 1.0f;
+    entry.region.uv[3] = 1.0f;
+    entry.ownsTexture = false;
+    entry.loaded = false;
+    entry.mipmaps = false;
+
+    int h = m_entries.size();
+    m_entries.append(entry);
+    m_handles.insert(name, h);
+
+    return h;
+}
+
+
+/*!
+  Uploads \a glImage, converted with toGLImage(), into the texture of
+  \a handle and marks it loaded.
+*/
+void TextureManager::setImage(int handle, const QImage &glImage)
+{
+    if (glImage.isNull())
+        DEBUG_INFO("Failed to load a texture");
+    else
+        uploadImage(m_entries[handle].region.textureID, glImage,
+                    m_entries[handle].mipmaps);
+
+    m_entries[handle].loaded = true;
+}
+
+
+/*!
+  Uploads the compressed \a image into the texture of \a handle and marks
+  it loaded.
+*/
+void TextureManager::setCompressedImage(int handle,
+                                        const CompressedImage &image)
+{
+    image.upload(m_entries[handle].region.textureID,
+                 m_entries[handle].mipmaps);
+    m_entries[handle].loaded = true;
+}
+
+
+/*!
+  Chooses the pixel format of the uploaded images. With
+  GL_EXT_texture_format_BGRA8888 the pixels of a little endian
+  QImage::Format_ARGB32 image are uploaded as they are, otherwise they are
+  swizzled to GL_RGBA. Also checks which compressed formats can be used,
+  define QOTH_NO_COMPRESSED_TEXTURES to always load the plain images. Must
+  be called in the GL thread before any image is loaded.
+*/
+void TextureManager::initFormats()
+{
+    const char *extensions = (const char*)glGetString(GL_EXTENSIONS);
+
+    if (!extensions)
+        extensions = "";
+
+    glImageFormat = GL_RGBA;
+
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    if (strstr(extensions, "GL_EXT_texture_format_BGRA8888")) {
+        DEBUG_INFO("Uploading the textures in BGRA");
+        glImageFormat = GL_BGRA_EXT;
+    }
+#endif
+
+#ifdef QOTH_NO_COMPRESSED_TEXTURES
+    etc1Supported = false;
+    pvrtcSupported = false;
+#else
+    etc1Supported =
+            strstr(extensions, "GL_OES_compressed_ETC1_RGB8_texture") != 0;
+    pvrtcSupported =
+            strstr(extensions, "GL_IMG_texture_compression_pvrtc") != 0;
+#endif
+}
+
+
+/*!
+  Converts \a image in place into the pixel format uploaded by
+  uploadImage(). The image is converted to QImage::Format_ARGB32 only if it
+  isn't in it already, and then swizzled unless the pixels can be uploaded
+  in BGRA. Doesn't touch GL, so it can be called in any thread.
+*/
+void TextureManager::toGLImage(QImage &image)
+{
+    if (image.isNull())
+        return;
+
+    if (image.format() != QImage::Format_ARGB32)
+        image = image.convertToFormat(QImage::Format_ARGB32);
+
+    if (glImageFormat == GL_BGRA_EXT)
+        return;
+
+    // The scanlines of a 32 bit image are contiguous. Swap the red and the
+    // blue bytes of each 0xAARRGGBB pixel.
+    GLuint *pixels = (GLuint*)image.bits();
+    int count = image.width() * image.height();
+    int f = 0;
+
+#if defined(TEXTURE_SWIZZLE_SSSE3)
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                          10, 9, 8, 11, 14, 13, 12, 15);
+
+    for (; f + 4 <= count; f += 4) {
+        __m128i *p = (__m128i*)(pixels + f);
+        _mm_storeu_si128(p, _mm_shuffle_epi8(_mm_loadu_si128(p), shuffle));
+    }
+#elif defined(TEXTURE_SWIZZLE_SSE2)
+    const __m128i alphaGreen = _mm_set1_epi32((int)0xff00ff00);
+
+    for (; f + 4 <= count; f += 4) {
+        __m128i *p = (__m128i*)(pixels + f);
+        __m128i v = _mm_loadu_si128(p);
+        __m128i redBlue = _mm_andnot_si128(alphaGreen, v);
+        redBlue = _mm_or_si128(_mm_slli_epi32(redBlue, 16),
+                               _mm_srli_epi32(redBlue, 16));
+        _mm_storeu_si128(p, _mm_or_si128(_mm_and_si128(v, alphaGreen),
+                                         redBlue));
+    }
+#elif defined(TEXTURE_SWIZZLE_NEON)
+    for (; f + 16 <= count; f += 16) {
+        uint8x16x4_t v = vld4q_u8((const uint8_t*)(pixels + f));
+        uint8x16_t blue = v.val[0];
+        v.val[0] = v.val[2];
+        v.val[2] = blue;
+        vst4q_u8((uint8_t*)(pixels + f), v);
+    }
+#endif
+
+    for (; f < count; f++) {
+        GLuint p = pixels[f];
+        pixels[f] = (p & 0xff00ff00) | ((p & 0xff) << 16) | ((p >> 16) & 0xff);
+    }
+}
+
+
+/*!
+  Uploads \a glImage, converted with toGLImage(), into \a texture straight
+  from the pixels of the image. With \a mipmaps the texture is minified
+  through generated mipmaps, which needs power of two dimensions in
+  OpenGL ES 2.0.
+*/
+void TextureManager::uploadImage(GLuint texture, const QImage &glImage,
+                                 bool mipmaps)
+{
+    int w = glImage.width();
+    int h = glImage.height();
+
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, glImageFormat, w, h, 0, glImageFormat,
+                 GL_UNSIGNED_BYTE, glImage.constBits());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    if (mipmaps && ((w & (w - 1)) != 0 || (h & (h - 1)) != 0)) {
+        DEBUG_INFO("No mipmaps for a texture not power of two in size");
+        mipmaps = false;
+    }
+
+    if (mipmaps) {
+        glGenerateMipmap(GL_TEXTURE_2D);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                        GL_LINEAR_MIPMAP_LINEAR);
+    }
+    else {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    }
+}
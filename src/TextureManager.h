@@ -6,16 +6,39 @@
 #define TEXTUREMANAGER_H
 
 #include <GLES2/gl2.h>
+#include <QHash>
+#include <QImage>
+#include <QString>
+#include <QVector>
+
+class CompressedImage;
+class GameAssetLoader;
+
+// Width and maximum height of an atlas page in pixels
+#define TEXTURE_ATLAS_SIZE 512
+
+// Maximum number of atlas pages created by one TextureManager::createAtlas()
+#define TEXTURE_ATLAS_MAX_PAGES 4
+
+// Transparent pixels around each image in an atlas page, so that the
+// linear filtering doesn't bleed the neighbouring images into a sprite
+#define TEXTURE_ATLAS_PADDING 2
 
 
 class TextureManager
 {
 public: // Data types
 
-    struct STextureCapsule {
-        char *name;
+    struct STextureRegion {
         GLuint textureID;
-        STextureCapsule *next;
+        GLfloat uv[4]; // left, top, right, bottom
+    };
+
+    struct STextureEntry {
+        STextureRegion region;
+        bool ownsTexture; // False for the images packed in an atlas page
+        bool loaded;
+        bool mipmaps;
     };
 
 public:
@@ -24,10 +47,48 @@ public:
 
 public:
     void releaseAll();
-    GLuint getTexture(const char *name);
+    void setLoader(GameAssetLoader *loader);
+    int handle(const char *name, bool mipmaps = false);
+    void preload(const char * const *names, int count, int *handles);
+    void createAtlas(const char * const *names, int count);
+
+    // Texture and region of a handle returned by handle() or preload()
+    inline GLuint texture(int handle) const
+    {
+        return m_entries[handle].region.textureID;
+    }
+
+    inline STextureRegion region(int handle) const
+    {
+        return m_entries[handle].region;
+    }
+
+    inline bool isLoaded(int handle) const
+    {
+        return m_entries[handle].loaded;
+    }
+
+    GLuint getTexture(const char *name, bool mipmaps = false);
+    STextureRegion getRegion(const char *name);
+
+    static void initFormats();
+    static void toGLImage(QImage &image);
+    static void uploadImage(GLuint texture, const QImage &glImage,
+                            bool mipmaps = false);
+
+protected:
+    int addEntry(const QString &name);
+    void setImage(int handle, const QImage &glImage);
+    void setCompressedImage(int handle, const CompressedImage &image);
 
 public: // Data
-    STextureCapsule *m_list;
+    QHash<QString, int> m_handles; // Interned names to indices of m_entries
+    QVector<STextureEntry> m_entries;
+    GameAssetLoader *m_loader; // Not owned
+    int m_atlasPageCount;
+
+    friend class TextureAsset;
+    friend class TextureAtlasAsset;
 };
 
 
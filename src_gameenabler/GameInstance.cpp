@@ -4,23 +4,105 @@
 
 #include "GameInstance.h"
 
+#include <QCoreApplication>
 #include <QImage>
+#include <QTime>
 #include <math.h>
 
 #include "audiobuffer.h"
 #include "audiobufferplayinstance.h"
 #include "gamewindow.h"
 
+#include "GameAssetLoader.h"
+#include "GameGLState.h"
+#include "GameJobPool.h"
 #include "GameLevel.h"
 #include "GameMenu.h"
 #include "GameObject.h"
 #include "GamePlayer.h"
+#include "GameProgramCache.h"
+#include "GameRandom.h"
 #include "ParticleEngine.h"
 #include "TextureManager.h"
 
 // Constants
 const int TreeCount(30);
 
+// The preload manifest in the order of GameInstance::GameTexture. The
+// sprites of the game objects come first and are packed into one atlas so
+// that the sprite batch can draw different kinds of objects with the same
+// texture.
+static const char *gameTextureNames[GameInstance::GameTextureCount] = {
+    ":/ammo1.png",
+    ":/arrow_down.png",
+    ":/gun.png",
+    ":/indicator.png",
+    ":/player.png",
+    ":/player_head.png",
+    ":/tip.png",
+    ":/tree1.png",
+    ":/treepart1.png",
+    ":/explo_flare1.png",
+    ":/fire_particle.png",
+    ":/ground.png",
+    ":/rock_wall.png",
+    ":/smoke1.png"
+};
+
+
+/*!
+  \class GameSampleAsset
+  \brief A WAV sample parsed by the asset loader and stored into its target
+  pointer when finished. Optionally starts looping the sample in a mixer.
+*/
+class GameSampleAsset : public GameAsset
+{
+public:
+    GameSampleAsset(GE::AudioBuffer **target, const char *fileName,
+                    GE::AudioMixer *loopMixer = 0)
+        : m_target(target),
+          m_fileName(fileName),
+          m_loopMixer(loopMixer),
+          m_buffer(0)
+    {
+    }
+
+    ~GameSampleAsset()
+    {
+        delete m_buffer;
+    }
+
+    void load()
+    {
+        m_buffer = GE::AudioBuffer::loadWav(m_fileName);
+
+        // Hand the buffer over to the main thread.
+        if (m_buffer)
+            m_buffer->moveToThread(QCoreApplication::instance()->thread());
+    }
+
+    void finish()
+    {
+        *m_target = m_buffer;
+
+        if (m_buffer && m_loopMixer) {
+            GE::AudioBufferPlayInstance *instance =
+                m_buffer->playWithMixer(*m_loopMixer);
+
+            if (instance)
+                instance->setLoopCount(-1);
+        }
+
+        m_buffer = 0;
+    }
+
+protected: // Data
+    GE::AudioBuffer **m_target; // Not owned
+    QString m_fileName;
+    GE::AudioMixer *m_loopMixer; // Not owned
+    GE::AudioBuffer *m_buffer; // Owned until finished
+};
+
 
 /*!
   \class GameInstance
@@ -40,9 +122,14 @@ GameInstance::GameInstance(int width, int height, GE::GameWindow *gameWindow)
       m_indicatorArrow(0),
       m_indicatorCircle(0),
       m_activePlayerIndicatorCircle(0),
+      m_assetLoader(0),
       m_textureManager(0),
       m_level(0),
       m_particleEngine(0),
+      m_random(0),
+      m_jobPool(0),
+      m_glState(0),
+      m_programCache(0),
       m_objManager(0),
       m_helpAngle(0.0f),
       m_helpPullState(0.0f),
@@ -53,7 +140,9 @@ GameInstance::GameInstance(int width, int height, GE::GameWindow *gameWindow)
       m_restarted(false),
       m_fireTargetVolume(0.0f),
       m_fireVolume(0.0f),
-      m_arrowAngle(0.0f)
+      m_arrowAngle(0.0f),
+      m_drawnCount(0),
+      m_culledCount(0)
 {
     // Initialize player array pointers.
     for (int i = 0; i < GAME_NOF_PLAYERS; ++i) {
@@ -61,26 +150,49 @@ GameInstance::GameInstance(int width, int height, GE::GameWindow *gameWindow)
     }
 
     m_mixer = &gameWindow->getMixer();
+
+    // Identity camera until the first frame sets it.
+    QMatrix4x4 camera;
+    memset(m_projectionMatrix, 0, sizeof(m_projectionMatrix));
+    setCamera(camera);
     setSize(width, height);
 
+#ifdef QOTH_RANDOM_SEED
+    m_random = new GameRandom(QOTH_RANDOM_SEED);
+#else
+    m_random = new GameRandom(QTime(0, 0).msecsTo(QTime::currentTime()));
+#endif
+
+    m_jobPool = new GameJobPool();
+    m_glState = new GameGLState();
+    m_programCache = new GameProgramCache();
+
+    // The images and the samples are loaded in the background while the
+    // first frames are drawn. The menu's texture is requested first so
+    // that the menu can show as soon as possible.
+    TextureManager::initFormats();
+    m_assetLoader = new GameAssetLoader();
     m_textureManager = new TextureManager();
+    m_textureManager->setLoader(m_assetLoader);
+    m_textureManager->handle(GAME_MENU_TEXTURE);
+    m_textureManager->createAtlas(gameTextureNames, AtlasTextureCount);
+    m_textureManager->preload(gameTextureNames, GameTextureCount,
+                              m_textures);
     m_objManager = new GameObjectManager(this);
 
     m_particleEngine = new ParticleEngine(this, GAME_MAX_PARTICLES);
     initParticles();
     initSamples();
 
-    // Start the background ambient noise.
-    GE::AudioBufferPlayInstance *bgSample =
-        m_sampleBackground->playWithMixer(*m_mixer);
-
-    if (bgSample) {
-        // Loop the sample forever.
-        bgSample->setLoopCount(-1);
-    }
-
     // Launch the main menu.
     m_currentMenu = new GameMenu(this, 0, 1,2);
+
+#ifdef QOTH_BENCHMARK_LEVEL
+    GameLevel::benchmark(this);
+#endif
+
+    // Store the programs linked so far for the next launch.
+    m_programCache->save();
 }
 
 
@@ -89,11 +201,17 @@ GameInstance::GameInstance(int width, int height, GE::GameWindow *gameWindow)
 */
 GameInstance::~GameInstance()
 {
+    // Stop loading first, the assets still loading refer to the managers.
+    delete m_assetLoader;
     delete m_currentMenu;
     delete m_textureManager;
     delete m_level;
     delete m_particleEngine;
+    delete m_jobPool;
+    delete m_glState;
     delete m_objManager;
+    delete m_programCache;
+    delete m_random;
 
     delete m_basicFireParticle;
     delete m_explosionFlareParticle;
@@ -115,11 +233,22 @@ GameInstance::~GameInstance()
 */
 void GameInstance::restartGame()
 {
+    // The game needs all the assets, wait for those still loading.
+    m_assetLoader->finishAll();
+
     m_restarted = true;
     delete m_level;
     m_level = new GameLevel(this);
+    m_programCache->save();
     m_objManager->destroyAll();
+
+#ifdef QOTH_LEVEL_FILE
+    // A pre-generated level, e.g. from a level pack
+    if (!m_level->load(QOTH_LEVEL_FILE))
+        m_level->recreate();
+#else
     m_level->recreate();
+#endif
 
     // Add some trees.
     for (int i = 0; i < TreeCount; ++i)
@@ -132,7 +261,7 @@ void GameInstance::restartGame()
         m_players[i]->createAssets();
         m_players[i]->pos().setX(
                 GAME_LEVEL_START_X + 8.0f
-                + (((float)(rand() & 255) / 255.0f) - 0.5f) * 2.0f
+                + (m_random->unit() - 0.5f) * 2.0f
                 + (float)i *((GAME_LEVEL_END_X - GAME_LEVEL_START_X) - 16.0f));
         m_players[i]->setOnGround(true);
     }
@@ -140,13 +269,13 @@ void GameInstance::restartGame()
     // Couple of more trees above the players, just to fake the eyes.
     for (int i = 0; i < 1; ++i) {
         GameObject *tree = placeTree();
-        tree->pos().setZ(tree->pos().z() + 1.0f + (rand() & 255) / 512.0f);
+        tree->pos().setZ(tree->pos().z() + 1.0f + m_random->byte() / 512.0f);
     }
 
     // Create the indicator arrow.
     m_indicatorArrow = m_objManager->addObject(
         new GameStaticObject(this,
-                             getTextureManager()->getTexture(":/arrow_down.png")));
+                             textureRegion(TextureArrowDown)));
     m_indicatorArrow->setRunEnabled(false);
     m_indicatorArrow->setDepthEnabled(false);
     m_indicatorArrow->setr(0.7f);
@@ -154,7 +283,7 @@ void GameInstance::restartGame()
     // Create the indicator circle indicating the active player.
     m_activePlayerIndicatorCircle = m_objManager->addObject(
         new GameStaticObject(this,
-                             getTextureManager()->getTexture(":/indicator.png")));
+                             textureRegion(TextureIndicator)));
     m_activePlayerIndicatorCircle->setRunEnabled(false);
     m_activePlayerIndicatorCircle->setDepthEnabled(false);
     m_activePlayerIndicatorCircle->setr(2.0f);
@@ -381,6 +510,8 @@ void GameInstance::setCamera(QMatrix4x4 &camera)
             m_cameraMatrix[f * 4 + g] = camera.constData()[f * 4 + g];
         }
     }
+
+    updateFrustum();
 }
 
 
@@ -398,6 +529,78 @@ void GameInstance::setSize(int width, int height)
             m_projectionMatrix[f * 4 + g] = projection.constData()[g * 4 + f];
         }
     }
+
+    updateFrustum();
+}
+
+
+/*!
+  Extracts the view frustum planes from the camera and projection
+  matrices, so that the objects outside of the view can be skipped before
+  transforming them.
+*/
+void GameInstance::updateFrustum()
+{
+    // The view matrix as cameraTransform() would produce it from identity.
+    float view[16];
+    memset(view, 0, sizeof(float) * 16);
+    view[0] = 1.0f;
+    view[5] = 1.0f;
+    view[10] = 1.0f;
+    view[15] = 1.0f;
+    cameraTransform(view);
+
+    // Row major clip matrix: projection * view
+    float clip[16];
+
+    for (int f = 0; f < 4; f++) {
+        for (int g = 0; g < 4; g++) {
+            clip[f * 4 + g] =
+                m_projectionMatrix[f * 4 + 0] * view[0 * 4 + g] +
+                m_projectionMatrix[f * 4 + 1] * view[1 * 4 + g] +
+                m_projectionMatrix[f * 4 + 2] * view[2 * 4 + g] +
+                m_projectionMatrix[f * 4 + 3] * view[3 * 4 + g];
+        }
+    }
+
+    // Left, right, bottom, top, near and far planes are the sums and
+    // differences of the fourth row and the other rows.
+    for (int f = 0; f < 6; f++) {
+        float sign = (f & 1) ? -1.0f : 1.0f;
+        int row = f / 2;
+        float length = 0.0f;
+
+        for (int g = 0; g < 4; g++) {
+            m_frustum[f][g] = clip[3 * 4 + g] + sign * clip[row * 4 + g];
+
+            if (g < 3)
+                length += m_frustum[f][g] * m_frustum[f][g];
+        }
+
+        length = sqrtf(length);
+
+        if (length < 0.000001f) {
+            // Degenerate plane, never culls.
+            m_frustum[f][0] = 0.0f;
+            m_frustum[f][1] = 0.0f;
+            m_frustum[f][2] = 0.0f;
+            m_frustum[f][3] = 1.0f;
+            continue;
+        }
+
+        for (int g = 0; g < 4; g++)
+            m_frustum[f][g] /= length;
+    }
+}
+
+
+/*!
+  Resets the drawn and culled counts. Called at the beginning of a frame.
+*/
+void GameInstance::resetRenderCounts()
+{
+    m_drawnCount = 0;
+    m_culledCount = 0;
 }
 
 
@@ -441,30 +644,23 @@ void GameInstance::cameraTransform(float *m, bool transformPosition)
 
 /*!
 */
-GLint GameInstance::loadGLTexture(QString filename)
+GLint GameInstance::loadGLTexture(QString filename, bool mipmaps)
+{
+    return createGLTexture(QImage(filename), mipmaps);
+}
+
+
+/*!
+  Creates a texture of the \a image, with mipmaps if \a mipmaps is true.
+*/
+GLint GameInstance::createGLTexture(const QImage &image, bool mipmaps)
 {
-    QImage image = QImage(filename);
+    QImage glImage(image);
+    TextureManager::toGLImage(glImage);
+
     GLuint texture;
     glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    GLuint* pTexData = new GLuint[image.width() * image.height()];
-    GLuint* sdata = (GLuint*)image.bits();
-    GLuint* tdata = pTexData;
-
-    for (int y = 0; y < image.height(); y++) {
-        for (int x = 0; x < image.width(); x++) {
-            *tdata = ((*sdata&255) << 16) | (((*sdata>>8)&255) << 8)
-                    | (((*sdata>>16)&255) << 0) | (((*sdata>>24)&255) << 24);
-            sdata++;
-            tdata++;
-        }
-    }
-
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image.width(), image.height(), 0,
-                 GL_RGBA, GL_UNSIGNED_BYTE, pTexData);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    delete [] pTexData;
+    TextureManager::uploadImage(texture, glImage, mipmaps);
     return texture;
 }
 
@@ -473,12 +669,12 @@ GLint GameInstance::loadGLTexture(QString filename)
 */
 void GameInstance::renderParticleTypes()
 {
-    glDepthMask(GL_FALSE);
-    glDisable(GL_DEPTH_TEST);
+    m_glState->depthMask(false);
+    m_glState->disable(GL_DEPTH_TEST);
 
     // Different smoke type particles. All with smoke program and texture.
-    glUseProgram(m_smallSmokeParticle->m_program);
-    glBindTexture(GL_TEXTURE_2D, m_smallSmokeParticle->m_textureId);
+    // The particle engine binds its own batch program for each render call.
+    m_glState->bindTexture(m_smallSmokeParticle->m_textureId);
 
     m_particleEngine->render(m_smallSmokeParticle,
                              m_smallSmokeParticle->m_program);
@@ -491,16 +687,14 @@ void GameInstance::renderParticleTypes()
                              m_smallSmokeParticle->m_program);
 
     // Fire
-    glUseProgram(m_basicFireParticle->m_program);
-    glBindTexture(GL_TEXTURE_2D, m_basicFireParticle->m_textureId);
+    m_glState->bindTexture(m_basicFireParticle->m_textureId);
     m_particleEngine->render(m_basicFireParticle,
                              m_basicFireParticle->m_program);
 #endif
 
     // The explosion flares without depth testing.
-    glDisable(GL_DEPTH_TEST);
-    glUseProgram(m_explosionFlareParticle->m_program);
-    glBindTexture(GL_TEXTURE_2D, m_explosionFlareParticle->m_textureId);
+    m_glState->disable(GL_DEPTH_TEST);
+    m_glState->bindTexture(m_explosionFlareParticle->m_textureId);
     m_particleEngine->render(m_explosionFlareParticle,
                              m_explosionFlareParticle->m_program);
 }
@@ -534,8 +728,8 @@ void GameInstance::killHelp()
 void GameInstance::initParticles()
 {
     m_basicFireParticle =  new ParticleType(
-                m_particleEngine->normalProgram(),
-                getTextureManager()->getTexture(":/fire_particle.png"));
+                m_particleEngine->normalProgram().program(),
+                texture(TextureFireParticle));
 
     m_basicFireParticle->m_lifeTime = 500;
     m_basicFireParticle->m_lifeTimeRandom = 1000;
@@ -554,8 +748,8 @@ void GameInstance::initParticles()
     m_basicFireParticle->m_additiveParticle = false;
 
     m_smokeParticle = new ParticleType(
-                m_particleEngine->smokeProgram(),
-                getTextureManager()->getTexture(":/smoke1.png"));
+                m_particleEngine->smokeProgram().program(),
+                texture(TextureSmoke));
 
     m_smokeParticle->m_lifeTime = 2000;
     m_smokeParticle->m_lifeTimeRandom = 800;
@@ -573,8 +767,8 @@ void GameInstance::initParticles()
     m_smokeParticle->setColors(0.6f, 0.6f, 0.6f, 0.3f, 0.3f, 0.3f);
 
     m_smallSmokeParticle = new ParticleType(
-                m_particleEngine->smokeProgram(),
-                getTextureManager()->getTexture(":/smoke1.png"));
+                m_particleEngine->smokeProgram().program(),
+                texture(TextureSmoke));
 
     m_smallSmokeParticle->m_lifeTime = 500;
     m_smallSmokeParticle->m_lifeTimeRandom = 1000;
@@ -593,8 +787,8 @@ void GameInstance::initParticles()
     m_smallSmokeParticle->m_turbulenceMul = 8000;
 
     m_dustParticle = new ParticleType(
-                m_particleEngine->smokeProgram(),
-                getTextureManager()->getTexture(":/smoke1.png"));
+                m_particleEngine->smokeProgram().program(),
+                texture(TextureSmoke));
 
     m_dustParticle->m_lifeTime = 4000;
     m_dustParticle->m_lifeTimeRandom = 2000;
@@ -613,8 +807,8 @@ void GameInstance::initParticles()
     m_dustParticle->setColors(0.2f, 0.3f, 0.15f, 0.1f, 0.1f, 0.1f);
 
     m_explosionFlareParticle = new ParticleType(
-                m_particleEngine->normalProgram(),
-                getTextureManager()->getTexture(":/explo_flare1.png"));
+                m_particleEngine->normalProgram().program(),
+                texture(TextureExplosionFlare));
 
     m_explosionFlareParticle->m_additiveParticle = true;
     m_explosionFlareParticle->m_lifeTime = 500;
@@ -631,6 +825,10 @@ void GameInstance::initParticles()
     m_explosionFlareParticle->m_angleIncRandom = 80 << 12;
     m_explosionFlareParticle->m_fadeOutTimeSecs = 1.0f/500.0f;
     m_explosionFlareParticle->setVisibility(0.0f, 0.05f, 1.0f);
+
+    // The flares move ballistically, let the GPU animate them.
+    m_explosionFlareParticle->m_turbulenceMul = 0;
+    m_explosionFlareParticle->m_gpuEvaluated = true;
 }
 
 
@@ -639,12 +837,23 @@ void GameInstance::initParticles()
 */
 void GameInstance::initSamples()
 {
-    m_sampleShoot = GE::AudioBuffer::loadWav(":/cannon.wav");
-    m_sampleExplosion = GE::AudioBuffer::loadWav(":/explosion.wav");
-    m_sampleWhistle = GE::AudioBuffer::loadWav(":/whistle.wav");
-    m_sampleFire = GE::AudioBuffer::loadWav(":/fire.wav");
-    m_sampleHurt = GE::AudioBuffer::loadWav(":/auts.wav");
-    m_sampleBackground = GE::AudioBuffer::loadWav(":/bg_ambient.wav");
+    m_sampleShoot = 0;
+    m_sampleExplosion = 0;
+    m_sampleWhistle = 0;
+    m_sampleFire = 0;
+    m_sampleHurt = 0;
+    m_sampleBackground = 0;
+
+    m_assetLoader->add(new GameSampleAsset(&m_sampleShoot, ":/cannon.wav"));
+    m_assetLoader->add(new GameSampleAsset(&m_sampleExplosion,
+                                           ":/explosion.wav"));
+    m_assetLoader->add(new GameSampleAsset(&m_sampleWhistle, ":/whistle.wav"));
+    m_assetLoader->add(new GameSampleAsset(&m_sampleFire, ":/fire.wav"));
+    m_assetLoader->add(new GameSampleAsset(&m_sampleHurt, ":/auts.wav"));
+
+    // The background ambient noise loops forever from when it is loaded.
+    m_assetLoader->add(new GameSampleAsset(&m_sampleBackground,
+                                           ":/bg_ambient.wav", m_mixer));
 }
 
 
@@ -658,14 +867,14 @@ void GameInstance::recreateHelp()
 
     // Create the tip box.
     m_tip = m_objManager->addObject(
-        new GameUIObject(this, getTextureManager()->getTexture(":/tip.png")));
+        new GameUIObject(this, textureRegion(TextureTip)));
     m_tip->setRunEnabled(false);
     m_tip->setDepthEnabled(false);
     m_tip->setr(2.7f);
     m_tip->setAspect(0.5f);
 
     m_indicatorCircle = m_objManager->addObject(
-        new GameUIObject(this, getTextureManager()->getTexture(":/indicator.png")));
+        new GameUIObject(this, textureRegion(TextureIndicator)));
     m_indicatorCircle->setRunEnabled(false);
     m_indicatorCircle->setDepthEnabled(false);
     m_indicatorCircle->setr(2.0f);
@@ -680,7 +889,7 @@ GameObject *GameInstance::placeTree()
 {
     GameObject *tree =
         m_objManager->addObject(
-            new GameTree(this, getTextureManager()->getTexture(":/tree1.png")));
+            new GameTree(this, textureRegion(TextureTree)));
 
     float x;
     QVector3D vec;
@@ -689,7 +898,7 @@ GameObject *GameInstance::placeTree()
     while (1) {
         x = GAME_LEVEL_START_X
             + (GAME_LEVEL_END_X - GAME_LEVEL_START_X)
-            * (float)(rand() & 1023) / 1023.0f;
+            * (float)(m_random->next() & 1023) / 1023.0f;
         float height = m_level->getHeightAndNormalAt(x, &vec);
 
         if (vec.y() > 0.75f && height > -0.3f)
@@ -703,7 +912,7 @@ GameObject *GameInstance::placeTree()
 
     tree->pos().setX(x);
     tree->pos().setY(5.0f);
-    tree->pos().setZ(-0.5f + (float)(rand() & 255) / 255.0f * 0.3f);
+    tree->pos().setZ(-0.5f + (float)m_random->byte() / 255.0f * 0.3f);
     return tree;
 }
 
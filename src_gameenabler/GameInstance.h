@@ -9,20 +9,36 @@
 #include <GLES2/gl2.h>
 #include <QMatrix4x4>
 
+#include "TextureManager.h"
+
 #include "gamewindow.h"
 
 #define GAME_NOF_PLAYERS 2
 #define GAME_MAX_PARTICLES 512
 
+// Texture of the menus, loaded before the other assets
+#define GAME_MENU_TEXTURE ":/texts.png"
+
+// Define QOTH_RANDOM_SEED to start every run from the same random sequence,
+// e.g. for replays and benchmarks. Otherwise the seed is taken from the
+// clock.
+
+// Define QOTH_LEVEL_FILE as the name of a level file written by
+// GameLevel::save() to play that level instead of a generated one.
+
 // Forward declarations
 class GameLevel;
 class GameMenu;
 class GameObject;
+class GameAssetLoader;
+class GameGLState;
+class GameJobPool;
 class GameObjectManager;
 class GamePlayer;
+class GameProgramCache;
+class GameRandom;
 class ParticleEngine;
 class ParticleType;
-class TextureManager;
 
 namespace GE {
     class AudioBuffer;
@@ -37,6 +53,30 @@ public:
     GameInstance(int width, int height, GE::GameWindow *gameWindow);
     ~GameInstance();
 
+public: // Data types
+    // The images preloaded by the game instance, see texture()
+    enum GameTexture {
+        // Sprites packed into the atlas
+        TextureAmmo,
+        TextureArrowDown,
+        TextureGun,
+        TextureIndicator,
+        TexturePlayer,
+        TexturePlayerHead,
+        TextureTip,
+        TextureTree,
+        TextureTreePart,
+        AtlasTextureCount,
+
+        // Textures of their own
+        TextureExplosionFlare = AtlasTextureCount,
+        TextureFireParticle,
+        TextureGround,
+        TextureRockWall,
+        TextureSmoke,
+        GameTextureCount
+    };
+
 public:
     inline GE::AudioMixer *getMixer() { return m_mixer; }
 
@@ -56,9 +96,25 @@ public:
 
     inline GameLevel *getLevel() { return m_level; }
     inline ParticleEngine *getParticleEngine() { return m_particleEngine; }
+    inline GameRandom *getRandom() { return m_random; }
+    inline GameJobPool *getJobPool() { return m_jobPool; }
+    inline GameAssetLoader *getAssetLoader() { return m_assetLoader; }
+    inline GameGLState *getGLState() { return m_glState; }
+    inline GameProgramCache *getProgramCache() { return m_programCache; }
     inline GameObjectManager *getObjectManager() { return m_objManager; }
     inline GamePlayer *getPlayer(int index) { return m_players[index]; }
     inline TextureManager *getTextureManager() { return m_textureManager; }
+
+    inline GLuint texture(GameTexture texture) const
+    {
+        return m_textureManager->texture(m_textures[texture]);
+    }
+
+    inline TextureManager::STextureRegion textureRegion(
+            GameTexture texture) const
+    {
+        return m_textureManager->region(m_textures[texture]);
+    }
     inline void markFireBurning() { m_fireTargetVolume = 1.0f; }
 
     int run(float frameTime, int m_playerTurn);
@@ -69,7 +125,29 @@ public:
 
     void setSize(int width, int height);
     void cameraTransform(float *m, bool transformPosition = true);
-    static GLint loadGLTexture(QString fileName);
+
+    // Returns false if the sphere at (x, y, z) with radius r is completely
+    // outside of the view frustum.
+    inline bool isSphereVisible(float x, float y, float z, float r) const {
+        for (int f = 0; f < 6; f++) {
+            if (m_frustum[f][0] * x + m_frustum[f][1] * y
+                    + m_frustum[f][2] * z + m_frustum[f][3] < -r)
+                return false;
+        }
+
+        return true;
+    }
+
+    // Number of sprites and particles drawn and culled since the last reset
+    inline void addRenderCounts(int drawn, int culled) {
+        m_drawnCount += drawn;
+        m_culledCount += culled;
+    }
+    inline int drawnCount() const { return m_drawnCount; }
+    inline int culledCount() const { return m_culledCount; }
+    void resetRenderCounts();
+    static GLint loadGLTexture(QString fileName, bool mipmaps = false);
+    static GLint createGLTexture(const QImage &image, bool mipmaps = false);
     void renderParticleTypes();
 
     inline GameObject *indicatorArrow() { return m_indicatorArrow; }
@@ -80,6 +158,7 @@ public:
     void resetShowHelpTimer() { m_showHelpTimer = 0.0f; }
 
 protected:
+    void updateFrustum();
     void initParticles();
     void initSamples();
     void recreateHelp();
@@ -110,9 +189,15 @@ protected: // Data
     GameObject *m_indicatorArrow;
     GameObject *m_indicatorCircle;
     GameObject *m_activePlayerIndicatorCircle;
+    GameAssetLoader *m_assetLoader; // Owned
     TextureManager *m_textureManager; // Owned
+    int m_textures[GameTextureCount]; // Handles in m_textureManager
     GameLevel *m_level; // Owned
     ParticleEngine *m_particleEngine; // Owned
+    GameRandom *m_random; // Owned
+    GameJobPool *m_jobPool; // Owned
+    GameGLState *m_glState; // Owned
+    GameProgramCache *m_programCache; // Owned
     GameObjectManager *m_objManager; // Owned
     GamePlayer *m_players[GAME_NOF_PLAYERS];
     float m_helpAngle;
@@ -127,6 +212,11 @@ protected: // Data
     float m_arrowAngle;
     float m_cameraMatrix[16];
     float m_projectionMatrix[16];
+
+    // View frustum planes in world space, normals pointing inwards
+    float m_frustum[6][4];
+    int m_drawnCount;
+    int m_culledCount;
 };
 
 
@@ -10,6 +10,7 @@
 #include <QVector3D>
 
 #include "gamewindow.h"
+#include "GameProgram.h"
 
 #define SELECT_PLAYER_DISTANCE 3.0f
 #define BACKGROUND_LAYER_COUNT 9
@@ -97,9 +98,7 @@ protected: // Data
     float m_bgAngle;
 
     // Clouds
-    GLuint m_fragmentShader;
-    GLuint m_vertexShader;
-    GLuint m_program;
+    GameProgram m_program;
     GLuint m_cloudTexture;
     float m_cloudPos;
 
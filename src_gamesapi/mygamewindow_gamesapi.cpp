@@ -12,17 +12,20 @@
 #include <QtGui>
 #include <QtGui/QTouchEvent>
 #include <QMatrix4x4>
-#include <QTime>
 #include <math.h>
 
 #include "audiobuffer.h"
 #include "pushaudioout.h"
 #include "trace.h"
 
+#include "GameAssetLoader.h"
+#include "GameGLState.h"
 #include "GameInstance.h"
 #include "GameLevel.h"
 #include "GameMenu.h"
 #include "GamePlayer.h"
+#include "GameProgramCache.h"
+#include "GameRandom.h"
 #include "mygamewindoweventfilter_gamesapi.h"
 #include "ParticleEngine.h"
 #include "TextureManager.h"
@@ -62,6 +65,8 @@ const char* strVertexShader =
          "texCoord = vertex.xz*0.02;\n"
     "}";
 
+static const char *cloudAttributes[] = { "vertex", "uv" };
+
 
 // INSERT breakpoint here to debug OpenGL ES error cases
 //
@@ -188,7 +193,6 @@ MyGameApplication::MyGameApplication(int &argc, char **argv, int version)
     // Set window title
     gles2->GetWidget()->setWindowTitle(tr("ES test"));
 
-    srand(QTime::currentTime().msec());
     m_muted = isProfileSilent();
     onCreate();
 
@@ -602,15 +606,16 @@ void MyGameApplication::updateGame(const float fFrameDeltaOld)
 */
 void MyGameApplication::renderClouds()
 {
-    glDisable(GL_BLEND);
-    glDisable(GL_DEPTH_TEST);
-    glDepthMask(GL_FALSE);
-    glUseProgram(m_program);
-    glBindTexture(GL_TEXTURE_2D, m_cloudTexture);
-    glUniformMatrix4fv(glGetUniformLocation(m_program, "projMatrix"), 1,
+    GameGLState *glState = m_gameInstance->getGLState();
+    glState->disable(GL_BLEND);
+    glState->disable(GL_DEPTH_TEST);
+    glState->depthMask(false);
+    glState->useProgram(m_program);
+    glState->bindTexture(m_cloudTexture);
+    glUniformMatrix4fv(m_program.location(GameProgram::ProjMatrix), 1,
                        GL_FALSE, m_gameInstance->getProjectionMatrix());
-    glUniform1i(glGetUniformLocation(m_program, "sampler2d"), 0);
-    glEnableVertexAttribArray(0);
+    glState->bindBuffer(GL_ARRAY_BUFFER, 0);
+    glState->setVertexAttribArrays(0x1);
 
     // Pass the vertex data
     GLfloat vertices[] = { -50.0f, 0.0f, -50.0f, 50.0f, 0.0f, -50.0f,
@@ -626,7 +631,7 @@ void MyGameApplication::renderClouds()
     id[7] = -2.0f;
     m_gameInstance->cameraTransform(id);
 
-    glUniformMatrix4fv(glGetUniformLocation(m_program, "transMatrix"), 1,
+    glUniformMatrix4fv(m_program.location(GameProgram::TransMatrix), 1,
                        GL_FALSE, id);
 
     GLfloat col[4];
@@ -634,8 +639,7 @@ void MyGameApplication::renderClouds()
     col[1] = m_cloudPos * 0.2f;
     col[2] = 1.0f;
     col[3] = 1.0f;
-    int colorLocation = glGetUniformLocation(m_program, "pcol");
-    glUniform4fv(colorLocation, 1, col);
+    glUniform4fv(m_program.location(GameProgram::Color), 1, col);
     glDrawArrays(GL_TRIANGLE_FAN, 0,4);
 
     // Upside
@@ -646,7 +650,7 @@ void MyGameApplication::renderClouds()
     id[15] = 1.0f;
     id[7] = 4.0f;
     m_gameInstance->cameraTransform(id, false);
-    glUniformMatrix4fv(glGetUniformLocation(m_program, "transMatrix"), 1,
+    glUniformMatrix4fv(m_program.location(GameProgram::TransMatrix), 1,
                        GL_FALSE, id);
 
     glDrawArrays(GL_TRIANGLE_FAN, 0,4);
@@ -658,17 +662,18 @@ void MyGameApplication::renderClouds()
 */
 void MyGameApplication::renderBg()
 {
-    glEnable(GL_DEPTH_TEST);
-    glDepthMask(GL_FALSE);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    GLuint program = m_gameInstance->getParticleEngine()->normalProgram();
-    glUseProgram(program);
-    glUniformMatrix4fv(glGetUniformLocation(program, "projMatrix"), 1,
+    GameGLState *glState = m_gameInstance->getGLState();
+    glState->enable(GL_DEPTH_TEST);
+    glState->depthMask(false);
+    glState->enable(GL_BLEND);
+    glState->blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    const GameProgram &program =
+            m_gameInstance->getParticleEngine()->normalProgram();
+    glState->useProgram(program);
+    glUniformMatrix4fv(program.location(GameProgram::ProjMatrix), 1,
                        GL_FALSE, m_gameInstance->getProjectionMatrix());
-    glUniform1i(glGetUniformLocation(program, "sampler2d"), 0);
-    glEnableVertexAttribArray(0);
-    glDisableVertexAttribArray(1);
+    glState->bindBuffer(GL_ARRAY_BUFFER, 0);
+    glState->setVertexAttribArrays(0x1);
 
     GLfloat vertices[] = { -1.0f, -1.0f, 0.0f, 1.0f, -1.0f, 0.0f,
                            1.0f, 1.0f, 0.0f, -1.0f, 1.0f, 0.0f };
@@ -679,12 +684,11 @@ void MyGameApplication::renderBg()
     col[1] = 1.0f;
     col[2] = 1.0f;
     col[3] = 1.0f;
-    int colorLocation = glGetUniformLocation(program, "pcol");
-    glUniform4fv(colorLocation, 1, col);
+    glUniform4fv(program.location(GameProgram::Color), 1, col);
     float id[16];
 
     for (int f = 0; f < BACKGROUND_LAYER_COUNT; f++) {
-        glBindTexture(GL_TEXTURE_2D, m_bgLayers[f].texture);
+        glState->bindTexture(m_bgLayers[f].texture);
         memset(id, 0, sizeof(float) * 16);
         id[0] = m_bgLayers[f].xsize;
         id[5] = m_bgLayers[f].ysize;
@@ -700,7 +704,7 @@ void MyGameApplication::renderBg()
         }
 
         m_gameInstance->cameraTransform(id);
-        glUniformMatrix4fv(glGetUniformLocation(program, "transMatrix"), 1,
+        glUniformMatrix4fv(program.location(GameProgram::TransMatrix), 1,
                            GL_FALSE, id);
         glDrawArrays(GL_TRIANGLE_FAN, 0,4);
     }
@@ -711,10 +715,11 @@ void MyGameApplication::renderBg()
 */
 void MyGameApplication::renderStaticButtons()
 {
-    GLuint program = m_gameInstance->getObjectManager()->m_program;
-    glUseProgram(program);
-    glDisable(GL_DEPTH_TEST);
-    glDepthMask(GL_FALSE);
+    const GameProgram &program = m_gameInstance->getObjectManager()->m_program;
+    GameGLState *glState = m_gameInstance->getGLState();
+    glState->useProgram(program);
+    glState->disable(GL_DEPTH_TEST);
+    glState->depthMask(false);
 
     float m[16];
     memset(m, 0, sizeof(float) * 16);
@@ -722,14 +727,13 @@ void MyGameApplication::renderStaticButtons()
     m[5] = 1.0f;
     m[10] = 1.0f;
     m[15] = 1.0f;
-    glUniformMatrix4fv(glGetUniformLocation(program, "projMatrix"),
+    glUniformMatrix4fv(program.location(GameProgram::ProjMatrix),
                        1, GL_FALSE, m);//m_gameInstance->getProjectionMatrix());
-    glUniform1i(glGetUniformLocation(program, "sampler2d"), 0);
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
-    glBindTexture(GL_TEXTURE_2D, m_buttonsTexture);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
+    glState->bindBuffer(GL_ARRAY_BUFFER, 0);
+    glState->setVertexAttribArrays(0x3);
+    glState->bindTexture(m_buttonsTexture);
+    glState->enable(GL_BLEND);
+    glState->blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
     GLfloat col[4];
     col[0] = 1.0f;
@@ -774,14 +778,15 @@ void MyGameApplication::renderStaticButtons()
         m[4] = -m[1];
         m[5] = m[0];
 
-        glUniform4fv(glGetUniformLocation(program, "pcol"), 1, col);
+        glUniform4fv(program.location(GameProgram::Color), 1, col);
         GLfloat texCoords[] = { 0.0f, (float)(m_prevButton + 1) / 3.0f,
                                 1.0f, (float)(m_prevButton + 1) / 3.0f,
                                 1.0f, (float)m_prevButton / 3.0f,
                                 0.0f, (float)m_prevButton / 3.0f };
 
         glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, texCoords);
-        glUniformMatrix4fv(glGetUniformLocation(program, "transMatrix"), 1, GL_FALSE, m);
+        glUniformMatrix4fv(program.location(GameProgram::TransMatrix), 1,
+                           GL_FALSE, m);
         glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
     }
 
@@ -790,19 +795,18 @@ void MyGameApplication::renderStaticButtons()
     m[1] = 0.0f;
     m[4] = -m[1];
     m[5] = m[0];
-    glUniform4fv(glGetUniformLocation(program, "pcol"), 1, col);
+    glUniform4fv(program.location(GameProgram::Color), 1, col);
     GLfloat texCoords[] = { 0.0f, (float)(m_currentButton + 1) / 3.0f,
                             1.0f, (float)(m_currentButton + 1) / 3.0f,
                             1.0f, (float)m_currentButton / 3.0f,
                             0.0f, (float)m_currentButton / 3.0f};
 
     glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, texCoords);
-    glUniformMatrix4fv(glGetUniformLocation(program, "transMatrix"), 1, GL_FALSE, m);
+    glUniformMatrix4fv(program.location(GameProgram::TransMatrix), 1,
+                       GL_FALSE, m);
 
     // Render the quad
     glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
-    glDisableVertexAttribArray(1);
-    glDisableVertexAttribArray(1);
 }
 
 
@@ -822,11 +826,16 @@ void MyGameApplication::renderFrame()
                   m_cameraYTarget + m_cameraYOffset + t,m_cameraZPos);
     cam.rotate(m_cameraXAngle, 0.0f, 1.0f, 0.0f);
     m_gameInstance->setCamera(cam);
+    m_gameInstance->resetRenderCounts();
+
+    // Upload the assets loaded in the background since the previous frame.
+    m_gameInstance->getAssetLoader()->dispatch();
+    m_gameInstance->getGLState()->beginFrame();
 
     // Clear background and depth buffer
     glClearColor(0.46f, 0.58f, 0.87f, 0.0f);
     glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    m_gameInstance->getGLState()->bindBuffer(GL_ARRAY_BUFFER, 0);
 
     renderClouds();
 
@@ -855,7 +864,18 @@ void MyGameApplication::renderFrame()
 
     //renderHelp();
 
-    glDepthMask(GL_TRUE);
+    m_gameInstance->getGLState()->depthMask(true);
+
+#ifdef QOTH_MEASURE_CULLING
+    qDebug() << "drawn:" << m_gameInstance->drawnCount()
+             << "culled:" << m_gameInstance->culledCount();
+#endif
+
+#ifdef QOTH_COUNT_GL_CALLS
+    qDebug() << "GL calls:" << GameGLState::s_callCount
+             << "state changes:" << m_gameInstance->getGLState()->issuedCount()
+             << "filtered:" << m_gameInstance->getGLState()->filteredCount();
+#endif
 }
 
 
@@ -866,34 +886,35 @@ int MyGameApplication::onCreate()
     DEBUG_POINT;
 
 
-    if (!GE::GameWindow::glhelpCreateShader( m_vertexShader, m_fragmentShader, m_program, strVertexShader, strFragmentShader)) {
-        DEBUG_INFO("MyGameApplication: Failed to create shader program.");
-    }
-    // Bind the custom vertex attributes
-    glBindAttribLocation(m_program, 0, "vertex");
-    glBindAttribLocation(m_program, 1, "uv");
+    m_gameInstance = new GameInstance(width(), height(), &m_mixer );
 
+    m_program.setProgram(m_gameInstance->getProgramCache()->program(
+            strVertexShader, strFragmentShader, cloudAttributes, 2));
 
-    m_gameInstance = new GameInstance(width(), height(), &m_mixer );
+    if (!m_program.program())
+        DEBUG_INFO("MyGameApplication: Failed to create shader program.");
 
     m_cloudTexture =
             m_gameInstance->getTextureManager()->getTexture(":/clouds.png");
 
-    // Setup the background layers
+    // Setup the background layers. They are drawn small in the distance,
+    // so their textures are minified through mipmaps.
+    GameRandom *random = m_gameInstance->getRandom();
+
     for (int f = 0; f < BACKGROUND_LAYER_COUNT; f++) {
         m_bgLayers[f].pos[0] =
                 ((float)cosf((float)(f) / (BACKGROUND_LAYER_COUNT - 1)
                              * 3.14159f * 2.0f * 1.5f)
-                * 1.4f + ((rand() & 255) / 255.0f - 0.5f) / 2.0f)
+                * 1.4f + (random->unit() - 0.5f) / 2.0f)
                 * (float)((BACKGROUND_LAYER_COUNT - f) + 10) * 2.0f;
 
         m_bgLayers[f].pos[1] = -3.0f + (float)f
-                + ((float)(rand() & 255) / 255.0f - 0.5f) * 1.0f;
+                + (random->unit() - 0.5f) * 1.0f;
         m_bgLayers[f].pos[2] = -40.0f + (float)f * 4.0f;
 
         if (f < 3) {
             m_bgLayers[f].texture =
-                    m_gameInstance->getTextureManager()->getTexture(":/bg2.png");
+                    m_gameInstance->getTextureManager()->getTexture(":/bg2.png", true);
             m_bgLayers[f].xsize = 30.0f;
             m_bgLayers[f].ysize = 15.0f;
             m_bgLayers[f].pos[1] += 10.0f;
@@ -901,19 +922,19 @@ int MyGameApplication::onCreate()
         else {
             if (f < 6) {
                 m_bgLayers[f].texture =
-                        m_gameInstance->getTextureManager()->getTexture(":/bg0.png");
+                        m_gameInstance->getTextureManager()->getTexture(":/bg0.png", true);
                 m_bgLayers[f].xsize = 20.0f;
                 m_bgLayers[f].ysize = 10.0f;
            } else {
                 m_bgLayers[f].texture =
-                        m_gameInstance->getTextureManager()->getTexture(":/bg1.png");
+                        m_gameInstance->getTextureManager()->getTexture(":/bg1.png", true);
                 m_bgLayers[f].pos[1] -= 2.0f;
-                m_bgLayers[f].xsize = 10.0f + (float)(rand() & 255) / 64.0f;
-                m_bgLayers[f].ysize = 6.0f + (float)(rand() & 255) / 64.0f;
+                m_bgLayers[f].xsize = 10.0f + (float)random->byte() / 64.0f;
+                m_bgLayers[f].ysize = 6.0f + (float)random->byte() / 64.0f;
             }
         }
 
-        if ((rand() & 255) < 128)
+        if (random->byte() < 128)
             m_bgLayers[f].xsize *= -1.0f;
     }
 
@@ -994,10 +1015,6 @@ void MyGameApplication::onResume()
 */
 void MyGameApplication::onDestroy()
 {
-    glDeleteProgram(m_program);
-    glDeleteShader(m_fragmentShader);
-    glDeleteShader(m_vertexShader);
-
     delete m_beat1;
     delete m_gameInstance;
 }
@@ -14,6 +14,7 @@
 #include <QWidget>
 #include <QApplication>
 #include "qgameopengles2.h"
+#include "GameProgram.h"
 
 
 #define SELECT_PLAYER_DISTANCE 3.0f
@@ -127,9 +128,7 @@ protected: // Data
     float m_bgAngle;
 
     // Clouds
-    GLuint m_fragmentShader;
-    GLuint m_vertexShader;
-    GLuint m_program;
+    GameProgram m_program;
     GLuint m_cloudTexture;
     float m_cloudPos;
 
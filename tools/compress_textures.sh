@@ -0,0 +1,69 @@
+#!/bin/sh
+# Copyright (c) 2011-2014 Microsoft Mobile.
+#
+# Compresses the large textures of images/ into GPU compressed formats.
+# The results are written into images/compressed/ together with
+# compressed.qrc, which the project files pick up when it exists. At run
+# time TextureManager loads e.g. ground.pvrtc.ktx instead of ground.png
+# when the GL supports the format.
+#
+# Needs PVRTexToolCLI of the PowerVR SDK (http://www.imgtec.com), either in
+# PATH or given in the PVRTEXTOOL environment variable.
+#
+# Usage: tools/compress_textures.sh
+
+PVRTEXTOOL=${PVRTEXTOOL:-PVRTexToolCLI}
+
+cd "$(dirname "$0")/../images" || exit 1
+
+if ! command -v "$PVRTEXTOOL" > /dev/null 2>&1; then
+    echo "$PVRTEXTOOL not found, set PVRTEXTOOL to point to it." >&2
+    exit 1
+fi
+
+mkdir -p compressed
+
+# Image, formats and whether mipmaps are made. ETC1 has no alpha channel,
+# so only the opaque images are compressed to it. PVRTC 4 bpp keeps the
+# alpha, e.g. the snow mask of the ground and the edges of the layers.
+MANIFEST="
+bg0.png         pvrtc       mipmaps
+bg1.png         pvrtc       mipmaps
+bg2.png         pvrtc       mipmaps
+clouds.png      pvrtc,etc1  -
+ground.png      pvrtc       -
+rock_wall.png   pvrtc       -
+"
+
+QRC=compressed/compressed.qrc
+echo "<RCC>" > $QRC
+echo "    <qresource prefix=\"/\">" >> $QRC
+
+echo "$MANIFEST" | while read image formats mipmaps; do
+    [ -z "$image" ] && continue
+
+    base=${image%.png}
+    mipmapFlag=""
+    [ "$mipmaps" = "mipmaps" ] && mipmapFlag="-m"
+
+    for format in $(echo $formats | tr ',' ' '); do
+        case $format in
+            pvrtc) options="-f PVRTC1_4 -q pvrtcbest" ;;
+            etc1)  options="-f ETC1 -q etcslowperceptual" ;;
+        esac
+
+        output=compressed/$base.$format.ktx
+        echo "$image -> $output"
+
+        if ! "$PVRTEXTOOL" -i "$image" -o "$output" $options $mipmapFlag \
+                > /dev/null; then
+            echo "Failed to compress $image" >&2
+            exit 1
+        fi
+
+        echo "        <file>$base.$format.ktx</file>" >> $QRC
+    done
+done || exit 1
+
+echo "    </qresource>" >> $QRC
+echo "</RCC>" >> $QRC